@@ -0,0 +1,125 @@
+/*
+ * adaptive.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "adaptive.h"
+
+void pixel_stats_add(pixel_stats_t *stats, dbl_pixel_t *clr)
+{
+    double lum = 0.299*clr->r + 0.587*clr->g + 0.114*clr->b;
+
+    stats->sum.r += clr->r;
+    stats->sum.g += clr->g;
+    stats->sum.b += clr->b;
+    stats->sum.a += clr->a;
+    stats->lum += lum;
+    stats->lum_sqr += lum*lum;
+    stats->n += 1;
+}
+
+void pixel_stats_mean(pixel_stats_t *stats, dbl_pixel_t *clr)
+{
+    if( stats->n < 1 ) {
+        clr->r = clr->g = clr->b = 0.0;
+        clr->a = 1.0;
+        return;
+    }
+
+    clr->r = stats->sum.r / stats->n;
+    clr->g = stats->sum.g / stats->n;
+    clr->b = stats->sum.b / stats->n;
+    clr->a = stats->sum.a / stats->n;
+}
+
+/* standard error of the pixel's mean luminance */
+double pixel_stats_error(pixel_stats_t *stats)
+{
+    int n = stats->n;
+    if( n < 2 )
+        return 1.0;
+
+    double var = (stats->lum_sqr - stats->lum*stats->lum/n) / (n-1);
+    if( var <= 0.0 )
+        return 0.0;
+
+    return sqrt(var/n);
+}
+
+/* budget tiles matching the scheduler's, in the same order */
+int adapt_tiles_init(adapt_tile_t **tiles, render_tile_t *src, int num)
+{
+    *tiles = calloc(num > 0 ? num : 1, sizeof(adapt_tile_t));
+    if( *tiles == NULL ) {
+        fprintf(stderr, "%s: failed to allocate %i tiles.\n", __FUNCTION__, num);
+        return -1;
+    }
+
+    for(int t=0; t<num; ++t) {
+        (*tiles)[t].x = src[t].x;
+        (*tiles)[t].y = src[t].y;
+        (*tiles)[t].w = src[t].w;
+        (*tiles)[t].h = src[t].h;
+    }
+
+    return num;
+}
+
+/*
+ * Measure each tile's remaining error and hand out one round of samples in
+ * proportion to it.  A round is as many samples as the unconverged pixels
+ * already hold (so their error shrinks geometrically), capped at limit
+ * when limit >= 0.  Every tile with an unconverged pixel gets at least one
+ * sample per such pixel, so a round always makes progress.
+ * Returns the number of samples granted, 0 once every pixel has converged.
+ */
+long adapt_tiles_budget(adapt_tile_t *tiles, int num, pixel_stats_t *stats,
+                        int width, double max_error, long limit)
+{
+    double total_error = 0.0;
+    long budget = 0;
+
+    for(int t=0; t<num; ++t) {
+        adapt_tile_t *tile = &tiles[t];
+        tile->error = 0.0;
+        tile->active = 0;
+        tile->budget = 0;
+
+        for(int j=tile->y; j<tile->y+tile->h; ++j) {
+            for(int i=tile->x; i<tile->x+tile->w; ++i) {
+                pixel_stats_t *ps = &stats[j*width+i];
+                if( ps->n >= ADAPT_MAX_PIXEL_SAMPLES )
+                    continue;
+                double err = pixel_stats_error(ps);
+                if( err <= max_error )
+                    continue;
+                tile->error += err;
+                tile->active += 1;
+                budget += ps->n;
+            }
+        }
+        total_error += tile->error;
+    }
+
+    if( total_error <= 0.0 )
+        return 0;
+    if( limit >= 0 && budget > limit )
+        budget = limit;
+
+    long granted = 0;
+    for(int t=0; t<num; ++t) {
+        adapt_tile_t *tile = &tiles[t];
+        if( tile->active == 0 )
+            continue;
+        tile->budget = (long)(budget * (tile->error / total_error));
+        if( tile->budget < tile->active )
+            tile->budget = tile->active;
+        granted += tile->budget;
+    }
+
+    return granted;
+}
@@ -0,0 +1,41 @@
+/*
+ * adaptive.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+#include "image.h"
+#include "tiles.h"
+
+/* samples needed before a pixel's variance estimate is trusted */
+#define ADAPT_MIN_SAMPLES 4
+/* hard cap on samples for any one pixel */
+#define ADAPT_MAX_PIXEL_SAMPLES 10000
+
+/* running sums for one pixel's samples */
+typedef struct pixel_stats {
+    dbl_pixel_t sum;    /* summed sample colours */
+    double lum;         /* summed luminance */
+    double lum_sqr;     /* summed squared luminance */
+    int n;              /* samples taken, also the next sample's index */
+} pixel_stats_t;
+
+/* one tile's share of an adaptive round */
+typedef struct adapt_tile {
+    int x, y;           /* top left pixel */
+    int w, h;
+    double error;       /* summed standard error of unconverged pixels */
+    int active;         /* unconverged pixels */
+    long budget;        /* samples granted this round */
+} adapt_tile_t;
+
+void pixel_stats_add(pixel_stats_t *stats, dbl_pixel_t *clr);
+void pixel_stats_mean(pixel_stats_t *stats, dbl_pixel_t *clr);
+double pixel_stats_error(pixel_stats_t *stats);
+
+int adapt_tiles_init(adapt_tile_t **tiles, render_tile_t *src, int num);
+long adapt_tiles_budget(adapt_tile_t *tiles, int num, pixel_stats_t *stats,
+                        int width, double max_error, long limit);
+#endif /* ADAPTIVE_H */
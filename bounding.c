@@ -6,11 +6,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <pthread.h>
 #include "object.h"
 #include "bounding.h"
-#include "nelder-mead.h"
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -174,67 +175,107 @@ int bounds_list_radius(bounds_list *list, vectNd *centroid, double *radius) {
     return 0;
 }
 
-int bounds_list_optimal(bounds_list *list, vectNd *centroid, double *radius) {
-    int dim = centroid->n;
-    void *nm = NULL;
-    double curr_radius = -1.0;
-    vectNd curr_centroid;
-
-    /* initialize Nelder Mead */
-    nm_init(&nm, dim);
-
-    /* get initial guess for center */
-    vectNd_calloc(&curr_centroid, dim);
-    bounds_list_centroid(list, &curr_centroid);
-    bounds_list_radius(list, &curr_centroid, &curr_radius);
-    nm_set_seed(nm, &curr_centroid);
-
-    /* store initial result for comparison */
-    vectNd initial;
-    vectNd_calloc(&initial, dim);
-    vectNd_copy(&initial, &curr_centroid);
-    double initial_radius = curr_radius;
-
-    int max_iterations = 1000;
-    while( !nm_done(nm, EPSILON, max_iterations) ) {
-        nm_add_result(nm, &curr_centroid, curr_radius);
-        nm_next_point(nm, &curr_centroid);
-        bounds_list_radius(list, &curr_centroid, &curr_radius);
+/* Badoiu-Clarkson: repeatedly step the center toward the farthest point of
+ * the farthest ball, with step 1/(i+1).  After i steps the radius is within
+ * a factor of (1+1/sqrt(i)) of the minimum, and in practice much closer. */
+/* see: https://doi.org/10.1016/j.comgeo.2007.04.002 */
+int bounds_ball(double *points, double *radii, int num, int dim, double *center, double *radius) {
+    if( num <= 0 )
+        return -1;
+
+    /* exact answers for one or two balls */
+    memcpy(center, points, dim*sizeof(double));
+    *radius = radii ? fabs(radii[0]) : 0.0;
+    if( num == 1 )
+        return 0;
+    if( num == 2 ) {
+        double *p1 = points + dim;
+        double r1 = radii ? fabs(radii[1]) : 0.0;
+        double dist = 0.0;
+        for(int k=0; k<dim; ++k)
+            dist += (p1[k]-center[k])*(p1[k]-center[k]);
+        dist = sqrt(dist);
+        if( dist + r1 <= *radius )
+            return 0;
+        if( dist + *radius <= r1 ) {
+            memcpy(center, p1, dim*sizeof(double));
+            *radius = r1;
+            return 0;
+        }
+        double new_radius = (dist + *radius + r1) / 2.0;
+        double t = (new_radius - *radius) / dist;
+        for(int k=0; k<dim; ++k)
+            center[k] += t*(p1[k]-center[k]);
+        *radius = new_radius;
+        return 0;
     }
 
-    /* get final result */
-    nm_best_point(nm, &curr_centroid);
-    bounds_list_radius(list, &curr_centroid, &curr_radius);
-
-    /* double check that it is an improvement */
-    if( curr_radius - initial_radius > EPSILON ) {
-        printf("%s: final radius (%g) is greater than initial radius (%g).\n", __FUNCTION__, curr_radius, initial_radius);
-        printf("bounding points:\n");
-        bounds_node *curr = list->head;
-        while(curr) {
-            vectNd_print(&curr->bounds.center, "\t");
-            curr = curr->next;
+    double *curr = calloc(dim, sizeof(double));
+    memcpy(curr, points, dim*sizeof(double));
+    double best = INFINITY;
+    for(int i=1; i<=BOUNDS_BALL_ITERATIONS; ++i) {
+        /* find the ball whose far side is farthest from the current center */
+        int far = 0;
+        double far_dist = -1.0, far_reach = -1.0;
+        for(int j=0; j<num; ++j) {
+            double *p = points + (size_t)j*dim;
+            double dist = 0.0;
+            for(int k=0; k<dim; ++k)
+                dist += (p[k]-curr[k])*(p[k]-curr[k]);
+            dist = sqrt(dist);
+            double reach = dist + (radii ? fabs(radii[j]) : 0.0);
+            if( reach > far_reach ) {
+                far_reach = reach;
+                far_dist = dist;
+                far = j;
+            }
+        }
+
+        if( far_reach < best ) {
+            best = far_reach;
+            memcpy(center, curr, dim*sizeof(double));
+        }
+
+        /* step toward the extreme point on the farthest ball */
+        double *p = points + (size_t)far*dim;
+        double r = radii ? fabs(radii[far]) : 0.0;
+        double scale = (far_dist > 0.0) ? (far_dist + r) / far_dist : 1.0;
+        for(int k=0; k<dim; ++k) {
+            double extreme = curr[k] + (p[k]-curr[k])*scale;
+            if( far_dist <= 0.0 && k == 0 )
+                extreme += r;
+            curr[k] += (extreme - curr[k]) / (i+1);
         }
-        vectNd_copy(&curr_centroid, &initial);
-        bounds_list_radius(list, &curr_centroid, &curr_radius);
     }
+    free(curr); curr = NULL;
+
+    *radius = best;
+
+    return 0;
+}
+
+int bounds_list_optimal(bounds_list *list, vectNd *centroid, double *radius) {
+    int dim = centroid->n;
 
-    #if 0
-    if( initial_radius != curr_radius ) {
-        printf("\n%s: initial radius: %g\n", __FUNCTION__, initial_radius);
-        printf("%s:   final radius: %g\n", __FUNCTION__, curr_radius);
-        printf("%s: change: %g%%\n", __FUNCTION__, 100.0 * (initial_radius-curr_radius) / initial_radius);
+    /* copy list into contiguous arrays */
+    int num = 0;
+    for(bounds_node *curr = list->head; curr!=NULL; curr = curr->next)
+        ++num;
+    if( num == 0 )
+        return -1;
+
+    double *points = calloc((size_t)num*dim, sizeof(double));
+    double *radii = calloc(num, sizeof(double));
+    int i = 0;
+    for(bounds_node *curr = list->head; curr!=NULL; curr = curr->next, ++i) {
+        memcpy(points + (size_t)i*dim, curr->bounds.center.v, dim*sizeof(double));
+        radii[i] = (curr->bounds.radius > 0.0) ? curr->bounds.radius : 0.0;
     }
-    #endif /* 0 */
 
-    /* store final results */
-    vectNd_copy(centroid, &curr_centroid);
-    *radius = curr_radius;
+    bounds_ball(points, radii, num, dim, centroid->v, radius);
 
-    /* clean up */
-    vectNd_free(&initial);
-    vectNd_free(&curr_centroid);
-    nm_free(nm);
+    free(radii); radii = NULL;
+    free(points); points = NULL;
 
     return 0;
 }
@@ -39,4 +39,8 @@ int bounds_list_centroid(bounds_list *list, vectNd *centroid);
 int bounds_list_radius(bounds_list *list, vectNd *centroid, double *radius);
 int bounds_list_optimal(bounds_list *list, vectNd *centroid, double *radius);
 
+/* iterations used by bounds_ball, radius is within 1/sqrt of this of optimal */
+#define BOUNDS_BALL_ITERATIONS 1000
+int bounds_ball(double *points, double *radii, int num, int dim, double *center, double *radius);
+
 #endif /* BOUNDING_SPHERE_H */
@@ -501,9 +501,13 @@ void camera_zoom(camera *cam) {
     vectNd_scale(&cam->dirY, 1/cam->zoom, &cam->dirY);
 }
 
-void camera_target_point(camera *cam, double x, double y, double dist, vectNd *pixel) {
-    vectNd temp;
-    vectNd_alloc(&temp,pixel->n);
+/* temp is scratch space, allocated here when NULL */
+void camera_target_point(camera *cam, double x, double y, double dist, vectNd *pixel, vectNd *temp) {
+    vectNd local;
+    if( temp == NULL ) {
+        vectNd_alloc(&local,pixel->n);
+        temp = &local;
+    }
     if( cam->type == CAMERA_VR ) {
         //printf("%s: hFov,vFov: %g, %g\n", __FUNCTION__, cam->hFov, cam->vFov);
         /* compute point in virtual spherical screen */
@@ -520,12 +524,12 @@ void camera_target_point(camera *cam, double x, double y, double dist, vectNd *p
         vectNd_copy(pixel, &cam->pos);
 
         /* scale local vectors and move pixel to actual location */
-        vectNd_scale(&cam->localX, view_x, &temp);
-        vectNd_add(pixel, &temp, pixel);
-        vectNd_scale(&cam->localY, view_y, &temp);
-        vectNd_add(pixel, &temp, pixel);
-        vectNd_scale(&cam->localZ, view_z, &temp);
-        vectNd_add(pixel, &temp, pixel);
+        vectNd_scale(&cam->localX, view_x, temp);
+        vectNd_add(pixel, temp, pixel);
+        vectNd_scale(&cam->localY, view_y, temp);
+        vectNd_add(pixel, temp, pixel);
+        vectNd_scale(&cam->localZ, view_z, temp);
+        vectNd_add(pixel, temp, pixel);
 
     } else if( cam->type == CAMERA_PANO ) {
         /* compute point in virtual cuylindrical screen */
@@ -548,36 +552,37 @@ void camera_target_point(camera *cam, double x, double y, double dist, vectNd *p
         vectNd_copy(pixel, &cam->pos);
 
         /* scale local vectors and move pixel to actual location */
-        vectNd_scale(&cam->localX, view_x, &temp);
-        vectNd_add(pixel, &temp, pixel);
-        vectNd_scale(&cam->localY, view_y, &temp);
-        vectNd_add(pixel, &temp, pixel);
-        vectNd_scale(&cam->localZ, view_z, &temp);
-        vectNd_add(pixel, &temp, pixel);
+        vectNd_scale(&cam->localX, view_x, temp);
+        vectNd_add(pixel, temp, pixel);
+        vectNd_scale(&cam->localY, view_y, temp);
+        vectNd_add(pixel, temp, pixel);
+        vectNd_scale(&cam->localZ, view_z, temp);
+        vectNd_add(pixel, temp, pixel);
     } else if( cam->type == CAMERA_NORMAL ) {
         /* compute point in virtual planar screen */
         vectNd_copy(pixel,&cam->imgOrig);
-        vectNd_scale(&cam->dirX,x,&temp);
-        vectNd_add(pixel,&temp,pixel);
-        vectNd_scale(&cam->dirY,y,&temp);
-        vectNd_add(pixel,&temp,pixel);
+        vectNd_scale(&cam->dirX,x,temp);
+        vectNd_add(pixel,temp,pixel);
+        vectNd_scale(&cam->dirY,y,temp);
+        vectNd_add(pixel,temp,pixel);
 
         /* project ray onto focal plane */
         double screen_dist = -1;
         vectNd_dist(&cam->imgOrig,&cam->pos,&screen_dist);
         if( screen_dist > EPSILON ) {
             double len;
-            vectNd_sub(pixel,&cam->pos,&temp);
-            vectNd_l2norm(&temp,&len);
+            vectNd_sub(pixel,&cam->pos,temp);
+            vectNd_l2norm(temp,&len);
 
-            vectNd_scale(&temp,dist/screen_dist,&temp);
-            vectNd_add(&cam->pos,&temp,pixel);
+            vectNd_scale(temp,dist/screen_dist,temp);
+            vectNd_add(&cam->pos,temp,pixel);
         }
     } else {
         fprintf(stderr,"Unknown camera type: %i\n", cam->type);
     }
 
-    vectNd_free(&temp);
+    if( temp == &local )
+        vectNd_free(&local);
 }
 
 void camera_print(camera *cam)
@@ -85,7 +85,7 @@ int camera_aim_naive(camera *cam);
 int camera_aim(camera *cam);
 int camera_focus(camera *cam, vectNd *point);
 int camera_focus_multi(camera *cam, vectNd *points, int n, double near_padding, double far_padding, double confusion_radius, double img_plane_dist);
-void camera_target_point(camera *cam, double x, double y, double dist, vectNd *p);
+void camera_target_point(camera *cam, double x, double y, double dist, vectNd *p, vectNd *temp);
 void camera_print(camera *cam);
 void camera_flip_x(camera *cam);
 void camera_flip_y(camera *cam);
@@ -19,6 +19,7 @@
 #include <math.h>
 #include <zlib.h>
 #include "image.h"
+#include "pool.h"
 
 int image_init(image_t *img)
 {
@@ -749,9 +750,6 @@ static int io_count = 0;
 
 static void *image_save_thread(void *arg)
 {
-    pthread_mutex_lock(&io_mutex);
-    ++io_count;
-    pthread_mutex_unlock(&io_mutex);
     save_thr_info_t *info = (save_thr_info_t*)arg;
     image_save(&info->img, info->fname, info->format);
     image_free(&info->img);
@@ -763,7 +761,8 @@ static void *image_save_thread(void *arg)
     return NULL;
 }
 
-int image_save_bg(image_t *img, char *fname, int format)
+/* save a copy of img as a job on pool, or on its own thread if pool is NULL */
+int image_save_bg(image_t *img, char *fname, int format, struct thread_pool *pool)
 {
     /* make local copy of image and parameters */
     save_thr_info_t *info;
@@ -776,6 +775,16 @@ int image_save_bg(image_t *img, char *fname, int format)
     /* ensure no conflict with initial save */
     unlink(fname);
 
+    /* counted from now, so a queued save is waited for too */
+    pthread_mutex_lock(&io_mutex);
+    ++io_count;
+    pthread_mutex_unlock(&io_mutex);
+
+    if( pool != NULL ) {
+        pool_submit(pool, NULL, image_save_thread, info);
+        return 0;
+    }
+
     /* launch background thread, that calls image_save */
     pthread_t thr_info;
     memset(&thr_info,'\0',sizeof(thr_info));
@@ -787,6 +796,9 @@ int image_save_bg(image_t *img, char *fname, int format)
         }
         return 0;
     }
+    pthread_mutex_lock(&io_mutex);
+    --io_count;
+    pthread_mutex_unlock(&io_mutex);
     image_free(&info->img);
     free(info); info = NULL;
     fprintf(stderr,"failed to launch background thread, saving %s in foreground.\n", fname);
@@ -92,13 +92,14 @@ typedef struct image
 int image_init(image_t*);
 int image_set_size(image_t *img, int x, int y);
 int image_set_format(image_t *img, image_type type);
+struct thread_pool;
 int image_set_pixel(image_t*,int,int,pixel_t*);
 int image_get_pixel(image_t*,int,int,pixel_t*);
 int image_get_subpixel_bilinear(image_t*,double,double,pixel_t*);
 int image_load(image_t*,char*,int);
 int image_save(image_t*,char*,int);
 int image_save_time(image_t*,char*,int,struct timeval);
-int image_save_bg(image_t*,char*,int);
+int image_save_bg(image_t*,char*,int,struct thread_pool*);
 int image_active_saves();
 int image_free(image_t *img);
 
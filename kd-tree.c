@@ -10,6 +10,10 @@
 #ifndef WITHOUT_KDTREE
 #include "kd-tree.h"
 #include "object.h"
+#include "pool.h"
+
+/* nodes with at least this many items split their right child on the pool */
+#define KD_PARALLEL_ITEMS 32
 
 /* aabb */
 
@@ -282,6 +286,14 @@ int kd_tree_free(kd_tree_t *tree) {
     if( tree->ids != NULL ) {
         free(tree->ids); tree->ids = NULL;
     }
+    if( tree->inf_ids != NULL ) {
+        free(tree->inf_ids); tree->inf_ids = NULL;
+    }
+    if( tree->view != NULL ) {
+        render_view_free(tree->view);
+        free(tree->view); tree->view = NULL;
+    }
+    tree->items = NULL;
     tree->root = NULL;
     return 1;
 }
@@ -312,7 +324,25 @@ static int kdtree_split_score(kd_item_list_t *items, int dim, double pos, double
     return (left_num>0 && right_num>0)?1:0;
 }
 
-static int kd_tree_split_node(kd_node_t *node, kd_item_list_t *items, int levels_remaining, int min_per_node, int dimensions) {
+typedef struct kd_split_job {
+    kd_node_t *node;
+    kd_item_list_t *items;
+    int levels_remaining;
+    int min_per_node;
+    int dimensions;
+    struct thread_pool *pool;
+} kd_split_job_t;
+
+static int kd_tree_split_node(kd_node_t *node, kd_item_list_t *items, int levels_remaining, int min_per_node, int dimensions, struct thread_pool *pool);
+
+static void *kd_split_job(void *arg) {
+    kd_split_job_t *job = arg;
+    kd_tree_split_node(job->node, job->items, job->levels_remaining,
+                       job->min_per_node, job->dimensions, job->pool);
+    return NULL;
+}
+
+static int kd_tree_split_node(kd_node_t *node, kd_item_list_t *items, int levels_remaining, int min_per_node, int dimensions, struct thread_pool *pool) {
 
     /* pick split point */
     int found_split = 0;
@@ -405,9 +435,19 @@ static int kd_tree_split_node(kd_node_t *node, kd_item_list_t *items, int levels
     node->left->dim = (node->dim+1)%dimensions;
     node->right->dim = (node->dim+1)%dimensions;
     if( left_items.n > 0 && right_items.n > 0 ) {
-        /* try to recursively split new leaves */
-        kd_tree_split_node(node->left, &left_items, levels_remaining-1, min_per_node, dimensions);
-        kd_tree_split_node(node->right, &right_items, levels_remaining-1, min_per_node, dimensions);
+        /* try to recursively split new leaves, the right one on another
+         * thread when it's big enough to be worth it */
+        if( pool != NULL && right_items.n >= KD_PARALLEL_ITEMS ) {
+            pool_group_t group = {0};
+            kd_split_job_t job = { node->right, &right_items, levels_remaining-1,
+                                   min_per_node, dimensions, pool };
+            pool_submit(pool, &group, kd_split_job, &job);
+            kd_tree_split_node(node->left, &left_items, levels_remaining-1, min_per_node, dimensions, pool);
+            pool_wait(pool, &group);
+        } else {
+            kd_tree_split_node(node->left, &left_items, levels_remaining-1, min_per_node, dimensions, pool);
+            kd_tree_split_node(node->right, &right_items, levels_remaining-1, min_per_node, dimensions, pool);
+        }
     }
     kd_item_list_free(&left_items, 0);
     kd_item_list_free(&right_items, 0);
@@ -426,6 +466,13 @@ int kd_tree_build(kd_tree_t *tree, kd_item_list_t *items) {
         tree->root = calloc(1, sizeof(kd_node_t));
     kd_item_list_t root_items;
     kd_item_list_init(&root_items);
+    /* make sure bounding spheres are set, infinite objects are only known
+     * once they are */
+    for(int i=0; i<items->n; ++i) {
+        object *obj = items->items[i]->obj_ptr;
+        if( obj->bounds.radius == 0 )
+            object_get_bounds(obj);
+    }
     /* count number of each type first */
     int num_inf=0, num_fin=0;
     for(int i=0; i<items->n; ++i) {
@@ -440,12 +487,16 @@ int kd_tree_build(kd_tree_t *tree, kd_item_list_t *items) {
     }
     tree->root->objs = calloc(num_fin, sizeof(void*));
     tree->inf_obj_ptrs = calloc(num_inf, sizeof(void*));
+    tree->inf_ids = calloc(num_inf, sizeof(int));
+    object **all_objs = calloc((size_t)items->n, sizeof(object*));
     tree->obj_num = 0;
     tree->inf_obj_num = 0;
+    tree->items = items->items;
     for(int i=0; i<items->n; ++i) {
         /* assign id */
         kd_item_t *item = items->items[i];
         item->id = i;
+        all_objs[i] = item->obj_ptr;
 
         if( ((object*)item->obj_ptr)->bounds.radius >= 0.0 ) {
             /* assign to root node */
@@ -456,9 +507,15 @@ int kd_tree_build(kd_tree_t *tree, kd_item_list_t *items) {
             aabb_add(&tree->bb, &item->bb);
         } else {
             /* add infinite object to special list */
+            tree->inf_ids[tree->inf_obj_num] = i;
             tree->inf_obj_ptrs[tree->inf_obj_num++] = item->obj_ptr;
         }
     }
+
+    /* compact copy of what traversal needs, indexed by item id */
+    tree->view = calloc(1, sizeof(render_view_t));
+    render_view_init(tree->view, all_objs, items->n, tree->bb.lower.n);
+    free(all_objs); all_objs = NULL;
     aabb_print(&tree->bb);
 
     printf("%i finite objects, %i infinite objects.\n", tree->obj_num, tree->inf_obj_num);
@@ -469,17 +526,32 @@ int kd_tree_build(kd_tree_t *tree, kd_item_list_t *items) {
     tree->obj_num = items->n;
     int ret = 1;
     int dimensions = tree->bb.lower.n;
-    ret = kd_tree_split_node(tree->root, &root_items, -1, -1, dimensions);
+    ret = kd_tree_split_node(tree->root, &root_items, -1, -1, dimensions, tree->pool);
     //ret = kd_tree_split_node(tree->root, items, 1, 1, dimensions);
     kd_item_list_free(&root_items, 0);
     //kd_tree_print(tree);
     return ret;
 }
 
+/* whether pnt lies in the box item id was filed under, so traversal along
+ * a ray through pnt is sure to test the item */
+int kd_tree_item_contains(kd_tree_t *tree, int id, vectNd *pnt) {
+    if( tree->items == NULL || id < 0 || id >= tree->obj_num )
+        return 0;
+
+    aabb_t *bb = &tree->items[id]->bb;
+    for(int k=0; k<pnt->n; ++k) {
+        if( pnt->v[k] < bb->lower.v[k] || pnt->v[k] > bb->upper.v[k] )
+            return 0;
+    }
+
+    return 1;
+}
+
 #define INV_EPSILON (1.0/(EPSILON))
 #define INV_EPSILON2 (1.0/(EPSILON2))
 
-static int kd_node_intersect(kd_node_t *node, vectNd *o, vectNd *unit_v, vectNd *v_inv, vectNd *hit, vectNd *hit_normal, char *obj_mask, object **ptr, double *t_ptr, double dist_limit, double tl, double tu) {
+static int kd_node_intersect(kd_node_t *node, render_view_t *view, vectNd *o, vectNd *unit_v, vectNd *v_inv, vectNd *hit, vectNd *hit_normal, char *obj_mask, object **ptr, double *t_ptr, double dist_limit, double tl, double tu, kd_scratch_t *scratch) {
     if( node==NULL )
         return 0;
 
@@ -491,26 +563,26 @@ static int kd_node_intersect(kd_node_t *node, vectNd *o, vectNd *unit_v, vectNd
         return 0;
     #endif /* 1 */
 
+    /* an occlusion query is answered by the first occluder found */
+    if( dist_limit >= 0.0 && *t_ptr < (dist_limit > 0.0 ? dist_limit : DBL_MAX) )
+        return 0;
+
     int num = node->num;
         int node_dim = node->dim;
     int ret = 0;
     if( num > 0 ) {
         double t;
-        int dim = o->n;
         object *obj_ptr;
-        vectNd lhit, lhit_normal;
-        vectNd_alloc(&lhit, dim);
-        vectNd_alloc(&lhit_normal, dim);
+        vectNd *lhit = &scratch->node_hit;
+        vectNd *lhit_normal = &scratch->node_normal;
         //printf("node %p: %i objects (tl, tu: %g, %g).\n", (void*)node, node->num, tl, tu);
-        ret = trace(o, unit_v, (object**)node->objs, node->obj_ids, node->num, obj_mask, &lhit, &lhit_normal, &obj_ptr, &t, dist_limit);
+        ret = trace_view(o, unit_v, view, node->obj_ids, node->num, obj_mask, lhit, lhit_normal, &obj_ptr, &t, dist_limit, &scratch->res, &scratch->normal);
         if( ret && t<*t_ptr ) {
             *t_ptr = t;
             *ptr = obj_ptr;
-            vectNd_copy(hit, &lhit);
-            vectNd_copy(hit_normal, &lhit_normal);
+            vectNd_copy(hit, lhit);
+            vectNd_copy(hit_normal, lhit_normal);
         }
-        vectNd_free(&lhit);
-        vectNd_free(&lhit_normal);
 
         if( node_dim < 0 ) {
             /* is a leaf */
@@ -540,34 +612,62 @@ static int kd_node_intersect(kd_node_t *node, vectNd *o, vectNd *unit_v, vectNd
         /* use t values to identify children to recurse to */
         if( tu < tp-EPSILON && *t_ptr > tl ) {
             /* recurse to near sub-AABB with tl and tu */
-            ret |= kd_node_intersect(near, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu);
+            ret |= kd_node_intersect(near, view, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu, scratch);
         } else if( tl > tp+EPSILON && *t_ptr > tl ) {
             /* recurse to far sub-AABB with tl and tu */
-            ret |= kd_node_intersect(far, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu);
+            ret |= kd_node_intersect(far, view, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu, scratch);
         } else {
             /* ray crosses dividing plane inside AABB,
              * recurse both directions, using tl,tp and tp,tu */
             if( *t_ptr > tl )
-                ret |= kd_node_intersect(near, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tp+EPSILON);
+                ret |= kd_node_intersect(near, view, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tp+EPSILON, scratch);
             if( *t_ptr > tp )
-                ret |= kd_node_intersect(far, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tp-EPSILON, tu);
+                ret |= kd_node_intersect(far, view, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tp-EPSILON, tu, scratch);
         }
     } else {
         /* plane is parallel to unit_v, compare o_dim and pos */
         if( o_i < node_boundary+EPSILON && *t_ptr > tl ) {
             /* recurse left with tl and tu */
-            ret |= kd_node_intersect(near, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu);
+            ret |= kd_node_intersect(near, view, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu, scratch);
         }
         if( o_i > node_boundary-EPSILON && *t_ptr > tl ) {
             /* recurse right with tl and tu */
-            ret |= kd_node_intersect(far, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu);
+            ret |= kd_node_intersect(far, view, o, unit_v, v_inv, hit, hit_normal, obj_mask, ptr, t_ptr, dist_limit, tl, tu, scratch);
         }
     }
 
     return ret;
 }
 
-int kd_tree_intersect(kd_tree_t *tree, vectNd *o, vectNd *unit_v, vectNd *hit, vectNd *hit_normal, void **ptr, double dist_limit) {
+int kd_scratch_init(kd_scratch_t *scratch, int dimensions) {
+    memset(scratch, '\0', sizeof(*scratch));
+    vectNd_alloc(&scratch->v_inv, dimensions);
+    vectNd_alloc(&scratch->hit, dimensions);
+    vectNd_alloc(&scratch->hit_normal, dimensions);
+    vectNd_alloc(&scratch->node_hit, dimensions);
+    vectNd_alloc(&scratch->node_normal, dimensions);
+    vectNd_alloc(&scratch->res, dimensions);
+    vectNd_alloc(&scratch->normal, dimensions);
+
+    return 1;
+}
+
+int kd_scratch_free(kd_scratch_t *scratch) {
+    vectNd_free(&scratch->v_inv);
+    vectNd_free(&scratch->hit);
+    vectNd_free(&scratch->hit_normal);
+    vectNd_free(&scratch->node_hit);
+    vectNd_free(&scratch->node_normal);
+    vectNd_free(&scratch->res);
+    vectNd_free(&scratch->normal);
+    free(scratch->obj_mask); scratch->obj_mask = NULL;
+    scratch->mask_size = 0;
+
+    return 1;
+}
+
+/* scratch may be NULL, in which case one is made for this call */
+int kd_tree_intersect(kd_tree_t *tree, vectNd *o, vectNd *unit_v, vectNd *hit, vectNd *hit_normal, void **ptr, double dist_limit, kd_scratch_t *scratch) {
     /* find all leaf nodes that ray o+x*v cross, and return items they contain */
     if( !tree ) {
         printf("tree is null.\n");
@@ -575,8 +675,12 @@ int kd_tree_intersect(kd_tree_t *tree, vectNd *o, vectNd *unit_v, vectNd *hit, v
     }
     int ret = 0;
     int dimensions = unit_v->n;
-    vectNd v_inv;
-    vectNd_alloc(&v_inv, dimensions);
+    kd_scratch_t local;
+    if( scratch == NULL ) {
+        kd_scratch_init(&local, dimensions);
+        scratch = &local;
+    }
+    vectNd *v_inv = &scratch->v_inv;
     for(int i=0; i<dimensions; ++i) {
         double v_i, v_inv_i;
         vectNd_get(unit_v, i, &v_i);
@@ -586,41 +690,48 @@ int kd_tree_intersect(kd_tree_t *tree, vectNd *o, vectNd *unit_v, vectNd *hit, v
             v_inv_i = -INV_EPSILON2;
         else
             v_inv_i = 1.0/v_i;
-        vectNd_set(&v_inv, i, v_inv_i);
+        vectNd_set(v_inv, i, v_inv_i);
     }
 
     /* check infinite objects */
     double t = DBL_MAX;
-    ret = trace(o, unit_v, (object**)tree->inf_obj_ptrs, NULL, tree->inf_obj_num, NULL, hit, hit_normal, (object**)ptr, &t, dist_limit);
+    ret = trace_view(o, unit_v, tree->view, tree->inf_ids, tree->inf_obj_num, NULL, hit, hit_normal, (object**)ptr, &t, dist_limit, &scratch->res, &scratch->normal);
+
+    /* an infinite object in the way already answers an occlusion query */
+    int occluded = ret && dist_limit >= 0.0 && (dist_limit == 0.0 || t < dist_limit);
 
     /* TODO: aabb_intersect should be faster using v_inv */
     double tl, tu;
-    if( aabb_intersect(&tree->bb, o, unit_v, &tl, &tu) ) {
+    if( !occluded && aabb_intersect(&tree->bb, o, unit_v, &tl, &tu) ) {
         double lt = DBL_MAX;
-        char *obj_mask = calloc(tree->obj_num, sizeof(char));
+        if( scratch->mask_size < tree->obj_num ) {
+            free(scratch->obj_mask);
+            scratch->obj_mask = calloc(tree->obj_num, sizeof(char));
+            scratch->mask_size = tree->obj_num;
+        }
+        char *obj_mask = scratch->obj_mask;
+        memset(obj_mask, '\0', tree->obj_num*sizeof(char));
 
         object *obj_ptr=NULL;
-        vectNd lhit, lhit_normal;
-        vectNd_alloc(&lhit, dimensions);
-        vectNd_alloc(&lhit_normal, dimensions);
+        vectNd *lhit = &scratch->hit;
+        vectNd *lhit_normal = &scratch->hit_normal;
 
-        int lret = kd_node_intersect(tree->root, o, unit_v, &v_inv, &lhit, &lhit_normal, obj_mask, &obj_ptr, &lt, dist_limit, tl, tu);
+        int lret = kd_node_intersect(tree->root, tree->view, o, unit_v, v_inv, lhit, lhit_normal, obj_mask, &obj_ptr, &lt, dist_limit, tl, tu, scratch);
 
         if( lret ) {
             /* check if intersection with finite objects is closer than
-             * intersection with infinite objects. */
-            if( !ret || (lt > EPSILON && lt+EPSILON < t)) {
-                vectNd_copy(hit, &lhit);
-                vectNd_copy(hit_normal, &lhit_normal);
+             * intersection with infinite objects, or is an occluder. */
+            if( !ret || (lt > EPSILON && lt+EPSILON < t)
+                || (dist_limit > 0.0 && lt < dist_limit) ) {
+                vectNd_copy(hit, lhit);
+                vectNd_copy(hit_normal, lhit_normal);
                 *ptr = obj_ptr;
                 ret |= lret;
             }
         }
-        vectNd_free(&lhit);
-        vectNd_free(&lhit_normal);
-        free(obj_mask); obj_mask=NULL;
     }
-    vectNd_free(&v_inv);
+    if( scratch == &local )
+        kd_scratch_free(&local);
     return ret;
 }
 #endif /* !WITHOUT_KDTREE */
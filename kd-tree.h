@@ -63,21 +63,45 @@ int kd_node_free(kd_node_t *node);
 
 /* kd_tree */
 
+struct render_view;
+
 typedef struct kd_tree {
     aabb_t bb;
     void **obj_ptrs;
     void **inf_obj_ptrs;
     int *ids;
+    int *inf_ids;
     int obj_num;
     int inf_obj_num;
     kd_node_t *root;
+    struct render_view *view;   /* hot records for every item, by id */
+    kd_item_t **items;          /* every item, by id, owned by the caller */
+    struct thread_pool *pool;   /* splits subtrees in parallel, NULL for serial */
 } kd_tree_t;
 
 int kd_tree_init(kd_tree_t *tree, int dimensions);
 int kd_tree_free(kd_tree_t *tree);
 int kd_tree_print(kd_tree_t *tree);
 int kd_tree_build(kd_tree_t *tree, kd_item_list_t *items);
-int kd_tree_intersect(kd_tree_t *tree, vectNd *o, vectNd *v, vectNd *hit, vectNd *hit_normal, void **ptr, double dist_limit);
+int kd_tree_item_contains(kd_tree_t *tree, int id, vectNd *pnt);
+
+/* kd_scratch */
+
+/* space reused by kd_tree_intersect, one per thread, so traversal doesn't
+ * allocate per ray */
+typedef struct kd_scratch {
+    vectNd v_inv;
+    vectNd hit, hit_normal;         /* closest finite hit */
+    vectNd node_hit, node_normal;   /* closest hit within a node */
+    vectNd res, normal;             /* candidate hit, see trace_view */
+    char *obj_mask;
+    int mask_size;
+} kd_scratch_t;
+
+int kd_scratch_init(kd_scratch_t *scratch, int dimensions);
+int kd_scratch_free(kd_scratch_t *scratch);
+
+int kd_tree_intersect(kd_tree_t *tree, vectNd *o, vectNd *v, vectNd *hit, vectNd *hit_normal, void **ptr, double dist_limit, kd_scratch_t *scratch);
 
 #endif /* KD_TREE_H */
 #endif /* !WITHOUT_KDTREE */
@@ -7,9 +7,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "vectNd.h"
 #include "kmeans.h"
 
+/* smallest share of points worth handing to an assignment thread */
+#define KMEANS_MIN_PER_THREAD 1024
+
 static double kmeans_vect_dist(kmean_vector_t *vect1, kmean_vector_t *vect2)
 {
     double ret = -1.0;
@@ -128,6 +133,308 @@ int kmeans_find(kmean_vector_list_t *data, kmean_vector_list_t *cents)
     return iterations;
 }
 
+static inline double kmeans_dist2(double *a, double *b, int dim)
+{
+    double sum = 0.0;
+    for(int i=0; i<dim; ++i) {
+        double d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+/* Choose initial centers with k-means++: each new center is drawn with
+ * probability proportional to its squared distance from the nearest center
+ * already chosen. */
+/* http://en.wikipedia.org/wiki/K-means%2B%2B */
+int kmeans_seed(kmean_vector_list_t *data, kmean_vector_list_t *cents, unsigned short seed[3])
+{
+    int n = data->num;
+    int k = cents->num;
+    if( n <= 0 || k <= 0 )
+        return -1;
+    int dim = cents->data[0].vect.n;
+
+    double *nearest = calloc(n,sizeof(double));
+    if( nearest==NULL )
+        return -1;
+
+    int pick = (int)(erand48(seed) * n);
+    for(int c=0; c<k; ++c) {
+        if( c > 0 ) {
+            double total = 0.0;
+            for(int i=0; i<n; ++i)
+                total += nearest[i];
+
+            pick = (int)(erand48(seed) * n);
+            if( total > 0.0 ) {
+                double r = erand48(seed) * total;
+                for(int i=0; i<n; ++i) {
+                    if( nearest[i] <= 0.0 )
+                        continue;
+                    pick = i;
+                    r -= nearest[i];
+                    if( r <= 0.0 )
+                        break;
+                }
+            }
+        }
+        if( pick >= n )
+            pick = n-1;
+
+        vectNd_copy(&cents->data[c].vect, &data->data[pick].vect);
+        cents->data[c].which = c;
+
+        /* track squared distance to the nearest chosen center */
+        double *cv = cents->data[c].vect.v;
+        for(int i=0; i<n; ++i) {
+            double d2 = kmeans_dist2(data->data[i].vect.v, cv, dim);
+            if( c==0 || d2 < nearest[i] )
+                nearest[i] = d2;
+        }
+    }
+
+    free(nearest); nearest=NULL;
+
+    return k;
+}
+
+/* assignment threads that last for a whole kmeans_find_bounded run, and
+ * are released once per iteration */
+typedef struct kmeans_crew {
+    pthread_barrier_t start;    /* an iteration's centers are ready */
+    pthread_barrier_t done;     /* every range has been assigned */
+    int stop;
+} kmeans_crew_t;
+
+typedef struct kmeans_job {
+    kmeans_crew_t *crew;
+    kmean_vector_list_t *data;
+    kmean_vector_list_t *cents;
+    int start, end;
+    double *upper;      /* distance to assigned center (Hamerly), or NULL */
+    double *lower;      /* distance to second closest center (Hamerly) */
+    double *half_sep;   /* half distance from each center to its nearest */
+    int changed;
+} kmeans_job_t;
+
+static void *kmeans_assign_range(void *arg)
+{
+    kmeans_job_t *job = arg;
+    kmean_vector_list_t *cents = job->cents;
+    int k = cents->num;
+    int dim = cents->data[0].vect.n;
+
+    job->changed = 0;
+    for(int i=job->start; i<job->end; ++i) {
+        kmean_vector_t *pnt = &job->data->data[i];
+        int which = pnt->which;
+
+        /* skip points that can't be closer to any other center */
+        if( job->upper ) {
+            double bound = fmax(job->half_sep[which], job->lower[i]);
+            if( job->upper[i] <= bound )
+                continue;
+            job->upper[i] = sqrt(kmeans_dist2(pnt->vect.v, cents->data[which].vect.v, dim));
+            if( job->upper[i] <= bound )
+                continue;
+        }
+
+        double best = INFINITY, second = INFINITY;
+        int best_which = which;
+        for(int c=0; c<k; ++c) {
+            double d2 = kmeans_dist2(pnt->vect.v, cents->data[c].vect.v, dim);
+            if( d2 < best ) {
+                second = best;
+                best = d2;
+                best_which = c;
+            } else if( d2 < second ) {
+                second = d2;
+            }
+        }
+
+        if( best_which != which ) {
+            pnt->which = best_which;
+            job->changed++;
+        }
+        if( job->upper ) {
+            job->upper[i] = sqrt(best);
+            job->lower[i] = sqrt(second);
+        }
+    }
+
+    return NULL;
+}
+
+static void *kmeans_worker(void *arg)
+{
+    kmeans_job_t *job = arg;
+    kmeans_crew_t *crew = job->crew;
+
+    while( 1 ) {
+        pthread_barrier_wait(&crew->start);
+        if( crew->stop )
+            break;
+        kmeans_assign_range(job);
+        pthread_barrier_wait(&crew->done);
+    }
+
+    return NULL;
+}
+
+/* Lloyd's algorithm with an iteration cap, assignment split across
+ * num_threads threads started once per run (<=0 uses all processors), and
+ * optionally Hamerly's bounds to skip most distance computations once
+ * centers settle. */
+/* https://doi.org/10.1137/1.9781611972801.12 */
+int kmeans_find_bounded(kmean_vector_list_t *data, kmean_vector_list_t *cents, int max_iterations, int num_threads, int prune)
+{
+    int n = data->num;
+    int k = cents->num;
+    if( n <= 0 || k <= 0 )
+        return 0;
+    int dim = cents->data[0].vect.n;
+
+    if( num_threads <= 0 )
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if( num_threads > n / KMEANS_MIN_PER_THREAD )
+        num_threads = n / KMEANS_MIN_PER_THREAD;
+    if( num_threads < 1 )
+        num_threads = 1;
+
+    /* everything needed per iteration is allocated once, up front */
+    double *sums = calloc(k*dim,sizeof(double));
+    int *counts = calloc(k,sizeof(int));
+    double *moved = calloc(k,sizeof(double));
+    double *half_sep = calloc(k,sizeof(double));
+    double *upper = NULL, *lower = NULL;
+    if( prune ) {
+        upper = malloc(n*sizeof(double));
+        lower = calloc(n,sizeof(double));
+        for(int i=0; i<n; ++i)
+            upper[i] = INFINITY;
+    }
+    kmeans_job_t *jobs = calloc(num_threads,sizeof(kmeans_job_t));
+    pthread_t *threads = calloc(num_threads,sizeof(pthread_t));
+    kmeans_crew_t crew;
+    crew.stop = 0;
+    for(int t=0; t<num_threads; ++t) {
+        jobs[t].crew = &crew;
+        jobs[t].data = data;
+        jobs[t].cents = cents;
+        jobs[t].start = (long)n * t / num_threads;
+        jobs[t].end = (long)n * (t+1) / num_threads;
+        jobs[t].upper = upper;
+        jobs[t].lower = lower;
+        jobs[t].half_sep = half_sep;
+    }
+
+    /* this thread takes the first range, the others wait between iterations */
+    if( num_threads > 1 ) {
+        pthread_barrier_init(&crew.start, NULL, num_threads);
+        pthread_barrier_init(&crew.done, NULL, num_threads);
+        for(int t=1; t<num_threads; ++t)
+            pthread_create(&threads[t], NULL, kmeans_worker, &jobs[t]);
+    }
+
+    /* the first pass checks every center, so prior assignments don't matter */
+    for(int i=0; i<n; ++i)
+        data->data[i].which = 0;
+
+    int iterations = 0;
+    while( max_iterations <= 0 || iterations < max_iterations ) {
+        ++iterations;
+
+        if( prune ) {
+            for(int c=0; c<k; ++c) {
+                double nearest = INFINITY;
+                for(int o=0; o<k; ++o) {
+                    if( o==c )
+                        continue;
+                    double d2 = kmeans_dist2(cents->data[c].vect.v, cents->data[o].vect.v, dim);
+                    if( d2 < nearest )
+                        nearest = d2;
+                }
+                half_sep[c] = 0.5*sqrt(nearest);
+            }
+        }
+
+        /* assign points to their nearest centers */
+        int changed = 0;
+        if( num_threads > 1 )
+            pthread_barrier_wait(&crew.start);
+        kmeans_assign_range(&jobs[0]);
+        if( num_threads > 1 )
+            pthread_barrier_wait(&crew.done);
+        for(int t=0; t<num_threads; ++t)
+            changed += jobs[t].changed;
+
+        /* move centers to the mean of their points */
+        memset(sums, '\0', k*dim*sizeof(double));
+        memset(counts, '\0', k*sizeof(int));
+        for(int i=0; i<n; ++i) {
+            int which = data->data[i].which;
+            double *v = data->data[i].vect.v;
+            counts[which]++;
+            for(int d=0; d<dim; ++d)
+                sums[which*dim+d] += v[d];
+        }
+        double max_moved = 0.0, second_moved = 0.0;
+        int max_which = -1;
+        for(int c=0; c<k; ++c) {
+            moved[c] = 0.0;
+            if( counts[c] > 0 ) {
+                double *cv = cents->data[c].vect.v;
+                double d2 = 0.0;
+                for(int d=0; d<dim; ++d) {
+                    double mean = sums[c*dim+d] / counts[c];
+                    d2 += (mean - cv[d])*(mean - cv[d]);
+                    cv[d] = mean;
+                }
+                moved[c] = sqrt(d2);
+            }
+            if( moved[c] > max_moved ) {
+                second_moved = max_moved;
+                max_moved = moved[c];
+                max_which = c;
+            } else if( moved[c] > second_moved ) {
+                second_moved = moved[c];
+            }
+        }
+
+        if( changed == 0 )
+            break;
+
+        /* loosen bounds by how far centers moved */
+        if( prune ) {
+            for(int i=0; i<n; ++i) {
+                int which = data->data[i].which;
+                upper[i] += moved[which];
+                lower[i] -= (which == max_which) ? second_moved : max_moved;
+            }
+        }
+    }
+
+    if( num_threads > 1 ) {
+        crew.stop = 1;
+        pthread_barrier_wait(&crew.start);
+        for(int t=1; t<num_threads; ++t)
+            pthread_join(threads[t], NULL);
+        pthread_barrier_destroy(&crew.done);
+        pthread_barrier_destroy(&crew.start);
+    }
+    free(threads); threads=NULL;
+    free(jobs); jobs=NULL;
+    free(lower); lower=NULL;
+    free(upper); upper=NULL;
+    free(half_sep); half_sep=NULL;
+    free(moved); moved=NULL;
+    free(counts); counts=NULL;
+    free(sums); sums=NULL;
+
+    return iterations;
+}
+
 int kmeans_new_list(kmean_vector_list_t *list, int num, int len)
 {
     void *ptr=NULL;
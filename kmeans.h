@@ -17,6 +17,8 @@ typedef struct kmean_vector_list {
 } kmean_vector_list_t;
 
 int kmeans_find(kmean_vector_list_t *data, kmean_vector_list_t *cents);
+int kmeans_seed(kmean_vector_list_t *data, kmean_vector_list_t *cents, unsigned short seed[3]);
+int kmeans_find_bounded(kmean_vector_list_t *data, kmean_vector_list_t *cents, int max_iterations, int num_threads, int prune);
 int kmeans_new_list(kmean_vector_list_t *list, int num, int width);
 int kmeans_free_list(kmean_vector_list_t *list);
 int kmeans_print_vect(kmean_vector_t *vect);
@@ -0,0 +1,188 @@
+/*
+ * light_tree.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "light_tree.h"
+#include "bounding.h"
+
+int light_tree_includes(light *lgt)
+{
+    return lgt->type == LIGHT_POINT
+        || lgt->type == LIGHT_SPOT
+        || lgt->type == LIGHT_DISK
+        || lgt->type == LIGHT_RECT;
+}
+
+/* radius swept out by a light's emitting surface */
+static double light_extent(light *lgt)
+{
+    if( lgt->type == LIGHT_DISK )
+        return fabs(lgt->radius);
+    if( lgt->type == LIGHT_RECT )
+        return fabs(lgt->radius) * M_SQRT2;
+    return 0.0;
+}
+
+/* a light's position along the axis being split */
+typedef struct light_key {
+    double key;
+    int light;
+} light_key_t;
+
+static int key_compar(const void *a, const void *b)
+{
+    const light_key_t *ka = a;
+    const light_key_t *kb = b;
+
+    if( ka->key > kb->key )
+        return 1;
+    else if( ka->key < kb->key )
+        return -1;
+    /* ties by index, so the tree doesn't depend on qsort's order */
+    return (ka->light > kb->light) - (ka->light < kb->light);
+}
+
+/* build the subtree over idx[0..num), returning its node, keys is scratch
+ * space for num entries */
+static int light_tree_node(light_tree_t *tree, scene *scn, int *idx, light_key_t *keys, int num)
+{
+    int dim = tree->dim;
+    int n = tree->num_nodes++;
+    light_node_t *node = &tree->nodes[n];
+    double *center = &tree->centers[(size_t)n*dim];
+
+    if( num == 1 ) {
+        light *lgt = scn->lights[idx[0]];
+        memcpy(center, lgt->pos.v, dim*sizeof(double));
+        node->radius = light_extent(lgt);
+        node->power = fmax(lgt->red, fmax(lgt->green, lgt->blue));
+        node->left = node->right = -1;
+        node->light = idx[0];
+        return n;
+    }
+
+    /* split at the median of the widest axis */
+    int axis = 0;
+    double widest = -1.0;
+    for(int k=0; k<dim; ++k) {
+        double lo = INFINITY, hi = -INFINITY;
+        for(int i=0; i<num; ++i) {
+            double p = scn->lights[idx[i]]->pos.v[k];
+            lo = fmin(lo, p);
+            hi = fmax(hi, p);
+        }
+        if( hi - lo > widest ) {
+            widest = hi - lo;
+            axis = k;
+        }
+    }
+    for(int i=0; i<num; ++i) {
+        keys[i].key = scn->lights[idx[i]]->pos.v[axis];
+        keys[i].light = idx[i];
+    }
+    qsort(keys, num, sizeof(light_key_t), key_compar);
+    for(int i=0; i<num; ++i)
+        idx[i] = keys[i].light;
+
+    int half = num/2;
+    int left = light_tree_node(tree, scn, idx, keys, half);
+    int right = light_tree_node(tree, scn, idx+half, keys, num-half);
+
+    node->left = left;
+    node->right = right;
+    node->light = -1;
+    node->power = tree->nodes[left].power + tree->nodes[right].power;
+
+    double points[2*dim];
+    double radii[2] = { tree->nodes[left].radius, tree->nodes[right].radius };
+    memcpy(points, &tree->centers[(size_t)left*dim], dim*sizeof(double));
+    memcpy(points+dim, &tree->centers[(size_t)right*dim], dim*sizeof(double));
+    bounds_ball(points, radii, 2, dim, center, &node->radius);
+
+    return n;
+}
+
+int light_tree_build(light_tree_t *tree, scene *scn)
+{
+    memset(tree, '\0', sizeof(*tree));
+    tree->dim = scn->dimensions;
+
+    int *idx = calloc(scn->num_lights > 0 ? scn->num_lights : 1, sizeof(int));
+    light_key_t *keys = calloc(scn->num_lights > 0 ? scn->num_lights : 1, sizeof(light_key_t));
+    for(int i=0; i<scn->num_lights; ++i) {
+        if( light_tree_includes(scn->lights[i]) )
+            idx[tree->num_lights++] = i;
+    }
+
+    if( tree->num_lights > 0 ) {
+        tree->nodes = calloc(2*tree->num_lights-1, sizeof(light_node_t));
+        tree->centers = calloc((size_t)(2*tree->num_lights-1)*tree->dim, sizeof(double));
+        light_tree_node(tree, scn, idx, keys, tree->num_lights);
+    }
+    free(keys); keys = NULL;
+    free(idx); idx = NULL;
+
+    return tree->num_lights;
+}
+
+int light_tree_free(light_tree_t *tree)
+{
+    free(tree->nodes); tree->nodes = NULL;
+    free(tree->centers); tree->centers = NULL;
+    tree->num_nodes = tree->num_lights = 0;
+
+    return 0;
+}
+
+/* upper bound style estimate of a node's contribution at a point */
+static inline double node_importance(light_tree_t *tree, int n, vectNd *at)
+{
+    light_node_t *node = &tree->nodes[n];
+    double *center = &tree->centers[(size_t)n*tree->dim];
+    double dist2 = 0.0;
+    for(int k=0; k<tree->dim; ++k)
+        dist2 += (at->v[k]-center[k])*(at->v[k]-center[k]);
+
+    return node->power / fmax(dist2, fmax(node->radius*node->radius, EPSILON));
+}
+
+/*
+ * Pick one light for the point at, walking down from the root and choosing
+ * each child in proportion to its importance.  u in [0,1) drives the
+ * choices, and pdf gets the probability of the light picked.
+ */
+int light_tree_sample(light_tree_t *tree, vectNd *at, double u, int *light, double *pdf)
+{
+    if( tree->num_lights <= 0 )
+        return -1;
+
+    int n = 0;
+    double prob = 1.0;
+    while( tree->nodes[n].light < 0 ) {
+        int left = tree->nodes[n].left;
+        int right = tree->nodes[n].right;
+        double il = node_importance(tree, left, at);
+        double ir = node_importance(tree, right, at);
+        double pl = (il+ir > 0.0) ? il/(il+ir) : 0.5;
+
+        if( u < pl ) {
+            n = left;
+            u = u / pl;
+            prob *= pl;
+        } else {
+            n = right;
+            u = (u - pl) / (1.0 - pl);
+            prob *= 1.0 - pl;
+        }
+    }
+    *light = tree->nodes[n].light;
+    *pdf = prob;
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * light_tree.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+#include "scene.h"
+
+/*
+ * Bounding hierarchy over a scene's positioned lights (point, spot, disk
+ * and rect), used to pick a few lights per hit in proportion to how much
+ * they could contribute there, in time logarithmic in the number of lights.
+ */
+typedef struct light_node {
+    double radius;
+    double power;       /* summed brightest channel of the lights below */
+    int left, right;    /* children, -1 for leaves */
+    int light;          /* index into scn->lights for leaves, else -1 */
+} light_node_t;
+
+typedef struct light_tree {
+    int dim;
+    int num_nodes;
+    int num_lights;
+    light_node_t *nodes;
+    double *centers;    /* num_nodes rows of dim */
+} light_tree_t;
+
+/* whether lgt is placed in the tree rather than shaded every hit */
+int light_tree_includes(light *lgt);
+
+int light_tree_build(light_tree_t *tree, scene *scn);
+int light_tree_free(light_tree_t *tree);
+int light_tree_sample(light_tree_t *tree, vectNd *at, double u, int *light, double *pdf);
+#endif /* LIGHT_TREE_H */
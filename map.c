@@ -9,6 +9,7 @@
 #include "image.h"
 #include "matrix.h"
 #include "map.h"
+#include "rng.h"
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -145,13 +146,19 @@ int map_image(map_t *map, vectNd *v, pixel_t *p)
             map_linear(map,&mapped,&mx,&my);
             break;
         case MAP_RANDOM:
-            mx = drand48();
-            my = drand48();
-            break;
         default:
-            printf("Unknown mapping mode %i\n", map->mode);
-            mx = drand48();
-            my = drand48();
+            if( map->mode != MAP_RANDOM )
+                printf("Unknown mapping mode %i\n", map->mode);
+            /* noise keyed on the mapped point, so it is thread order independent */
+            {
+                rng_t rng;
+                uint64_t key = 0;
+                for(int i=0; i<dim; ++i)
+                    key = rng_mix(key ^ rng_hash_double(mapped.v[i]));
+                rng_seed(&rng, 0, key, 0);
+                mx = rng_double(&rng);
+                my = rng_double(&rng);
+            }
             break;
     }
     vectNd_free(&mapped);
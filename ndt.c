@@ -25,6 +25,14 @@
 #include "object.h"
 #include "scene.h"
 #include "timing.h"
+#include "sampler.h"
+#include "adaptive.h"
+#include "wavefront.h"
+#include "light_tree.h"
+#include "tiles.h"
+#include "pool.h"
+#include "sample_cache.h"
+#include "status.h"
 
 #ifndef MIN
 #define MIN(x,y) (((x)>(y))?(y):(x))
@@ -43,6 +51,53 @@ int specular_enabled = 1;
 
 int recursive_aa = 0;
 
+/* frame being rendered, keys the per-sample random streams */
+static unsigned int render_frame = 0;
+static sampler_type_t sampler_type = SAMPLER_SOBOL;
+
+/* adaptive sampling targets, budgets <= 0 are unlimited */
+static double adapt_max_error = 1.0/256.0;
+static double adapt_spp_budget = 0.0;   /* average samples per pixel */
+static double adapt_time_budget = 0.0;  /* seconds per frame */
+static int adapt_requested = 0;         /* -x given, else just -n samples */
+
+/* bounces before Russian roulette starts, 0 disables it */
+static int russian_roulette = 0;
+
+/* trace tiles breadth first through ray queues rather than pixel by pixel */
+static int wavefront = 0;
+
+/* pixels per edge of the tiles threads take (and steal) work in */
+static int tile_size = TILE_DEFAULT_SIZE;
+
+/* progress counters and their reporter thread, optionally writing a status
+ * file for job schedulers */
+static render_status_t render_status;
+static char *status_file = NULL;
+static double status_interval = 0.0;
+
+/* progressive refinement, the first pass renders 1 in 4^levels pixels of
+ * each tile and every later pass halves the spacing */
+#define PROGRESSIVE_LEVELS 2
+static int progressive = 0;
+static double progressive_interval = 0.0;  /* seconds between previews, 0 for none */
+static double progressive_budget = 0.0;    /* seconds per frame, 0 for none */
+
+/* workers kept for the whole run, the main thread makes up the last one */
+static thread_pool_t render_pool;
+static int pin_threads = 0;
+
+/* lights picked per hit from light_tree (0 visits every light), and the
+ * unshadowed contribution below which a light's shadow ray is skipped */
+static int light_samples = 0;
+static double light_cull = 0.0;
+static light_tree_t light_tree;
+
+/* this frame's lights, prepared for shading */
+static light_view_t *light_views = NULL;
+static int num_light_views = 0;
+static int light_views_epoch = 0;   /* bumped each time the views are built */
+
 typedef enum stereo_mode_t {
     MONO, SIDE_SIDE_3D, OVER_UNDER_3D, ANAGLYPH_3D, HIDEF_3D
 } stereo_mode;
@@ -65,269 +120,716 @@ int mpi_broadcast_image(image_t *img, int source_rank);
 #endif /* WITH_MPI */
 
 #ifndef WITHOUT_KDTREE
-kd_tree_t kdtree;
+/* tree of the frame being rendered */
+kd_tree_t *kdtree = NULL;
 #endif /* !WITHOUT_KDTREE */
 
-static inline int apply_lights(scene *scn, int dim, object *obj_ptr, vectNd *src, vectNd *look, vectNd *hit, vectNd *hit_normal, dbl_pixel_t *color) {
-    dbl_pixel_t clr;
-    double hit_r, hit_g, hit_b;
+/* scratch vectors for shading one hit */
+typedef struct light_scratch {
     vectNd rev_view, rev_light, light_vec, light_hit, light_hit_normal;
-    vectNd lgt_pos, near_pos;
+    vectNd lgt_pos, near_pos, temp;
+    vectNd light_ref, rev_look;
+} light_scratch_t;
+
+/* pending ray of a ray tree, see get_ray_color */
+typedef struct ray_job {
+    vectNd src;
+    vectNd look;
+    double r, g, b;     /* weight of this ray's colour in the result */
+    double frac;        /* share of the pixel, for pruning */
+    int depth;          /* remaining reflection/refraction depth */
+} ray_job_t;
+
+/*
+ * Per thread render context: everything tracing and shading a ray needs
+ * besides the scene, allocated once so the hot paths don't touch the heap.
+ */
+typedef struct render_ctx {
+    int dim;
+
+    /* stack of pending rays */
+    ray_job_t *jobs;
+    int num;
+    int size;
+    vectNd src, look;   /* ray being shaded */
+    vectNd hit, hit_normal;
+
+    /* camera rays */
+    vectNd cam_pos, cam_look, cam_pixel, cam_temp;
+
+    light_scratch_t ls;
+    #ifndef WITHOUT_KDTREE
+    kd_scratch_t kd;
+    #endif /* !WITHOUT_KDTREE */
+
+    /* wavefront rows, grown as needed */
+    ray_queue_t queues[2];
+    int num_paths;
+    int num_pixels;
+    sampler_t *path_smp;
+    dbl_pixel_t *path_clr;
+    double *pixel_depth;
+    int *pixel_pos;     /* x,y of each pixel in the batch */
+
+    /* view index of the object last found blocking each light's shadow
+     * rays, tested before a full query; cleared when the views are rebuilt */
+    int *occluders;
+    int num_occluders;
+    int occluder_epoch;
+
+    /* resampling points of the tile being resampled */
+    sample_cache_t subsamples;
+
+    long rays;          /* rays traced, shadow rays included */
+    long occluder_hits, occluder_misses;
+} render_ctx_t;
+
+static pthread_key_t render_ctx_key;
+static pthread_once_t render_ctx_once = PTHREAD_ONCE_INIT;
+
+static void render_ctx_free(void *arg)
+{
+    render_ctx_t *ctx = arg;
+    if( ctx == NULL )
+        return;
+
+    for(int i=0; i<ctx->size; ++i) {
+        vectNd_free(&ctx->jobs[i].src);
+        vectNd_free(&ctx->jobs[i].look);
+    }
+    free(ctx->jobs); ctx->jobs = NULL;
+    free(ctx->occluders); ctx->occluders = NULL;
+    vectNd_free(&ctx->src);
+    vectNd_free(&ctx->look);
+    vectNd_free(&ctx->hit);
+    vectNd_free(&ctx->hit_normal);
+    vectNd_free(&ctx->cam_pos);
+    vectNd_free(&ctx->cam_look);
+    vectNd_free(&ctx->cam_pixel);
+    vectNd_free(&ctx->cam_temp);
+
+    light_scratch_t *ls = &ctx->ls;
+    vectNd_free(&ls->rev_view);
+    vectNd_free(&ls->rev_light);
+    vectNd_free(&ls->light_vec);
+    vectNd_free(&ls->light_hit);
+    vectNd_free(&ls->light_hit_normal);
+    vectNd_free(&ls->lgt_pos);
+    vectNd_free(&ls->near_pos);
+    vectNd_free(&ls->temp);
+    vectNd_free(&ls->light_ref);
+    vectNd_free(&ls->rev_look);
+
+    #ifndef WITHOUT_KDTREE
+    kd_scratch_free(&ctx->kd);
+    #endif /* !WITHOUT_KDTREE */
+
+    ray_queue_free(&ctx->queues[0]);
+    ray_queue_free(&ctx->queues[1]);
+    free(ctx->path_smp); ctx->path_smp = NULL;
+    free(ctx->path_clr); ctx->path_clr = NULL;
+    free(ctx->pixel_depth); ctx->pixel_depth = NULL;
+    free(ctx->pixel_pos); ctx->pixel_pos = NULL;
+    sample_cache_free(&ctx->subsamples);
+    free(ctx);
+}
+
+static void render_ctx_key_init(void)
+{
+    pthread_key_create(&render_ctx_key, render_ctx_free);
+}
+
+/* this thread's context, with an empty ray stack able to hold size rays of
+ * dimension dim */
+static render_ctx_t *render_ctx_get(int dim, int size)
+{
+    pthread_once(&render_ctx_once, render_ctx_key_init);
+    render_ctx_t *ctx = pthread_getspecific(render_ctx_key);
+
+    /* jobs hold vectNds, which may point into themselves, so grow by
+     * rebuilding rather than with realloc */
+    if( ctx != NULL && (ctx->dim != dim || ctx->size < size) ) {
+        render_ctx_free(ctx);
+        ctx = NULL;
+    }
+
+    if( ctx == NULL ) {
+        ctx = calloc(1, sizeof(render_ctx_t));
+        ctx->dim = dim;
+        ctx->size = size;
+        ctx->jobs = calloc(size, sizeof(ray_job_t));
+        for(int i=0; i<size; ++i) {
+            vectNd_alloc(&ctx->jobs[i].src, dim);
+            vectNd_alloc(&ctx->jobs[i].look, dim);
+        }
+        vectNd_alloc(&ctx->src, dim);
+        vectNd_alloc(&ctx->look, dim);
+        vectNd_calloc(&ctx->hit, dim);
+        vectNd_calloc(&ctx->hit_normal, dim);
+        vectNd_alloc(&ctx->cam_pos, dim);
+        vectNd_alloc(&ctx->cam_look, dim);
+        vectNd_alloc(&ctx->cam_pixel, dim);
+        vectNd_alloc(&ctx->cam_temp, dim);
+
+        /* all of these are initialized before use */
+        light_scratch_t *ls = &ctx->ls;
+        vectNd_alloc(&ls->rev_view, dim);
+        vectNd_alloc(&ls->rev_light, dim);
+        vectNd_alloc(&ls->light_vec, dim);
+        vectNd_alloc(&ls->light_hit, dim);
+        vectNd_alloc(&ls->light_hit_normal, dim);
+        vectNd_alloc(&ls->lgt_pos, dim);
+        vectNd_alloc(&ls->near_pos, dim);
+        vectNd_alloc(&ls->temp, dim);
+        vectNd_alloc(&ls->light_ref, dim);
+        vectNd_alloc(&ls->rev_look, dim);
+
+        #ifndef WITHOUT_KDTREE
+        kd_scratch_init(&ctx->kd, dim);
+        #endif /* !WITHOUT_KDTREE */
+
+        ray_queue_init(&ctx->queues[0], dim, 1);
+        ray_queue_init(&ctx->queues[1], dim, 1);
+        pthread_setspecific(render_ctx_key, ctx);
+    }
+    ctx->num = 0;
+
+    return ctx;
+}
+
+/* |cos| of the angle between hit_normal and the unit vector light_vec */
+static inline double light_cos(vectNd *hit_normal, vectNd *light_vec)
+{
+    double dot, len;
+    vectNd_dot(hit_normal,light_vec,&dot);
+    vectNd_l2norm(hit_normal,&len);
+    if( len <= EPSILON )
+        return 0.0;
+    return fabs(dot) / len;
+}
+
+/*
+ * Unshadowed diffuse plus specular contribution of lgt (brightest channel),
+ * for a point or spot light at squared distance ldist2 in unit direction
+ * light_vec from the light to the hit.
+ */
+static inline double light_estimate(light_view_t *lgt, material_t *mtl, vectNd *look,
+            vectNd *hit_normal, vectNd *light_vec, double ldist2,
+            light_scratch_t *ls)
+{
+    double est = 0.0;
+
+    if( !mtl->transparent ) {
+        double light_scale = light_cos(hit_normal,light_vec) / ldist2;
+        est = MAX(mtl->red * lgt->red, MAX(mtl->green * lgt->green,
+                    mtl->blue * lgt->blue)) * light_scale;
+    }
+
+    #ifdef WITH_SPECULAR
+    if( specular_enabled ) {
+        double rv;
+        vectNd_reflect(light_vec,hit_normal,&ls->light_ref,0.5);
+        vectNd_unitize(&ls->light_ref);
+        vectNd_scale(look,-1,&ls->rev_look);
+        vectNd_unitize(&ls->rev_look);
+        vectNd_dot(&ls->light_ref,&ls->rev_look,&rv);
+        rv = MAX(0,rv);
+        est += MAX(mtl->red_r * lgt->red_n, MAX(mtl->green_r * lgt->green_n,
+                    mtl->blue_r * lgt->blue_n)) * pow(rv,50);
+    }
+    #endif /* WITH_SPECULAR */
+
+    return est;
+}
+
+#ifndef WITHOUT_KDTREE
+/* this thread's cached occluder for light i */
+static inline int *occluder_slot(render_ctx_t *ctx, int i)
+{
+    if( ctx->occluder_epoch != light_views_epoch ) {
+        if( ctx->num_occluders < num_light_views ) {
+            free(ctx->occluders);
+            ctx->occluders = malloc(num_light_views*sizeof(int));
+            ctx->num_occluders = ctx->occluders ? num_light_views : 0;
+        }
+        for(int k=0; k<ctx->num_occluders; ++k)
+            ctx->occluders[k] = -1;
+        ctx->occluder_epoch = light_views_epoch;
+    }
+
+    if( i >= ctx->num_occluders )
+        return NULL;
+    return &ctx->occluders[i];
+}
+
+/*
+ * Whether view object id blocks the ray from pos along unit dir closer than
+ * limit (anywhere when limit is 0).  This is the test the full query makes
+ * of each object, and a hit only counts where the full query is sure to
+ * make it, so a cached occluder never changes the answer.
+ */
+static inline int occluder_blocks(int id, vectNd *pos, vectNd *dir,
+            double limit, render_ctx_t *ctx)
+{
+    vectNd *at = &ctx->ls.light_hit;
+    object *ptr = NULL;
+    double t = 0.0;
+    if( !trace_view(pos, dir, kdtree->view, &id, 1, NULL, at,
+            &ctx->ls.light_hit_normal, &ptr, &t, limit, &ctx->kd.res, &ctx->kd.normal) )
+        return 0;
+    if( limit != 0.0 && t >= limit )
+        return 0;
+
+    /* infinite objects are always tested in full */
+    object_view_t *ov = &kdtree->view->views[id];
+    if( ov->obj->bounds.radius < 0.0 )
+        return 1;
+
+    /* some types (hfacet) report hits outside their bounds, which the
+     * traversal can pass by, so only hits within them are trusted */
+    if( ov->radius > 0.0 ) {
+        double *center = kdtree->view->centers + (size_t)id*at->n;
+        double dist2 = 0.0;
+        for(int k=0; k<at->n; ++k)
+            dist2 += (at->v[k] - center[k]) * (at->v[k] - center[k]);
+        if( dist2 > ov->radius_sqr )
+            return 0;
+    }
+    return kd_tree_item_contains(kdtree, id, at);
+}
+
+/* view index to cache obj by, objects the view doesn't hold aren't cached */
+static inline int occluder_index(object *obj)
+{
+    return render_view_index(kdtree->view, obj);
+}
+#else
+/* without the kd-tree's view there is nothing to cache occluders by */
+static inline int *occluder_slot(render_ctx_t *ctx, int i)
+{
+    (void)ctx; (void)i;
+    return NULL;
+}
+
+static inline int occluder_blocks(int id, vectNd *pos, vectNd *dir,
+            double limit, render_ctx_t *ctx)
+{
+    (void)id; (void)pos; (void)dir; (void)limit; (void)ctx;
+    return 0;
+}
+
+static inline int occluder_index(object *obj)
+{
+    (void)obj;
+    return -1;
+}
+#endif /* !WITHOUT_KDTREE */
+
+/* add light i's contribution to the hit, scaled by weight, into clr */
+static inline int apply_light(scene *scn, object *obj_ptr, material_t *mtl, vectNd *src, vectNd *look, vectNd *hit, vectNd *hit_normal, int i, double weight, dbl_pixel_t *clr, sampler_t *smp, render_ctx_t *ctx) {
+    light_scratch_t *ls = &ctx->ls;
+    vectNd *rev_view = &ls->rev_view;
+    vectNd *rev_light = &ls->rev_light;
+    vectNd *light_vec = &ls->light_vec;
+    vectNd *light_hit = &ls->light_hit;
+    vectNd *light_hit_normal = &ls->light_hit_normal;
+    vectNd *lgt_pos = &ls->lgt_pos;
+    vectNd *near_pos = &ls->near_pos;
+    /* views are built per frame, from scn's lights */
+    if( i >= num_light_views || num_light_views != scn->num_lights )
+        return 0;
+    light_view_t *lgt = &light_views[i];
+    int *occluder = occluder_slot(ctx, i);
 
     /* get color of object */
-    obj_ptr->get_color(obj_ptr, hit, &hit_r, &hit_g, &hit_b);
+    double hit_r = mtl->red, hit_g = mtl->green, hit_b = mtl->blue;
 
     #ifdef WITH_SPECULAR
     double hitr_r = 0.0, hitr_g = 0.0, hitr_b = 0.0;
     if( specular_enabled ) {
         /* get reflectivity of object */
-        obj_ptr->get_reflect(obj_ptr, hit, &hitr_r, &hitr_g, &hitr_b);
+        hitr_r = mtl->red_r;
+        hitr_g = mtl->green_r;
+        hitr_b = mtl->blue_r;
     }
     #endif /* WITH_SPECULAR */
 
-    memset(&clr,'\0',sizeof(clr));
-    clr.r = hit_r * scn->ambient.red;
-    clr.g = hit_g * scn->ambient.green;
-    clr.b = hit_b * scn->ambient.blue;
-    clr.a = 1.0;
+    light_type lgt_type = lgt->type;
+    if( lgt_type == LIGHT_AMBIENT ) {
+        clr->r += weight * hit_r * lgt->red;
+        clr->g += weight * hit_g * lgt->green;
+        clr->b += weight * hit_b * lgt->blue;
+        return 0;
+    }
 
-    /* all of these are initialized within the loop */
-    vectNd_alloc(&rev_view,dim);
-    vectNd_alloc(&rev_light,dim);
-    vectNd_alloc(&light_vec,dim);
-    vectNd_alloc(&light_hit,dim);
-    vectNd_alloc(&light_hit_normal,dim);
-    vectNd_alloc(&lgt_pos,dim);
-    vectNd_alloc(&near_pos,dim);
-    int i=0;
-    for(i=0; i<scn->num_lights; ++i) {
+    /* copy location of actual light */
+    vectNd_copy(lgt_pos,&lgt->pos);
 
-        light_type lgt_type = scn->lights[i]->type;
-        if( lgt_type == LIGHT_AMBIENT ) {
-            clr.r += hit_r * scn->lights[i]->red;
-            clr.g += hit_g * scn->lights[i]->green;
-            clr.b += hit_b * scn->lights[i]->blue;
-            continue;
+    if( lgt_type == LIGHT_DISK ||
+        lgt_type == LIGHT_RECT ) {
+        /* move light to a random point on areal light */
+        double x,y,u,v;
+        vectNd *temp = &ls->temp;
+
+        /* get one sample */
+        /* re-sampling happens at the pixel level */
+        sampler_get_2d(smp, &u, &v);
+        if( lgt_type == LIGHT_DISK ) {
+            sampler_disk(u, v, &x, &y);
+        } else {
+            x = 2 * u - 1.0;
+            y = 2 * v - 1.0;
         }
 
-        /* copy location of actual light */
-        vectNd_copy(&lgt_pos,&scn->lights[i]->pos);
+        /* map point onto light surface */
+        vectNd_scale(&lgt->u1,x,temp);
+        vectNd_add(lgt_pos,temp,lgt_pos);
+        vectNd_scale(&lgt->v1,y,temp);
+        vectNd_add(lgt_pos,temp,lgt_pos);
 
-        if( lgt_type == LIGHT_DISK ||
-            lgt_type == LIGHT_RECT ) {
-            /* move light to a random point on areal light */
-            double x,y;
-            vectNd temp;
-            vectNd_alloc(&temp,scn->lights[i]->pos.n);
+        /* treat sampled point as a regular point light source */
+        lgt_type = LIGHT_POINT;
+    }
 
-            if( scn->lights[i]->prepared == 0 ) {
-                scene_prepare_light(scn->lights[i]);
-            }
+    if( lgt_type == LIGHT_POINT ||
+        lgt_type == LIGHT_DIRECTIONAL ||
+        lgt_type == LIGHT_SPOT ) {
+        /* determine if light is in correct direction */
+        if( lgt_type == LIGHT_POINT ||
+            lgt_type == LIGHT_SPOT ) {
+            vectNd_sub(lgt_pos, hit, rev_light);
+            vectNd_unitize(rev_light);
+        } else if( lgt_type == LIGHT_DIRECTIONAL ) {
+            vectNd_scale(&lgt->dir, -1, rev_light);
+        }
+        vectNd_sub(src, hit, rev_view);
+        double dotRev1, dotRev2;
+        vectNd_dot(rev_light, hit_normal,&dotRev1);
+        vectNd_dot(rev_view, hit_normal,&dotRev2);
+        if( (dotRev1*dotRev2) <= 0 ) {
+            /* light and observer are on opposite sides of the surface */
+            /*printf("light on the wrong side of surface\n");*/
+            return 0;
+        }
+    }
+
+    if( lgt_type == LIGHT_POINT
+        || lgt_type == LIGHT_SPOT
+        || lgt_type == LIGHT_DIRECTIONAL ) {
+        object *light_obj_ptr=NULL;
+        int got_hit = 0;
 
-            double radius = scn->lights[i]->radius;
-            /* get one random sample */
-            /* re-sampling happens at the pixel level */
-            do {
-                x = 2 * drand48() - 1.0;
-                y = 2 * drand48() - 1.0;
-                /* reject any samples outside unit circle */
-                /* see: Ray Tracing From The Ground Up, p. 120 */
-            } while (lgt_type == LIGHT_DISK && x*x + y*y > 1.0 );
-
-            /* map point onto light surface */
-            vectNd_scale(&scn->lights[i]->u1,x*radius,&temp);
-            vectNd_add(&lgt_pos,&temp,&lgt_pos);
-            vectNd_scale(&scn->lights[i]->v1,y*radius,&temp);
-            vectNd_add(&lgt_pos,&temp,&lgt_pos);
-
-            /* treat sampled point as a regular point light source */
-            lgt_type = LIGHT_POINT;
-
-            vectNd_free(&temp);
+        /* dist_limit meanings:
+         *  <0 check all objects
+         *  0 stop if any hit found
+         *  >0 stop if hit found within limit
+         */
+        double dist_limit = -1.0;
+        if( lgt_type == LIGHT_DIRECTIONAL ) {
+            dist_limit = 0.0;
+        } else if( lgt_type == LIGHT_POINT
+                || lgt_type == LIGHT_SPOT ) {
+            /* anything reached before the hit point shadows it */
+            vectNd_dist(hit,lgt_pos,&dist_limit);
+            dist_limit = MAX(dist_limit - EPSILON, EPSILON);
         }
 
+        double ldist2=1.0;
         if( lgt_type == LIGHT_POINT ||
-            lgt_type == LIGHT_DIRECTIONAL ||
             lgt_type == LIGHT_SPOT ) {
-            /* determine if light is in correct direction */
-            if( lgt_type == LIGHT_POINT ||
-                lgt_type == LIGHT_SPOT ) {
-                vectNd_sub(&lgt_pos, hit, &rev_light);
-            } else if( scn->lights[i]->type == LIGHT_DIRECTIONAL ) {
-                vectNd_scale(&scn->lights[i]->dir, -1, &rev_light);
-            }
-            vectNd_unitize(&rev_light);
-            vectNd_sub(src, hit, &rev_view);
-            double dotRev1, dotRev2;
-            vectNd_dot(&rev_light, hit_normal,&dotRev1);
-            vectNd_dot(&rev_view, hit_normal,&dotRev2);
-            if( (dotRev1*dotRev2) <= 0 ) {
-                /* light and observer are on opposite sides of the surface */
-                /*printf("light on the wrong side of surface\n");*/
-                continue;
+            vectNd_sub(hit, lgt_pos, light_vec);
+            /* get distance squared, needed for diffuse lighting */
+            vectNd_dot(light_vec,light_vec,&ldist2);
+            vectNd_unitize(light_vec);
+
+            /* check that hit point is within cone of light for
+             * spotlight, skip tracing path if not */
+            if( lgt_type == LIGHT_SPOT ) {
+                double cos_angle;
+                vectNd_dot(&lgt->dir,light_vec,&cos_angle);
+                if( cos_angle < lgt->cos_angle ) {
+                    return 0;
+                }
             }
-        }
 
-        if( lgt_type == LIGHT_POINT
-            || lgt_type == LIGHT_SPOT
-            || lgt_type == LIGHT_DIRECTIONAL ) {
-            object *light_obj_ptr=NULL;
-            int got_hit = 0;
-
-            /* dist_limit meanings:
-             *  <0 check all objects
-             *  0 stop if any hit found
-             *  >0 stop if hit found withing limit
-             */
-            double dist_limit = -1.0;
-            if( lgt_type == LIGHT_DIRECTIONAL ) {
-                dist_limit = 0.0;
-            } else if( lgt_type == LIGHT_POINT
-                    || lgt_type == LIGHT_SPOT ) {
-                vectNd_dist(hit,&lgt_pos,&dist_limit);
-                dist_limit += EPSILON;
+            /* skip the shadow ray when the light can't add a visible amount */
+            if( light_cull > 0.0
+                && weight * light_estimate(lgt, mtl, look, hit_normal,
+                            light_vec, ldist2, ls) < light_cull ) {
+                return 0;
             }
 
-            double ldist2=1.0;
-            if( lgt_type == LIGHT_POINT ||
-                lgt_type == LIGHT_SPOT ) {
-                vectNd_sub(hit, &lgt_pos, &light_vec);
-                /* get distance squared, needed for diffuse lighting */
-                vectNd_dot(&light_vec,&light_vec,&ldist2);
-                vectNd_unitize(&light_vec);
-
-                /* check that hit point is within cone of light for
-                 * spotlight, skip tracing path if not */
-                if( lgt_type == LIGHT_SPOT ) {
-                    double angle = -1;
-                    vectNd_angle(&scn->lights[i]->dir,&light_vec,&angle);
-                    if( (angle*180.0/M_PI) > scn->lights[i]->angle ) {
-                        continue;
-                    }
+            /* whatever blocked this light last time is likely to again */
+            if( occluder && *occluder >= 0 ) {
+                if( occluder_blocks(*occluder, lgt_pos, light_vec, dist_limit, ctx) ) {
+                    ctx->occluder_hits += 1;
+                    return 0;
                 }
+                ctx->occluder_misses += 1;
+            }
 
-                /* trace from light to object */
-                #ifndef WITHOUT_KDTREE
-                got_hit = trace_kd(&lgt_pos, &light_vec, &kdtree,
-                    &light_hit, &light_hit_normal, &light_obj_ptr, dist_limit);
-                #else
-                got_hit = trace(&lgt_pos, &light_vec, scn->object_ptrs, scn->num_objects,
-                    &light_hit, &light_hit_normal, &light_obj_ptr, dist_limit);
-                #endif /* !WITHOUT_KDTREE */
-                if( !got_hit || light_obj_ptr != obj_ptr ) {
-                    /* light didn't hit the target object */
-                    continue;
+            /* trace from light to object */
+            ctx->rays += 1;
+            #ifndef WITHOUT_KDTREE
+            got_hit = trace_kd(lgt_pos, light_vec, kdtree,
+                light_hit, light_hit_normal, &light_obj_ptr, dist_limit, &ctx->kd);
+            #else
+            got_hit = trace(lgt_pos, light_vec, scn->object_ptrs, NULL, scn->num_objects, NULL,
+                light_hit, light_hit_normal, &light_obj_ptr, NULL, dist_limit);
+            #endif /* !WITHOUT_KDTREE */
+            if( got_hit ) {
+                double dist = 0.0;
+                vectNd_dist(lgt_pos,light_hit,&dist);
+                if( dist < dist_limit ) {
+                    /* something, maybe the object itself, is in the way */
+                    if( occluder )
+                        *occluder = occluder_index(light_obj_ptr);
+                    return 0;
                 }
+            }
 
-                double dist = 1000;
-                vectNd_dist(hit,&light_hit,&dist);
-                /* verify we hit the right point with the light */
-                if( dist > EPSILON ) {
-                    /* light didn't hit the same point on the object */
-                    continue;
+            /* lit, so stop testing the old occluder until shadowed again */
+            if( occluder )
+                *occluder = -1;
+            vectNd_copy(light_hit, hit);
+            vectNd_copy(light_hit_normal, hit_normal);
+
+        } else if( lgt_type == LIGHT_DIRECTIONAL ) {
+            /* trace from object towards light */
+            vectNd_scale(&lgt->dir,-EPSILON,near_pos);
+            vectNd_add(near_pos,hit,near_pos);
+            if( occluder && *occluder >= 0 ) {
+                if( occluder_blocks(*occluder, near_pos, rev_light, 0.0, ctx) ) {
+                    ctx->occluder_hits += 1;
+                    return 0;
                 }
+                ctx->occluder_misses += 1;
+            }
+            ctx->rays += 1;
+            #ifndef WITHOUT_KDTREE
+            got_hit = trace_kd(near_pos, rev_light, kdtree,
+                light_hit, light_hit_normal, &light_obj_ptr, 0.0, &ctx->kd);
+            #else
+            got_hit = trace(near_pos, rev_light, scn->object_ptrs, NULL, scn->num_objects, NULL,
+                light_hit, light_hit_normal, &light_obj_ptr, NULL, 0.0);
+            #endif /* !WITHOUT_KDTREE */
 
-            } else if( lgt_type == LIGHT_DIRECTIONAL ) {
-                /* trace from object towards light */
-                vectNd_copy(&near_pos,&scn->lights[i]->dir);
-                vectNd_unitize(&near_pos);
-                vectNd_scale(&near_pos,-EPSILON,&near_pos);
-                vectNd_add(&near_pos,hit,&near_pos);
-                vectNd_scale(&scn->lights[i]->dir, -1.0, &light_vec);
-                #ifndef WITHOUT_KDTREE
-                got_hit = trace_kd(&near_pos, &rev_light, &kdtree,
-                    &light_hit, &light_hit_normal, &light_obj_ptr, 0.0);
-                #else
-                got_hit = trace(&near_pos, &rev_light, scn->object_ptrs, scn->num_objects,
-                    &light_hit, &light_hit_normal, &light_obj_ptr, 0.0);
-                #endif /* !WITHOUT_KDTREE */
-
-                /* success is not hitting anything */
-                if( got_hit ) {
-                    /* something between object and infinity */
-                    continue;
-                }
+            /* success is not hitting anything */
+            if( got_hit ) {
+                /* something between object and infinity */
+                if( occluder )
+                    *occluder = occluder_index(light_obj_ptr);
+                return 0;
+            }
+            if( occluder )
+                *occluder = -1;
 
-                /* prep vectors for remainder of computations */
-                vectNd_copy(&light_vec, &scn->lights[i]->dir);
-                vectNd_copy(&light_hit, hit);
-                vectNd_copy(&light_hit_normal, hit_normal);
-                light_obj_ptr = obj_ptr;
+            /* prep vectors for remainder of computations */
+            vectNd_copy(light_vec, &lgt->dir);
+            vectNd_copy(light_hit, hit);
+            vectNd_copy(light_hit_normal, hit_normal);
+            light_obj_ptr = obj_ptr;
 
-                /* distance is irrelevant for diffuse lighting */
-                ldist2 = 1;
-            }
+            /* distance is irrelevant for diffuse lighting */
+            ldist2 = 1;
+        }
 
-            double angle = -1;
-            double light_scale = 1;
-            vectNd_angle(hit_normal,&light_vec,&angle);
-
-            /* diffuse lighting */
-            if( angle > M_PI / 2.0 )
-                angle = M_PI - angle;
-            light_scale = cos(angle) / ldist2;
-            if( !obj_ptr->transparent ) {
-                clr.r += hit_r * scn->lights[i]->red * light_scale;
-                clr.g += hit_g * scn->lights[i]->green * light_scale;
-                clr.b += hit_b * scn->lights[i]->blue * light_scale;
-            }
+        /* diffuse lighting */
+        double light_scale = light_cos(hit_normal,light_vec) / ldist2;
+        if( !mtl->transparent ) {
+            clr->r += weight * hit_r * lgt->red * light_scale;
+            clr->g += weight * hit_g * lgt->green * light_scale;
+            clr->b += weight * hit_b * lgt->blue * light_scale;
         }
+    }
 
-        #ifdef WITH_SPECULAR
-        if( lgt_type == LIGHT_POINT ||
-            lgt_type == LIGHT_SPOT ||
-            lgt_type == LIGHT_DIRECTIONAL ) {
-            if( specular_enabled ) {
-                /* specular highlighting */
-                /* see: http://en.wikipedia.org/wiki/Specular_highlight */
-                /* note: wikipedia doesn't mention that these have to be unit vectors */
-                /* slide 28 of
-                 * http://www.eng.utah.edu/~cs5600/slides/Wk%2013%20Ray%20Tracing.pdf
-                 * looks interesting. */
-                vectNd light_ref;
-                vectNd_alloc(&light_ref,dim);
-                vectNd_reflect(&light_vec,&light_hit_normal,&light_ref,0.5);
-
-                double rv;
-                vectNd rev_look;
-                vectNd_alloc(&rev_look,look->n);
-                vectNd_unitize(&light_ref);
-                vectNd_scale(look,-1,&rev_look);
-                vectNd_unitize(&rev_look);
-                vectNd_dot(&light_ref,&rev_look,&rv);
-                vectNd_free(&rev_look);
-                rv = MAX(0,rv);
-                double rvn = pow(rv,50);
-
-                double max_light = MAX(scn->lights[i]->red, MAX(scn->lights[i]->green, scn->lights[i]->blue));
-                clr.r += hitr_r * scn->lights[i]->red/max_light * rvn;
-                clr.g += hitr_g * scn->lights[i]->green/max_light * rvn;
-                clr.b += hitr_b * scn->lights[i]->blue/max_light * rvn;
-                clr.a = 1.0;
-
-                vectNd_free(&light_ref);
-            }
+    #ifdef WITH_SPECULAR
+    if( lgt_type == LIGHT_POINT ||
+        lgt_type == LIGHT_SPOT ||
+        lgt_type == LIGHT_DIRECTIONAL ) {
+        if( specular_enabled ) {
+            /* specular highlighting */
+            /* see: http://en.wikipedia.org/wiki/Specular_highlight */
+            /* note: wikipedia doesn't mention that these have to be unit vectors */
+            /* slide 28 of
+             * http://www.eng.utah.edu/~cs5600/slides/Wk%2013%20Ray%20Tracing.pdf
+             * looks interesting. */
+            vectNd *light_ref = &ls->light_ref;
+            vectNd_reflect(light_vec,light_hit_normal,light_ref,0.5);
+
+            double rv;
+            vectNd *rev_look = &ls->rev_look;
+            vectNd_unitize(light_ref);
+            vectNd_scale(look,-1,rev_look);
+            vectNd_unitize(rev_look);
+            vectNd_dot(light_ref,rev_look,&rv);
+            rv = MAX(0,rv);
+            double rvn = pow(rv,50);
+
+            clr->r += weight * hitr_r * lgt->red_n * rvn;
+            clr->g += weight * hitr_g * lgt->green_n * rvn;
+            clr->b += weight * hitr_b * lgt->blue_n * rvn;
+            clr->a = 1.0;
+        }
+    }
+    #else
+    #warning "Specular highlighting not enabled."
+    #endif /* WITH_SPECULAR */
+
+    return 1;
+}
+
+static inline int apply_lights(scene *scn, object *obj_ptr, material_t *mtl, vectNd *src, vectNd *look, vectNd *hit, vectNd *hit_normal, dbl_pixel_t *color, sampler_t *smp, render_ctx_t *ctx) {
+    dbl_pixel_t clr;
+
+    memset(&clr,'\0',sizeof(clr));
+    clr.r = mtl->red * scn->ambient.red;
+    clr.g = mtl->green * scn->ambient.green;
+    clr.b = mtl->blue * scn->ambient.blue;
+    clr.a = 1.0;
+
+    /* lights in the tree are sampled below instead of visited here */
+    int sample_tree = light_samples > 0 && light_tree.num_lights > 0;
+    for(int i=0; i<scn->num_lights; ++i) {
+        if( sample_tree && light_tree_includes(scn->lights[i]) )
+            continue;
+        apply_light(scn,obj_ptr,mtl,src,look,hit,hit_normal,i,1.0,&clr,smp,ctx);
+    }
+
+    if( sample_tree ) {
+        /* pick lights by importance, weighting each by 1/(pdf*samples) */
+        for(int k=0; k<light_samples; ++k) {
+            double u, v, pdf = 0.0;
+            int pick = -1;
+            sampler_get_2d(smp, &u, &v);
+            if( light_tree_sample(&light_tree, hit, u, &pick, &pdf) < 0 || pdf <= 0.0 )
+                continue;
+            apply_light(scn,obj_ptr,mtl,src,look,hit,hit_normal,pick,
+                        1.0/(pdf*light_samples),&clr,smp,ctx);
         }
-        #else
-        #warning "Specular highlighting not enabled."
-        #endif /* WITH_SPECULAR */
     }
-    vectNd_free(&lgt_pos);
-    vectNd_free(&near_pos);
-    vectNd_free(&light_vec);
-    vectNd_free(&light_hit);
-    vectNd_free(&light_hit_normal);
-    vectNd_free(&rev_light);
-    vectNd_free(&rev_view);
 
     memcpy(color,&clr,sizeof(clr));
 
     return 0;
 }
-    
+
+/*
+ * Whether a secondary ray with weight w, spawned at the given bounce with
+ * depth left, gets traced.  Past russian_roulette bounces rays survive with
+ * probability equal to their weight (and w is boosted to compensate),
+ * otherwise rays under 1/512th of the pixel are dropped.
+ */
+static inline int ray_survives(int bounce, int depth, double *w, double frac, sampler_t *smp)
+{
+    if( depth <= 0 )
+        return 0;
+
+    if( russian_roulette > 0 && bounce >= russian_roulette ) {
+        double p = MIN(1.0, MAX(w[0], MAX(w[1], w[2])));
+        if( p <= 0.0 || rng_double(&smp->rng) >= p )
+            return 0;
+        w[0] /= p;
+        w[1] /= p;
+        w[2] /= p;
+    } else if( russian_roulette <= 0 && frac < (1.0/512.0) ) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* queue a secondary ray, returning the job to fill in or NULL if pruned */
+static inline ray_job_t *ray_stack_push(render_ctx_t *ctx, int bounce, int depth,
+            double *w, double frac, sampler_t *smp)
+{
+    if( !ray_survives(bounce, depth, w, frac, smp) )
+        return NULL;
+
+    ray_job_t *job = &ctx->jobs[ctx->num++];
+    job->r = w[0];
+    job->g = w[1];
+    job->b = w[2];
+    job->frac = frac;
+    job->depth = depth;
+
+    return job;
+}
+
+/*
+ * Shade a ray with weight w that hit obj_ptr: adds its weighted local
+ * colour to pixel and sets the weights of the reflected and refracted
+ * rays it spawns (all zero for none), along with their pixel shares.
+ * Returns the material, which the caller needs for the refraction index.
+ */
+static inline material_t *shade_hit(scene *scn, object *obj_ptr,
+            vectNd *src, vectNd *look, vectNd *hit, vectNd *hit_normal,
+            double *w, double frac, dbl_pixel_t *pixel, sampler_t *smp,
+            material_t *scratch, double *refl_w, double *refl_frac,
+            double *trans_w, double *trans_frac, render_ctx_t *ctx)
+{
+    /* get shading data of object */
+    #ifndef WITHOUT_KDTREE
+    material_t *mtl = object_material(kdtree->view, obj_ptr, hit, scratch);
+    #else
+    material_t *mtl = object_material(NULL, obj_ptr, hit, scratch);
+    #endif /* !WITHOUT_KDTREE */
+
+    dbl_pixel_t clr;
+    apply_lights(scn,obj_ptr,mtl,src,look,hit,hit_normal,&clr,smp,ctx);
+
+    /* get reflectivity of object */
+    double hitr_r = mtl->red_r, hitr_g = mtl->green_r, hitr_b = mtl->blue_r;
+    double contrib = MAX(hitr_r,MAX(hitr_g,hitr_b));
+
+    /* compute reflection and refraction */
+    /* see:
+     * http://www.unc.edu/~marzuola/Math547_S13/Math547_S13_Projects/P_Smith_Section001_RayTracing.pdf
+     */
+    double l_r = w[0], l_g = w[1], l_b = w[2];
+    #ifdef WITH_SPECULAR
+    if( specular_enabled && contrib > 0 ) {
+        /* reflection replaces part of the surface colour */
+        l_r *= 1-hitr_r;
+        l_g *= 1-hitr_g;
+        l_b *= 1-hitr_b;
+    }
+    #endif /* WITH_SPECULAR */
+    pixel->r += l_r*clr.r;
+    pixel->g += l_g*clr.g;
+    pixel->b += l_b*clr.b;
+
+    /* apply reflectivity */
+    refl_w[0] = refl_w[1] = refl_w[2] = 0.0;
+    if( contrib > 0 ) {
+        refl_w[0] = w[0]*hitr_r;
+        refl_w[1] = w[1]*hitr_g;
+        refl_w[2] = w[2]*hitr_b;
+    }
+    *refl_frac = contrib*frac;
+
+    /* apply transparency */
+    trans_w[0] = trans_w[1] = trans_w[2] = 0.0;
+    if( mtl->transparent ) {
+        trans_w[0] = w[0]*(1.0-hitr_r);
+        trans_w[1] = w[1]*(1.0-hitr_g);
+        trans_w[2] = w[2]*(1.0-hitr_b);
+    }
+    *trans_frac = (1-contrib)*frac;
+
+    return mtl;
+}
+
 /* get color of ray r,g,b \in [0,1] */
+/*
+ * Reflected and refracted rays are walked depth first from a per thread
+ * stack rather than by recursion.  Each ray carries the weight its colour
+ * has in the result, so the result is the weighted sum of the local
+ * shading of every ray in the tree.
+ */
 int get_ray_color(vectNd *src, vectNd *unit_look, scene *scn, dbl_pixel_t *pixel,
-            double pixel_frac, double *depth, int max_depth)
+            double pixel_frac, double *depth, int max_depth, sampler_t *smp,
+            render_ctx_t *ctx)
 {
     int ret = 0;
 
@@ -340,112 +842,93 @@ int get_ray_color(vectNd *src, vectNd *unit_look, scene *scn, dbl_pixel_t *pixel
     if( max_depth <= 0 )
         return 1;
 
-    vectNd hit;
-    vectNd hit_normal;
-    object *obj_ptr=NULL;
-    int dim = src->n;
-    dbl_pixel_t clr;
-
-    memset(&clr,'\0',sizeof(clr));
-
-    /* trace from camera to possible object */
-    vectNd_calloc(&hit,dim);
-    vectNd_calloc(&hit_normal,dim);
+    /* each ray popped pushes at most two, so max_depth+1 always fits */
+    ctx->num = 0;
+    vectNd *ray_src = &ctx->src;
+    vectNd *ray_look = &ctx->look;
+    vectNd *hit = &ctx->hit;
+    vectNd *hit_normal = &ctx->hit_normal;
+
+    ray_job_t *root = &ctx->jobs[ctx->num++];
+    vectNd_copy(&root->src, src);
+    vectNd_copy(&root->look, unit_look);
+    root->r = root->g = root->b = 1.0;
+    root->frac = pixel_frac;
+    root->depth = max_depth;
+
+    int first = 1;
+    while( ctx->num > 0 ) {
+        /* pop, copying out the ray since children reuse its slot */
+        ray_job_t *job = &ctx->jobs[--ctx->num];
+        vectNd_copy(ray_src, &job->src);
+        vectNd_copy(ray_look, &job->look);
+        double w_r = job->r, w_g = job->g, w_b = job->b;
+        double frac = job->frac;
+        int job_depth = job->depth;
+        int bounce = max_depth - job_depth + 1;
+
+        /* trace from ray origin to possible object */
+        object *obj_ptr = NULL;
+        ctx->rays += 1;
+        #ifndef WITHOUT_KDTREE
+        trace_kd(ray_src, ray_look, kdtree, hit, hit_normal, &obj_ptr, -1.0, &ctx->kd);
+        #else
+        trace(ray_src, ray_look, scn->object_ptrs, NULL, scn->num_objects, NULL, hit, hit_normal, &obj_ptr, NULL, -1.0);
+        #endif /* !WITHOUT_KDTREE */
 
-    obj_ptr = NULL;
-    #ifndef WITHOUT_KDTREE
-    trace_kd(src, unit_look, &kdtree, &hit, &hit_normal, &obj_ptr, -1.0);
-    #else
-    trace(src, unit_look, scn->object_ptrs, scn->num_objects, &hit, &hit_normal, &obj_ptr, -1.0);
-    #endif /* !WITHOUT_KDTREE */
+        double trace_dist = -1;
+        if( obj_ptr != NULL )
+            vectNd_dist(hit,ray_src,&trace_dist);
 
-    /* record depth for depth maps */
-    double trace_dist = -1;
-    if( obj_ptr != NULL || depth != NULL ) {
-        vectNd_dist(&hit,src,&trace_dist);
-        if( depth != NULL ) {
-            /* record distance to hit */
-            if( trace_dist > EPSILON )
+        /* record depth for depth maps */
+        if( first && depth != NULL ) {
+            if( obj_ptr == NULL )
+                *depth = 0.0;
+            else if( trace_dist > EPSILON )
                 *depth = 1.0/trace_dist;
         }
-    }
-    if( obj_ptr == NULL && depth != NULL )
-        *depth = 0.0;
-
-    /* apply light */
-    if( obj_ptr != NULL && trace_dist > EPSILON )
-    {
-        apply_lights(scn,dim,obj_ptr,src,unit_look,&hit,&hit_normal,&clr);
-
-        #if 1
-        /* get reflectivity of object */
-        double hitr_r, hitr_g, hitr_b;
-        obj_ptr->get_reflect(obj_ptr, &hit, &hitr_r, &hitr_g, &hitr_b);
-
-        /* compute reflection and refraction */
-        /* see:
-         * http://www.unc.edu/~marzuola/Math547_S13/Math547_S13_Projects/P_Smith_Section001_RayTracing.pdf
-         */
-        dbl_pixel_t ref;
-        vectNd new_ray;
-        vectNd_alloc(&new_ray,dim);
 
-        double contrib = MAX(hitr_r,MAX(hitr_g,hitr_b));
-        if(contrib > 0 ) {
-
-            /* apply reflectivity */
-            if( hitr_r != 0.0 || hitr_g != 0.0 || hitr_b != 0.0 ) {
-                vectNd_reflect(unit_look,&hit_normal,&new_ray,1.0);
-                vectNd_unitize(&new_ray);
+        if( obj_ptr != NULL && trace_dist > EPSILON ) {
+            double w[3] = { w_r, w_g, w_b };
+            double refl_w[3], trans_w[3], refl_frac, trans_frac;
+            material_t scratch;
+            material_t *mtl = shade_hit(scn, obj_ptr, ray_src, ray_look,
+                        hit, hit_normal, w, frac, pixel, smp, &scratch,
+                        refl_w, &refl_frac, trans_w, &trans_frac, ctx);
+
+            if( refl_w[0] > 0 || refl_w[1] > 0 || refl_w[2] > 0 ) {
+                ray_job_t *child = ray_stack_push(ctx, bounce, job_depth-1,
+                            refl_w, refl_frac, smp);
+                if( child != NULL ) {
+                    vectNd_reflect(ray_look,hit_normal,&child->look,1.0);
+                    vectNd_unitize(&child->look);
+                    vectNd_copy(&child->src,hit);
+                }
+            }
 
-                /* set color based on actual reflection */
-                get_ray_color(&hit,&new_ray,scn,&ref, contrib*pixel_frac, NULL, max_depth-1);
-                #ifdef WITH_SPECULAR
-                if( specular_enabled ) {
-                    clr.r = (1-hitr_r)*(clr.r)+(hitr_r)*ref.r;
-                    clr.g = (1-hitr_g)*(clr.g)+(hitr_g)*ref.g;
-                    clr.b = (1-hitr_b)*(clr.b)+(hitr_b)*ref.b;
-                    clr.a = 1.0;
-                } else {
-                #endif /* WITH_SPECULAR */
-                    clr.r += hitr_r*ref.r;
-                    clr.g += hitr_g*ref.g;
-                    clr.b += hitr_b*ref.b;
-                    clr.a = 1.0;
-                #ifdef WITH_SPECULAR
+            if( mtl->transparent ) {
+                ray_job_t *child = ray_stack_push(ctx, bounce, job_depth-1,
+                            trans_w, trans_frac, smp);
+                if( child != NULL ) {
+                    vectNd_refract(ray_look,hit_normal,&child->look,mtl->refract_index);
+                    vectNd_unitize(&child->look);
+                    vectNd_copy(&child->src,hit);
                 }
-                #endif /* WITH_SPECULAR */
             }
-        }
 
-        /* apply transparency */
-        if( obj_ptr->transparent ) {
-            vectNd_refract(unit_look,&hit_normal,&new_ray,obj_ptr->refract_index);
-            vectNd_unitize(&new_ray);
-            get_ray_color(&hit,&new_ray,scn,&ref, (1-contrib)*pixel_frac, NULL, max_depth-1);
-            clr.r += (1.0-hitr_r)*ref.r;
-            clr.g += (1.0-hitr_g)*ref.g;
-            clr.b += (1.0-hitr_b)*ref.b;
-            clr.a = 1.0;
+            if( first )
+                ret = 1;
+        } else {
+            /* didn't hit an object, so use background color */
+            pixel->r += w_r*scn->bg_red;
+            pixel->g += w_g*scn->bg_green;
+            pixel->b += w_b*scn->bg_blue;
+            if( first )
+                pixel->a = scn->bg_alpha;
         }
-
-        vectNd_free(&new_ray);
-        #endif /* 1 */
-
-        ret = 1;
-    } else {
-        /* didn't hit an object, so use background color */
-        clr.r = scn->bg_red;
-        clr.g = scn->bg_green;
-        clr.b = scn->bg_blue;
-        clr.a = scn->bg_alpha;
-        ret = 0;
+        first = 0;
     }
 
-    memcpy(pixel,&clr,sizeof(clr));
-    vectNd_free(&hit);
-    vectNd_free(&hit_normal);
-
     return ret;
 }
 
@@ -453,129 +936,101 @@ typedef enum camera_mode_t {
     CAM_LEFT, CAM_CENTER, CAM_RIGHT
 } camera_mode;
 
-int get_pixel_color(scene *scn, int width, int height, double x, double y,
-    dbl_pixel_t *clr, int samples, camera_mode mode, double *depth,
-    int max_optic_depth)
+/* primary ray and sampler for camera sample index of samples planned */
+static void camera_ray(scene *scn, int width, int height, double x, double y,
+    int index, int samples, camera_mode mode, sampler_t *smp,
+    vectNd *virtCam, vectNd *look, render_ctx_t *ctx)
 {
-    vectNd look;
-    vectNd pixel;
-    vectNd virtCam;
-    vectNd temp;
-    int dim = scn->cam.pos.n;
+    vectNd *pixel = &ctx->cam_pixel;
+    vectNd *temp = &ctx->cam_temp;
 
     /* compute look vector */
     /* pixelPos = cam.imgOrig + x*cam.dirX + y*cam.dirY */
     /* look = pixelPos - cam.pos */
-    vectNd_alloc(&pixel,dim);
-    vectNd_alloc(&virtCam,dim);
-    vectNd_alloc(&look,dim);
-    vectNd_alloc(&temp,dim);
-
-    int min_samples = samples;
-    int max_samples = 10000;
-    double max_diff = 1.0/256.0;
-    double clr_diff = 256;
-
-    dbl_pixel_t t_clr;
-    t_clr.r = t_clr.g = t_clr.b = t_clr.a = 0.0;
-    int t_samples = 0;
-    int i=0;
+
     double pixel_width = 1.0/width;
     double pixel_height = 1.0/height;
-    double orig_x, orig_y;
-    orig_x = x;
-    orig_y = y;
-    for(i=0; i<min_samples || (i<max_samples && clr_diff > max_diff); ++i) {
-        dbl_pixel_t l_clr;
-
-        switch(mode) {
-            case CAM_LEFT:
-                vectNd_copy(&virtCam,&scn->cam.leftEye);
-                break;
-            case CAM_RIGHT:
-                vectNd_copy(&virtCam,&scn->cam.rightEye);
-                break;
-            case CAM_CENTER:
-            default:
-                vectNd_copy(&virtCam,&scn->cam.pos);
-                break;
-        }
-
-        /* apply pixel sampling for anti-aliasing */
-        if( recursive_aa == 0 && samples > 1 ) {
-            double dx,dy;
-            /* perturb look vector slightly */
-            /* see: Ray Tracing From The Ground Up, p. 172 */
-            dx = drand48();
-            dy = drand48();
 
-            x = orig_x + dx * pixel_width;
-            y = orig_y + dy * pixel_height;
-        }
+    /* key random streams on the pixel position and eye */
+    uint64_t pixel_key = rng_hash_double(x) ^ rng_mix(rng_hash_double(y) + mode);
+    double lens_u, lens_v;
+    sampler_start(smp, sampler_type, render_frame, pixel_key, index, samples);
+
+    switch(mode) {
+        case CAM_LEFT:
+            vectNd_copy(virtCam,&scn->cam.leftEye);
+            break;
+        case CAM_RIGHT:
+            vectNd_copy(virtCam,&scn->cam.rightEye);
+            break;
+        case CAM_CENTER:
+        default:
+            vectNd_copy(virtCam,&scn->cam.pos);
+            break;
+    }
 
-        double focal_dist = scn->cam.focal_distance;
-        camera_target_point(&scn->cam, x, y, focal_dist, &pixel);
+    /* pixel and lens always take the first two dimensions */
+    double dx,dy;
+    sampler_get_2d(smp, &dx, &dy);
+    sampler_get_2d(smp, &lens_u, &lens_v);
+
+    /* apply pixel sampling for anti-aliasing */
+    if( recursive_aa == 0 && samples > 1 ) {
+        /* perturb look vector slightly */
+        /* see: Ray Tracing From The Ground Up, p. 172 */
+        x = x + dx * pixel_width;
+        y = y + dy * pixel_height;
+    }
 
-        if( scn->cam.type == CAMERA_VR || scn->cam.type == CAMERA_PANO ) {
-            /* For VR, rotate camera around CAM_CENTER point */
-            if( mode != CAM_CENTER ) {
-                double azi = x * scn->cam.hFov;
-                vectNd_rotate2(&virtCam,&scn->cam.pos,&scn->cam.localX,&scn->cam.localZ,azi,&virtCam);
-            }
-        }
+    double focal_dist = scn->cam.focal_distance;
+    camera_target_point(&scn->cam, x, y, focal_dist, pixel, temp);
 
-        /* apply aperture sampling for depth of field */
-        if( recursive_aa != 0 || samples > 1 ) {
-            double x,y;
-            /* perturb look vector slightly */
-            /* see: Ray Tracing From The Ground Up, p. 171 */
-            do {
-                x = 2 * drand48() - 1.0;
-                y = 2 * drand48() - 1.0;
-                /* reject any samples outside unit circle */
-                /* see: Ray Tracing From The Ground Up, p. 120 */
-            } while (x*x + y*y > 1.0 );
-            vectNd_scale(&scn->cam.localX, x*scn->cam.aperture_radius, &temp);
-            vectNd_add(&virtCam, &temp, &virtCam);
-            vectNd_scale(&scn->cam.localY, y*scn->cam.aperture_radius, &temp);
-            vectNd_add(&virtCam, &temp, &virtCam);
+    if( scn->cam.type == CAMERA_VR || scn->cam.type == CAMERA_PANO ) {
+        /* For VR, rotate camera around CAM_CENTER point */
+        if( mode != CAM_CENTER ) {
+            double azi = x * scn->cam.hFov;
+            vectNd_rotate2(virtCam,&scn->cam.pos,&scn->cam.localX,&scn->cam.localZ,azi,virtCam);
         }
+    }
 
-        /* compute primary ray to use */
-        vectNd_sub(&pixel, &virtCam, &look);
-
-        l_clr.r = l_clr.g = l_clr.b = 0.0;
-        l_clr.a = 1.0;
-        vectNd_unitize(&look);
-        get_ray_color(&virtCam, &look, scn, &l_clr, 1.0, depth, max_optic_depth);
+    /* apply aperture sampling for depth of field */
+    if( recursive_aa != 0 || samples > 1 ) {
+        double x,y;
+        /* perturb look vector slightly */
+        /* see: Ray Tracing From The Ground Up, p. 171 */
+        sampler_disk(lens_u, lens_v, &x, &y);
+        vectNd_scale(&scn->cam.localX, x*scn->cam.aperture_radius, temp);
+        vectNd_add(virtCam, temp, virtCam);
+        vectNd_scale(&scn->cam.localY, y*scn->cam.aperture_radius, temp);
+        vectNd_add(virtCam, temp, virtCam);
+    }
 
-        if( i > 1 ) {
-            clr_diff = MAX( fabs(t_clr.r / (i-1) - (t_clr.r+l_clr.r) / i),
-                        MAX( fabs(t_clr.g / (i-1) - (t_clr.g+l_clr.g) / i),
-                             fabs(t_clr.b / (i-1) - (t_clr.b+l_clr.b) / i) ) );
-        }
+    /* compute primary ray to use */
+    vectNd_sub(pixel, virtCam, look);
+    vectNd_unitize(look);
+}
 
-        t_clr.r += l_clr.r;
-        t_clr.g += l_clr.g;
-        t_clr.b += l_clr.b;
-        t_clr.a += l_clr.a;
-        t_samples += 1;
-    }
+/* colour of camera sample index out of samples planned for the pixel */
+int get_pixel_color(scene *scn, int width, int height, double x, double y,
+    dbl_pixel_t *clr, int index, int samples, camera_mode mode, double *depth,
+    int max_optic_depth)
+{
+    sampler_t smp;
+    render_ctx_t *ctx = render_ctx_get(scn->cam.pos.n, max_optic_depth+1);
 
-    clr->r = t_clr.r/t_samples;
-    clr->g = t_clr.g/t_samples;
-    clr->b = t_clr.b/t_samples;
-    clr->a = t_clr.a/t_samples;
+    camera_ray(scn, width, height, x, y, index, samples, mode, &smp,
+               &ctx->cam_pos, &ctx->cam_look, ctx);
 
-    vectNd_free(&temp);
-    vectNd_free(&look);
-    vectNd_free(&pixel);
-    vectNd_free(&virtCam);
+    clr->r = clr->g = clr->b = 0.0;
+    clr->a = 1.0;
+    get_ray_color(&ctx->cam_pos, &ctx->cam_look, scn, clr, 1.0, depth,
+                  max_optic_depth, &smp, ctx);
 
     return 1;
 }
 
-int render_pixel(scene *scn, int width, double x_scale, int height, double y_scale, double i, double j, stereo_mode mode, int samples, dbl_pixel_t *clr, double *depth, int max_optic_depth)
+/* image position and eye for pixel i,j, returns -1 for blanking pixels */
+static int pixel_position(int width, double x_scale, int height, double y_scale, double i, double j, stereo_mode mode, double *xp, double *yp, camera_mode *cam_modep)
 {
     double ip = 0;
     double jp = 0;
@@ -622,8 +1077,7 @@ int render_pixel(scene *scn, int width, double x_scale, int height, double y_sca
             // some wierd blanking thing
             // see:
             // http://www.tomshardware.com/reviews/blu-ray-3d-3d-video-3d-tv,2632-6.html
-            clr->r = clr->g = clr->b = 0;
-            return 0;
+            return -1;
         }
 
         x = ip/(double)width - 0.5;
@@ -633,25 +1087,73 @@ int render_pixel(scene *scn, int width, double x_scale, int height, double y_sca
         y = -(jp/(double)height - 0.5);
     }
 
-    if( mode == ANAGLYPH_3D ) {
-        dbl_pixel_t left_clr;
-        dbl_pixel_t right_clr;
+    *xp = x;
+    *yp = y;
+    *cam_modep = cam_mode;
+
+    return 0;
+}
 
-        get_pixel_color(scn, width, height, x, y, &left_clr, samples, CAM_LEFT, depth, max_optic_depth);
-        get_pixel_color(scn, width, height, x, y, &right_clr, samples, CAM_RIGHT, NULL, max_optic_depth);
+/* take count more samples (of samples planned) into stats, clr gets their mean */
+int render_pixel(scene *scn, int width, double x_scale, int height, double y_scale, double i, double j, stereo_mode mode, int samples, int count, pixel_stats_t *stats, dbl_pixel_t *clr, double *depth, int max_optic_depth)
+{
+    pixel_stats_t local;
+    if( stats == NULL ) {
+        memset(&local, '\0', sizeof(local));
+        stats = &local;
+    }
 
-        /* true anaglyph */
-        clr->r = 0.299*left_clr.r+0.587*left_clr.g+0.114*left_clr.b;
-        clr->g = 0;
-        clr->b = 0.299*right_clr.r+0.587*right_clr.g+0.114*right_clr.b;
+    double x = 0.0;
+    double y = 0.0;
+    camera_mode cam_mode = CAM_CENTER;
+    if( pixel_position(width, x_scale, height, y_scale, i, j, mode, &x, &y, &cam_mode) < 0 ) {
+        clr->r = clr->g = clr->b = 0;
         clr->a = 1.0;
-    } else {
-        get_pixel_color(scn, width, height, x, y, clr, samples, cam_mode, depth, max_optic_depth);
+        for(int k=0; k<count; ++k)
+            pixel_stats_add(stats, clr);
+        return 0;
+    }
+
+    for(int k=0; k<count; ++k) {
+        int index = stats->n;
+        if( mode == ANAGLYPH_3D ) {
+            dbl_pixel_t left_clr;
+            dbl_pixel_t right_clr;
+
+            get_pixel_color(scn, width, height, x, y, &left_clr, index, samples, CAM_LEFT, depth, max_optic_depth);
+            get_pixel_color(scn, width, height, x, y, &right_clr, index, samples, CAM_RIGHT, NULL, max_optic_depth);
+
+            /* true anaglyph */
+            clr->r = 0.299*left_clr.r+0.587*left_clr.g+0.114*left_clr.b;
+            clr->g = 0;
+            clr->b = 0.299*right_clr.r+0.587*right_clr.g+0.114*right_clr.b;
+            clr->a = 1.0;
+        } else {
+            get_pixel_color(scn, width, height, x, y, clr, index, samples, cam_mode, depth, max_optic_depth);
+        }
+        pixel_stats_add(stats, clr);
     }
+    pixel_stats_mean(stats, clr);
 
     return 0;
 }
 
+/* colour of resampling point (x,y), tracing each lattice point once per tile */
+static void resample_point(scene *scn, int width, double x_scale, int height, double y_scale, double x, double y, stereo_mode mode, int samples, dbl_pixel_t *clr, int max_optic_depth)
+{
+    render_ctx_t *ctx = render_ctx_get(scn->cam.pos.n, max_optic_depth+1);
+    int found = 0;
+    dbl_pixel_t *cached = sample_cache_find(&ctx->subsamples, x, y, &found);
+    if( found ) {
+        *clr = *cached;
+        return;
+    }
+
+    render_pixel(scn, width, x_scale, height, y_scale, x, y, mode, samples, samples, NULL, clr, NULL, max_optic_depth);
+    if( cached != NULL )
+        *cached = *clr;
+}
+
 int recursive_resample(scene *scn, int width, double x_scale,
         int height, double y_scale, double x, double y,
         int samples, int aa_diff, int aa_depth, stereo_mode mode, double step,
@@ -667,15 +1169,15 @@ int recursive_resample(scene *scn, int width, double x_scale,
 
     double hs=step/2;
     /* center */
-    render_pixel(scn, width, x_scale, height, y_scale, x+hs, y+hs, mode, samples, &p5, NULL, max_optic_depth);
+    resample_point(scn, width, x_scale, height, y_scale, x+hs, y+hs, mode, samples, &p5, max_optic_depth);
     /* top middle */
-    render_pixel(scn, width, x_scale, height, y_scale, x+hs, y, mode, samples, &p6, NULL, max_optic_depth);
+    resample_point(scn, width, x_scale, height, y_scale, x+hs, y, mode, samples, &p6, max_optic_depth);
     /* left edge */
-    render_pixel(scn, width, x_scale, height, y_scale, x, y+hs, mode, samples, &p7, NULL, max_optic_depth);
+    resample_point(scn, width, x_scale, height, y_scale, x, y+hs, mode, samples, &p7, max_optic_depth);
     /* right edge */
-    render_pixel(scn, width, x_scale, height, y_scale, x+step, y+hs, mode, samples, &p8, NULL, max_optic_depth);
+    resample_point(scn, width, x_scale, height, y_scale, x+step, y+hs, mode, samples, &p8, max_optic_depth);
     /* bottom middle */
-    render_pixel(scn, width, x_scale, height, y_scale, x+hs, y+step, mode, samples, &p9, NULL, max_optic_depth);
+    resample_point(scn, width, x_scale, height, y_scale, x+hs, y+step, mode, samples, &p9, max_optic_depth);
 
     /* compute 4 sub-pixels */
     dbl_pixel_t sp1, sp2, sp3, sp4;
@@ -706,49 +1208,147 @@ int recursive_resample(scene *scn, int width, double x_scale,
     return var5;
 }
 
-int resample_pixel(scene *scn, int width, double x_scale, int height, double y_scale, int i, int j, stereo_mode mode, int samples, int aa_diff, int aa_depth, image_t *img, dbl_pixel_t *clr, int max_optic_depth) {
-    dbl_pixel_t p1, p2, p3, p4;
+/* corners of pixel (i,j) in the padded first pass image, clr gets their
+ * average, returns its variance */
+static double pixel_corners(image_t *img, int i, int j, dbl_pixel_t *p, dbl_pixel_t *clr)
+{
     double var = 0.0;
-    int ret = 0;
 
-    memset(&p1, '\0', sizeof(p1));
-    memset(&p2, '\0', sizeof(p2));
-    memset(&p3, '\0', sizeof(p3));
-    memset(&p4, '\0', sizeof(p4));
-    dbl_image_get_pixel(img,i,j,&p1);
-    dbl_image_get_pixel(img,i+1,j,&p2);
-    dbl_image_get_pixel(img,i,j+1,&p3);
-    dbl_image_get_pixel(img,i+1,j+1,&p4);
+    memset(p, '\0', 4*sizeof(*p));
+    dbl_image_get_pixel(img,i,j,&p[0]);
+    dbl_image_get_pixel(img,i+1,j,&p[1]);
+    dbl_image_get_pixel(img,i,j+1,&p[2]);
+    dbl_image_get_pixel(img,i+1,j+1,&p[3]);
+
+    image_avg_dbl_pixels4(&p[0],&p[1],&p[2],&p[3],clr,&var);
+
+    return var;
+}
+
+int resample_pixel(scene *scn, int width, double x_scale, int height, double y_scale, int i, int j, stereo_mode mode, int samples, int aa_diff, int aa_depth, image_t *img, dbl_pixel_t *clr, int max_optic_depth) {
+    dbl_pixel_t p[4];
+    int ret = 0;
 
-    image_avg_dbl_pixels4(&p1,&p2,&p3,&p4,clr,&var);
+    double var = pixel_corners(img, i, j, p, clr);
 
     /* resample pixel if needed */
     if( var > aa_diff/255.0 ) {
         ret = 1;
         recursive_resample(scn,width+1,x_scale,height+1,y_scale,
-                i,j,samples,aa_diff,aa_depth,mode,1.0, &p1, &p2, &p3, &p4, clr, max_optic_depth);
+                i,j,samples,aa_diff,aa_depth,mode,1.0, &p[0], &p[1], &p[2], &p[3], clr, max_optic_depth);
     }
 
     return ret;
 }
 
-int render_line(scene *scn, int width, double x_scale, int height, double y_scale, int j, stereo_mode mode, int samples, image_t *img, image_t *depth_map, int max_optic_depth)
+/* progressive passes each tile has finished, for previews */
+typedef struct progress {
+    int *passes;            /* per tile */
+    int *snapshot;          /* copy of passes taken for a preview */
+    int num_tiles;
+    char *preview_name;
+    struct timeval *frame_timer;
+    struct timeval last_preview;
+    pthread_mutex_t lock;
+} progress_t;
+
+/* pixels left to resample, handed out in batches */
+#define RESAMPLE_BATCH 256
+typedef struct resample_queue {
+    int *pixels;            /* j*width+i, in tile order */
+    int num;
+    int next;
+    pthread_mutex_t lock;
+} resample_queue_t;
+
+struct thr_info {
+    image_t *img;
+    image_t *actual_img;
+    image_t *depth_map;
+    scene *scn;
+    char *name;
+    int width;
+    int height;
+    double x_scale;
+    double y_scale;
+    int samples;
+    int aa_diff;
+    int aa_depth;
+    stereo_mode mode;
+    int threads;
+    int thr_offset;
+    int pixel_count;
+    int max_optic_depth;
+    tile_sched_t *sched;    /* hands out tiles, shared by every thread */
+
+    /* progressive refinement */
+    int step;               /* pixel spacing of this pass, 1 when not progressive */
+    int refine;             /* pixels on the 2*step grid were done last pass */
+    progress_t *progress;   /* NULL when not progressive */
+
+    /* adaptive sampling */
+    int count;              /* samples per pixel in the first pass */
+    pixel_stats_t *stats;   /* per pixel, NULL when not adaptive */
+    adapt_tile_t *tiles;
+    struct timeval *frame_timer;
+    long samples_used;
+
+    /* tracing stats, accumulated across passes */
+    long rays;
+    unsigned long allocs;   /* heap allocations made while tracing */
+    long occluder_hits, occluder_misses;
+    long subsample_hits, subsample_misses;
+
+    /* recursive anti-aliasing, pixels found over the threshold by the scan */
+    int *edges;
+    int num_edges, edges_size;
+    resample_queue_t *queue;
+};
+
+#ifdef WITH_MPI
+/* whether this rank renders row j, rows are dealt out threads at a time */
+static inline int mpi_row_local(int j, int threads)
+{
+    if( mpi_mode != MPI_MODE_ROW )
+        return 1;
+    return (j / threads) % mpiSize == mpiRank;
+}
+#endif /* WITH_MPI */
+
+/* first pixel at or after x0 in row j that this rank renders, and the step
+ * to the next one */
+static inline int row_pixels(int width, int j, int x0, int *step)
+{
+    *step = 1;
+    #ifdef WITH_MPI
+    if( mpi_mode == MPI_MODE_PIXEL && mpiSize > 0 ) {
+        int start = (width * j + mpiRank) % mpiSize;
+        *step = mpiSize;
+        if( x0 <= start )
+            return start;
+        return x0 + (mpiSize - (x0 - start) % mpiSize) % mpiSize;
+    }
+    #endif /* WITH_MPI */
+    return x0;
+}
+
+/* render every step'th pixel from x0 through x1-1 of row j, returns the
+ * number rendered */
+int render_line(scene *scn, int width, double x_scale, int height, double y_scale, int j, int x0, int x1, int step, stereo_mode mode, int samples, int count, pixel_stats_t *stats, image_t *img, image_t *depth_map, int max_optic_depth)
 {
     dbl_pixel_t clr;
     dbl_pixel_t depth_clr;
     double depth;
     int i=0;
     depth_clr.a = 1.0;
-    int row_start = 0;
     int row_step = 1;
-    #ifdef WITH_MPI
-    if( mpi_mode == MPI_MODE_PIXEL && mpiSize > 0 ) {
-        row_start = (width * j + mpiRank) % mpiSize;
-        row_step = mpiSize;
-    }
-    #endif /* WITH_MPI */
-    for(i=row_start; i<width; i+=row_step) {
-        render_pixel(scn,width,x_scale,height,y_scale,i,j,mode,samples,&clr, &depth, max_optic_depth);
+    int row_start = row_pixels(width, j, x0, &row_step);
+    row_step *= step;
+    int num = 0;
+    for(i=row_start; i<x1; i+=row_step) {
+        num += 1;
+        render_pixel(scn,width,x_scale,height,y_scale,i,j,mode,samples,count,
+                     stats ? &stats[i] : NULL, &clr, &depth, max_optic_depth);
         dbl_image_set_pixel(img,i,j,&clr);
         if( depth_map != NULL ) {
             depth_clr.r = depth_clr.g = depth_clr.b = depth;
@@ -756,91 +1356,426 @@ int render_line(scene *scn, int width, double x_scale, int height, double y_scal
         }
     }
 
+    return num;
+}
+
+/* first pixel of row j of the tile that this pass renders, and the spacing
+ * of the rest, returns 0 when the pass skips the row */
+static inline int pass_row(struct thr_info *info, render_tile_t *tile, int j, int *x, int *step)
+{
+    int s = info->step;
+    if( (j - tile->y) % s != 0 )
+        return 0;
+
+    *x = tile->x;
+    *step = s;
+    if( info->refine && (j - tile->y) % (2*s) == 0 ) {
+        /* every other pixel was rendered by the last pass */
+        *x += s;
+        *step = 2*s;
+    }
+
+    return 1;
+}
+
+/* render the rows of a tile that this rank owns, returns the pixels rendered */
+static int render_tile(struct thr_info *info, render_tile_t *tile)
+{
+    int num = 0;
+    for(int j=tile->y; j<tile->y+tile->h; ++j) {
+        int x, step;
+        #ifdef WITH_MPI
+        if( !mpi_row_local(j, info->threads) )
+            continue;
+        #endif /* WITH_MPI */
+        if( !pass_row(info, tile, j, &x, &step) )
+            continue;
+        pixel_stats_t *row_stats = info->stats ? &info->stats[j*info->width] : NULL;
+        num += render_line(info->scn, info->width, info->x_scale,
+                    info->height, info->y_scale, j, x, tile->x+tile->w, step,
+                    info->mode, info->samples, info->count, row_stats,
+                    info->img, info->depth_map, info->max_optic_depth);
+    }
+
+    return num;
+}
+
+/*
+ * Wavefront version of render_tile.
+ *
+ * All of the tile's camera samples are generated up front, then each bounce
+ * is a pass of two tight loops over a ray queue: intersect every ray, then
+ * shade every hit, emitting reflected and refracted rays into the queue
+ * for the next bounce.  Shadow rays are still traced inside apply_lights.
+ */
+static int render_tile_wavefront(struct thr_info *info, render_tile_t *tile)
+{
+    scene *scn = info->scn;
+    int width = info->width;
+    int height = info->height;
+    double x_scale = info->x_scale;
+    double y_scale = info->y_scale;
+    stereo_mode mode = info->mode;
+    int samples = info->samples;
+    int count = info->count;
+    pixel_stats_t *stats = info->stats;
+    image_t *img = info->img;
+    image_t *depth_map = info->depth_map;
+    int max_optic_depth = info->max_optic_depth;
+
+    /* eye pairs and blanking are left to the per-pixel path */
+    if( mode == ANAGLYPH_3D || mode == HIDEF_3D || max_optic_depth <= 0 )
+        return render_tile(info, tile);
+
+    /* queues and path state live in the thread's context between tiles */
+    render_ctx_t *ctx = render_ctx_get(scn->cam.pos.n, max_optic_depth+1);
+    int max_pixels = tile->w * tile->h;
+    if( ctx->num_pixels < max_pixels ) {
+        free(ctx->pixel_depth);
+        free(ctx->pixel_pos);
+        ctx->pixel_depth = calloc(max_pixels, sizeof(double));
+        ctx->pixel_pos = calloc(2*max_pixels, sizeof(int));
+        ctx->num_pixels = max_pixels;
+    }
+
+    /* pixels of the tile this rank renders */
+    int *pixel_pos = ctx->pixel_pos;
+    int num_pixels = 0;
+    for(int j=tile->y; j<tile->y+tile->h; ++j) {
+        int x, step;
+        #ifdef WITH_MPI
+        if( !mpi_row_local(j, info->threads) )
+            continue;
+        #endif /* WITH_MPI */
+        if( !pass_row(info, tile, j, &x, &step) )
+            continue;
+        int row_step = 1;
+        int row_start = row_pixels(width, j, x, &row_step);
+        row_step *= step;
+        for(int i=row_start; i<tile->x+tile->w; i+=row_step) {
+            pixel_pos[2*num_pixels] = i;
+            pixel_pos[2*num_pixels+1] = j;
+            num_pixels += 1;
+        }
+    }
+
+    int num_paths = num_pixels * count;
+    if( num_paths <= 0 )
+        return num_pixels;
+
+    if( ctx->num_paths < num_paths ) {
+        free(ctx->path_smp);
+        free(ctx->path_clr);
+        ctx->path_smp = calloc(num_paths, sizeof(sampler_t));
+        ctx->path_clr = calloc(num_paths, sizeof(dbl_pixel_t));
+        ctx->num_paths = num_paths;
+    }
+    sampler_t *path_smp = ctx->path_smp;
+    dbl_pixel_t *path_clr = ctx->path_clr;
+    double *pixel_depth = ctx->pixel_depth;
+    memset(path_clr, '\0', num_paths*sizeof(dbl_pixel_t));
+    ray_queue_t *curr = &ctx->queues[0];
+    ray_queue_t *next = &ctx->queues[1];
+    curr->num = next->num = 0;
+    vectNd src, look, hit, normal;
+
+    /* generate primary rays */
+    for(int p=0; p<num_pixels; ++p) {
+        int i = pixel_pos[2*p];
+        int j = pixel_pos[2*p+1];
+        double x = 0.0, y = 0.0;
+        camera_mode cam_mode = CAM_CENTER;
+        pixel_position(width, x_scale, height, y_scale, i, j, mode, &x, &y, &cam_mode);
+
+        int first = stats ? stats[j*width+i].n : 0;
+        for(int k=0; k<count; ++k) {
+            int path = p*count + k;
+            int q = ray_queue_push(curr);
+            ray_queue_vect(curr, curr->src, q, &src);
+            ray_queue_vect(curr, curr->look, q, &look);
+            camera_ray(scn, width, height, x, y, first+k, samples, cam_mode,
+                       &path_smp[path], &src, &look, ctx);
+            curr->r[q] = curr->g[q] = curr->b[q] = 1.0;
+            curr->frac[q] = 1.0;
+            curr->depth[q] = max_optic_depth;
+            curr->path[q] = path;
+            path_clr[path].a = 1.0;
+        }
+    }
+
+    double depth = 0.0;
+    for(int bounce=0; curr->num > 0; ++bounce) {
+        /* intersect */
+        for(int q=0; q<curr->num; ++q) {
+            ray_queue_vect(curr, curr->src, q, &src);
+            ray_queue_vect(curr, curr->look, q, &look);
+            ray_queue_vect(curr, curr->hit, q, &hit);
+            ray_queue_vect(curr, curr->normal, q, &normal);
+            curr->obj[q] = NULL;
+            ctx->rays += 1;
+            #ifndef WITHOUT_KDTREE
+            trace_kd(&src, &look, kdtree, &hit, &normal, &curr->obj[q], -1.0, &ctx->kd);
+            #else
+            trace(&src, &look, scn->object_ptrs, NULL, scn->num_objects, NULL, &hit, &normal, &curr->obj[q], NULL, -1.0);
+            #endif /* !WITHOUT_KDTREE */
+        }
+
+        /* shade, queueing the next bounce */
+        next->num = 0;
+        for(int q=0; q<curr->num; ++q) {
+            int path = curr->path[q];
+            object *obj_ptr = curr->obj[q];
+            ray_queue_vect(curr, curr->src, q, &src);
+            ray_queue_vect(curr, curr->look, q, &look);
+            ray_queue_vect(curr, curr->hit, q, &hit);
+            ray_queue_vect(curr, curr->normal, q, &normal);
+
+            double trace_dist = -1;
+            if( obj_ptr != NULL )
+                vectNd_dist(&hit,&src,&trace_dist);
+
+            /* record depth for depth maps, last sample wins */
+            if( bounce == 0 ) {
+                if( obj_ptr == NULL )
+                    depth = 0.0;
+                else if( trace_dist > EPSILON )
+                    depth = 1.0/trace_dist;
+                pixel_depth[path/count] = depth;
+            }
+
+            if( obj_ptr == NULL || trace_dist <= EPSILON ) {
+                /* didn't hit an object, so use background color */
+                path_clr[path].r += curr->r[q]*scn->bg_red;
+                path_clr[path].g += curr->g[q]*scn->bg_green;
+                path_clr[path].b += curr->b[q]*scn->bg_blue;
+                if( bounce == 0 )
+                    path_clr[path].a = scn->bg_alpha;
+                continue;
+            }
+
+            double w[3] = { curr->r[q], curr->g[q], curr->b[q] };
+            double refl_w[3], trans_w[3], refl_frac, trans_frac;
+            material_t scratch;
+            material_t *mtl = shade_hit(scn, obj_ptr, &src, &look,
+                        &hit, &normal, w, curr->frac[q], &path_clr[path],
+                        &path_smp[path], &scratch,
+                        refl_w, &refl_frac, trans_w, &trans_frac, ctx);
+
+            int child_depth = curr->depth[q]-1;
+            if( (refl_w[0] > 0 || refl_w[1] > 0 || refl_w[2] > 0)
+                && ray_survives(bounce+1, child_depth, refl_w, refl_frac, &path_smp[path]) ) {
+                int c = ray_queue_push(next);
+                vectNd child;
+                ray_queue_vect(next, next->look, c, &child);
+                vectNd_reflect(&look,&normal,&child,1.0);
+                vectNd_unitize(&child);
+                ray_queue_vect(next, next->src, c, &child);
+                vectNd_copy(&child,&hit);
+                next->r[c] = refl_w[0];
+                next->g[c] = refl_w[1];
+                next->b[c] = refl_w[2];
+                next->frac[c] = refl_frac;
+                next->depth[c] = child_depth;
+                next->path[c] = path;
+            }
+
+            if( mtl->transparent
+                && ray_survives(bounce+1, child_depth, trans_w, trans_frac, &path_smp[path]) ) {
+                int c = ray_queue_push(next);
+                vectNd child;
+                ray_queue_vect(next, next->look, c, &child);
+                vectNd_refract(&look,&normal,&child,mtl->refract_index);
+                vectNd_unitize(&child);
+                ray_queue_vect(next, next->src, c, &child);
+                vectNd_copy(&child,&hit);
+                next->r[c] = trans_w[0];
+                next->g[c] = trans_w[1];
+                next->b[c] = trans_w[2];
+                next->frac[c] = trans_frac;
+                next->depth[c] = child_depth;
+                next->path[c] = path;
+            }
+        }
+
+        ray_queue_t *temp = curr;
+        curr = next;
+        next = temp;
+    }
+
+    /* resolve paths into pixels */
+    dbl_pixel_t clr;
+    dbl_pixel_t depth_clr;
+    depth_clr.a = 1.0;
+    for(int p=0; p<num_pixels; ++p) {
+        int i = pixel_pos[2*p];
+        int j = pixel_pos[2*p+1];
+        pixel_stats_t local;
+        pixel_stats_t *ps = stats ? &stats[j*width+i] : &local;
+        if( stats == NULL )
+            memset(&local, '\0', sizeof(local));
+
+        for(int k=0; k<count; ++k)
+            pixel_stats_add(ps, &path_clr[p*count+k]);
+        pixel_stats_mean(ps, &clr);
+        dbl_image_set_pixel(img,i,j,&clr);
+
+        if( depth_map != NULL ) {
+            depth_clr.r = depth_clr.g = depth_clr.b = pixel_depth[p];
+            dbl_image_set_pixel(depth_map,i,j,&depth_clr);
+        }
+    }
+
+    return num_pixels;
+}
+
+/* note pixel p for resampling */
+static int edge_push(struct thr_info *info, int p)
+{
+    if( info->num_edges >= info->edges_size ) {
+        int size = info->edges_size > 0 ? info->edges_size*2 : 1024;
+        int *edges = realloc(info->edges, size*sizeof(int));
+        if( edges == NULL ) {
+            fprintf(stderr, "%s: failed to allocate %i pixels.\n", __FUNCTION__, size);
+            return -1;
+        }
+        info->edges = edges;
+        info->edges_size = size;
+    }
+    info->edges[info->num_edges++] = p;
+
     return 0;
 }
 
-int resample_line(scene *scn, int width, double x_scale, int height, double y_scale, int j, stereo_mode mode, int samples, int aa_diff, int aa_depth, image_t *img, image_t *actual_img, int max_optic_depth)
+/* fill dst from src, giving each pixel of a tile the colour of the pixel
+ * the tile's last finished pass rendered in its place */
+static void progress_fill(image_t *dst, image_t *src, render_tile_t *tiles, int *passes, int num)
 {
     dbl_pixel_t clr;
-    int ret = 0;
-    int i=0;
-    int row_start = 0;
-    int row_step = 1;
-    #ifdef WITH_MPI
-    if( mpi_mode == MPI_MODE_PIXEL && mpiSize > 0 ) {
-        row_start = (width * j + mpiRank) % mpiSize;
-        row_step = mpiSize;
-    }
-    #endif /* WITH_MPI */
-    for(i=row_start; i<width; i+=row_step) {
-        ret += resample_pixel(scn, width, x_scale, height, y_scale, i, j, mode, samples, aa_diff, aa_depth, img, &clr, max_optic_depth);
-        dbl_image_set_pixel(actual_img,i,j,&clr);
+
+    for(int t=0; t<num; ++t) {
+        render_tile_t *tile = &tiles[t];
+        if( passes[t] < 1 )
+            continue;
+        int s = 1 << (PROGRESSIVE_LEVELS - (passes[t]-1));
+        if( s == 1 && dst == src )
+            continue;
+        for(int j=tile->y; j<tile->y+tile->h; ++j) {
+            int y = tile->y + ((j - tile->y)/s)*s;
+            for(int i=tile->x; i<tile->x+tile->w; ++i) {
+                int x = tile->x + ((i - tile->x)/s)*s;
+                dbl_image_get_pixel(src, x, y, &clr);
+                dbl_image_set_pixel(dst, i, j, &clr);
+            }
+        }
     }
+}
 
-    return ret;
+/* save what the finished tiles show so far */
+static void progress_preview(progress_t *prog, image_t *img, tile_sched_t *sched)
+{
+    image_t preview;
+
+    pthread_mutex_lock(&prog->lock);
+    memcpy(prog->snapshot, prog->passes, prog->num_tiles*sizeof(int));
+    pthread_mutex_unlock(&prog->lock);
+
+    dbl_image_init(&preview);
+    image_set_size(&preview, img->width, img->height);
+    progress_fill(&preview, img, sched->tiles, prog->snapshot, prog->num_tiles);
+    image_save(&preview, prog->preview_name, IMAGE_FORMAT);
+    image_free(&preview);
+    timer_start(&prog->last_preview);
 }
 
-struct thr_info {
-    image_t *img;
-    image_t *actual_img;
-    image_t *depth_map;
-    scene *scn;
-    char *name;
-    int width;
-    int height;
-    double x_scale;
-    double y_scale;
-    int samples;
-    int aa_diff;
-    int aa_depth;
-    stereo_mode mode;
-    int threads;
-    int thr_offset;
-    int pixel_count;
-    int max_optic_depth;
-};
+/* whether the frame has used up its progressive time budget */
+static inline int progress_expired(progress_t *prog)
+{
+    if( prog == NULL || progressive_budget <= 0 )
+        return 0;
+
+    double elapsed = 0.0;
+    timer_elapsed(prog->frame_timer, &elapsed);
+    return elapsed >= progressive_budget;
+}
 
 void *render_lines_thread(void *arg)
 {
     struct thr_info info;
     memcpy(&info,arg,sizeof(info));
-    
-    int j=0;
-    struct timeval timer;
-    if( info.thr_offset==0 )
-        timer_start(&timer);
-    int row_start = info.thr_offset;
-    int row_step = info.threads;
-    #ifdef WITH_MPI
-    if( mpi_mode == MPI_MODE_ROW ) {
-        row_start += mpiRank*info.threads;
-        row_step *= mpiSize;
+
+    /* set up the context first, so only allocations made tracing count */
+    render_ctx_t *ctx = render_ctx_get(info.scn->cam.pos.n, info.max_optic_depth+1);
+    long rays = ctx->rays;
+    unsigned long allocs = vectNd_allocs;
+    long occluder_hits = ctx->occluder_hits;
+    long occluder_misses = ctx->occluder_misses;
+
+    long last_rays = ctx->rays;
+    int t;
+    while( !progress_expired(info.progress)
+           && (t = tile_sched_next(info.sched, info.thr_offset)) >= 0 ) {
+        int num;
+        if( wavefront )
+            num = render_tile_wavefront(&info, &info.sched->tiles[t]);
+        else
+            num = render_tile(&info, &info.sched->tiles[t]);
+        status_add(&render_status, num, num, ctx->rays - last_rays, (long)num*info.count);
+        last_rays = ctx->rays;
+
+        if( info.progress ) {
+            progress_t *prog = info.progress;
+            pthread_mutex_lock(&prog->lock);
+            prog->passes[t] += 1;
+            pthread_mutex_unlock(&prog->lock);
+
+            if( info.thr_offset==0 && progressive_interval > 0 ) {
+                double since = 0.0;
+                timer_elapsed(&prog->last_preview, &since);
+                if( since >= progressive_interval )
+                    progress_preview(prog, info.img, info.sched);
+            }
+        }
     }
-    #endif /* WITH_MPI */
-    for(j=row_start; j<info.height; j+=row_step) {
-        render_line(info.scn, info.width, info.x_scale,
-                    info.height, info.y_scale, j, info.mode, info.samples,
-                    info.img, info.depth_map, info.max_optic_depth);
-
-        if( info.thr_offset==0 && (j%10) == 0 ) {
-            int num = image_active_saves();
-            double remaining = timer_remaining(&timer, j, info.height+1);
-            #ifdef WITH_MPI
-            if( mpiRank == 0 || (mpiRank == 1 && mpi_mode == MPI_MODE_FRAME) ) {
-            #endif /* WITH_MPI */
-                if( num <= 0 ) {
-                    char remainStr[32] = "";
-                    if( remaining >= 0 )
-                        snprintf(remainStr, sizeof(remainStr), " (%.2fs remaining)", remaining);
-                    printf("  \r% 6.2f%%%s", 100.0*j/(info.height+1),remainStr);
-                } else {
-                    printf("   \r% 6.2f%%  (%i active save%s)", 100.0*j/info.height, num, (num==1)?"":"s");
-                }
+    info.rays += ctx->rays - rays;
+    info.allocs += vectNd_allocs - allocs;
+    info.occluder_hits += ctx->occluder_hits - occluder_hits;
+    info.occluder_misses += ctx->occluder_misses - occluder_misses;
+    memcpy(arg,&info,sizeof(info));
+
+    return 0;
+}
+
+/*
+ * Average each pixel's corners into actual_img, and note the pixels whose
+ * corners differ by more than aa_diff, so only those get traced again.
+ */
+void *resample_scan_thread(void *arg)
+{
+    struct thr_info info;
+    memcpy(&info,arg,sizeof(info));
 
-                fflush(stdout);
+    double threshold = info.aa_diff/255.0;
+    dbl_pixel_t p[4];
+    dbl_pixel_t clr;
+    int t;
+    info.num_edges = 0;
+    while( (t = tile_sched_next(info.sched, info.thr_offset)) >= 0 ) {
+        render_tile_t *tile = &info.sched->tiles[t];
+        int x1 = MIN(tile->x+tile->w, info.width);
+        int y1 = MIN(tile->y+tile->h, info.height);
+
+        for(int j=tile->y; j<y1; ++j) {
             #ifdef WITH_MPI
-            }
+            if( !mpi_row_local(j, info.threads) )
+                continue;
             #endif /* WITH_MPI */
+            int row_step = 1;
+            for(int i=row_pixels(info.width, j, tile->x, &row_step); i<x1; i+=row_step) {
+                double var = pixel_corners(info.img, i, j, p, &clr);
+                dbl_image_set_pixel(info.actual_img,i,j,&clr);
+                if( var > threshold )
+                    edge_push(&info, j*info.width+i);
+            }
         }
     }
     memcpy(arg,&info,sizeof(info));
@@ -848,55 +1783,156 @@ void *render_lines_thread(void *arg)
     return 0;
 }
 
-void *resample_lines_thread(void *arg)
+/* resample the queued pixels, a batch at a time */
+void *resample_queue_thread(void *arg)
 {
     struct thr_info info;
     memcpy(&info,arg,sizeof(info));
-    
-    int j=0;
-    struct timeval timer;
-    if( info.thr_offset==0 )
-        timer_start(&timer);
-    int row_start = info.thr_offset;
-    int row_step = info.threads;
-    #ifdef WITH_MPI
-    if( mpi_mode == MPI_MODE_ROW ) {
-        row_start += mpiRank*info.threads;
-        row_step *= mpiSize;
+    resample_queue_t *queue = info.queue;
+
+    render_ctx_t *ctx = render_ctx_get(info.scn->cam.pos.n, info.max_optic_depth+1);
+    sample_cache_t *cache = &ctx->subsamples;
+    long hits = cache->hits;
+    long misses = cache->misses;
+    long last_rays = ctx->rays;
+    long last_misses = misses;
+
+    /* resampling points sit on a lattice of 2^(aa_depth+1) per pixel */
+    double scale = 0.0;
+    if( info.aa_depth >= 0 && info.aa_depth < 48 )
+        scale = ldexp(1.0, info.aa_depth+1);
+
+    dbl_pixel_t clr;
+    while( 1 ) {
+        pthread_mutex_lock(&queue->lock);
+        int start = queue->next;
+        int end = MIN(start + RESAMPLE_BATCH, queue->num);
+        queue->next = end;
+        pthread_mutex_unlock(&queue->lock);
+        if( start >= end )
+            break;
+
+        /* a batch is a run of nearby pixels, so they share subsamples */
+        sample_cache_clear(cache, scale);
+        for(int k=start; k<end; ++k) {
+            int i = queue->pixels[k] % info.width;
+            int j = queue->pixels[k] / info.width;
+            info.pixel_count += resample_pixel(info.scn, info.width, info.x_scale,
+                                    info.height, info.y_scale, i, j, info.mode,
+                                    info.samples, info.aa_diff, info.aa_depth,
+                                    info.img, &clr, info.max_optic_depth);
+            dbl_image_set_pixel(info.actual_img,i,j,&clr);
+        }
+        status_add(&render_status, end-start, 0, ctx->rays - last_rays,
+                   (cache->misses - last_misses)*info.samples);
+        last_rays = ctx->rays;
+        last_misses = cache->misses;
     }
-    #endif /* WITH_MPI */
-    for(j=row_start; j<info.height; j+=row_step) {
-        info.pixel_count += resample_line(info.scn, info.width, info.x_scale,
-                      info.height, info.y_scale, j, info.mode, info.samples,
-                      info.aa_diff, info.aa_depth, info.img, info.actual_img,
-                      info.max_optic_depth);
-
-        if( info.thr_offset==0 && (j%10) == 0 ) {
-            int num = image_active_saves();
-            double remaining = timer_remaining(&timer, j, info.height+1);
-            #ifdef WITH_MPI
-            if( mpiRank == 0 || (mpiRank == 1 && mpi_mode == MPI_MODE_FRAME) ) {
-            #endif /* WITH_MPI */
-                if( num <= 0 ) {
-                    char remainStr[32] = "";
-                    if( remaining >= 0 )
-                        snprintf(remainStr, sizeof(remainStr), " (%.2fs remaining)", remaining);
-                    printf("  \r% 6.2f%%%s", 100.0*j/(info.height+1),remainStr);
-                } else {
-                    printf("   \r% 6.2f%%  (%i active save%s)", 100.0*j/info.height, num, (num==1)?"":"s");
-                }
+    sample_cache_clear(cache, 0.0);
+    info.subsample_hits += cache->hits - hits;
+    info.subsample_misses += cache->misses - misses;
+    memcpy(arg,&info,sizeof(info));
 
-                fflush(stdout);
-            #ifdef WITH_MPI
-            }
-            #endif /* WITH_MPI */
+    return 0;
+}
+
+/* spend one tile's share of an adaptive round */
+static long adapt_render_tile(struct thr_info *info, adapt_tile_t *tile)
+{
+    long used = 0;
+    dbl_pixel_t clr;
+
+    for(int j=tile->y; j<tile->y+tile->h; ++j) {
+        for(int i=tile->x; i<tile->x+tile->w; ++i) {
+            pixel_stats_t *ps = &info->stats[j*info->width+i];
+            double err = pixel_stats_error(ps);
+            if( err <= adapt_max_error || ps->n >= ADAPT_MAX_PIXEL_SAMPLES )
+                continue;
+
+            /* split the tile's budget by each pixel's share of its error,
+             * at most doubling a pixel's samples per round */
+            int count = (int)ceil(tile->budget * err / tile->error);
+            count = MAX(count, 1);
+            count = MIN(count, ps->n);
+            count = MIN(count, ADAPT_MAX_PIXEL_SAMPLES - ps->n);
+
+            render_pixel(info->scn, info->width, info->x_scale,
+                         info->height, info->y_scale, i, j, info->mode,
+                         info->samples, count, ps, &clr, NULL,
+                         info->max_optic_depth);
+            dbl_image_set_pixel(info->img, i, j, &clr);
+            used += count;
+        }
+    }
+
+    return used;
+}
+
+void *adapt_tiles_thread(void *arg)
+{
+    struct thr_info info;
+    memcpy(&info,arg,sizeof(info));
+
+    render_ctx_t *ctx = render_ctx_get(info.scn->cam.pos.n, info.max_optic_depth+1);
+    long rays = ctx->rays;
+    unsigned long allocs = vectNd_allocs;
+    long occluder_hits = ctx->occluder_hits;
+    long occluder_misses = ctx->occluder_misses;
+
+    long last_rays = rays;
+    info.samples_used = 0;
+    while( 1 ) {
+        if( adapt_time_budget > 0 ) {
+            double elapsed = 0.0;
+            timer_elapsed(info.frame_timer, &elapsed);
+            if( elapsed >= adapt_time_budget )
+                break;
+        }
+
+        int t = tile_sched_next(info.sched, info.thr_offset);
+        if( t < 0 )
+            break;
+
+        if( info.tiles[t].budget > 0 ) {
+            long used = adapt_render_tile(&info, &info.tiles[t]);
+            info.samples_used += used;
+            status_add(&render_status, used, 0, ctx->rays - last_rays, used);
+            last_rays = ctx->rays;
         }
     }
+    info.rays += ctx->rays - rays;
+    info.allocs += vectNd_allocs - allocs;
+    info.occluder_hits += ctx->occluder_hits - occluder_hits;
+    info.occluder_misses += ctx->occluder_misses - occluder_misses;
     memcpy(arg,&info,sizeof(info));
 
     return 0;
 }
 
+/* run func once per thread's info on the pool, and wait for all of them */
+static void run_threads(void *(*func)(void*), struct thr_info *info, int threads)
+{
+    pool_group_t group = {0};
+    for(int i=0; i<threads; ++i)
+        pool_submit(&render_pool, &group, func, &info[i]);
+    pool_wait(&render_pool, &group);
+}
+
+/* whether repeated samples of a pixel can differ */
+static int scene_is_stochastic(scene *scn, int samples)
+{
+    if( recursive_aa )
+        return 0;
+    if( samples > 1 )
+        return 1;
+    for(int i=0; i<scn->num_lights; ++i) {
+        if( scn->lights[i]->type == LIGHT_DISK
+            || scn->lights[i]->type == LIGHT_RECT )
+            return 1;
+    }
+    return 0;
+}
+
 int render_image(scene *scn, char *name, char *depth_name, int width, int height, int samples, stereo_mode mode, int threads, int aa_diff, int aa_depth, int max_optic_depth, image_t *img_copy, image_t *depth_copy)
 {
     image_t *img = NULL;
@@ -940,11 +1976,74 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
     image_set_size(actual_img,width,height);
 
     struct thr_info *info;
-    pthread_t *thr;
     info = calloc(threads,sizeof(struct thr_info));
-    thr = calloc(threads,sizeof(pthread_t));
 
+    /* with -x, frames whose samples vary get a variance driven second pass */
+    int adaptive = adapt_requested && scene_is_stochastic(scn, samples);
+    #ifdef WITH_MPI
+    if( mpi_mode == MPI_MODE_ROW || mpi_mode == MPI_MODE_PIXEL )
+        adaptive = 0;
+    #endif /* WITH_MPI */
+    int first_count = MAX(samples, 1);
+    pixel_stats_t *stats = NULL;
+    if( adaptive ) {
+        first_count = MAX(first_count, ADAPT_MIN_SAMPLES);
+        stats = calloc(width*height, sizeof(pixel_stats_t));
+    }
+
+    /* failures below skip to the cleanup at the end, which needs these */
+    int ret = 1;
+    tile_sched_t sched;
+    memset(&sched, '\0', sizeof(sched));
+    progress_t prog;
+    char preview_name[PATH_MAX];
+    int use_progressive = 0;
+
+    /* prepare this frame's lights, then group them for importance sampling */
+    num_light_views = scene_light_views_init(scn, &light_views);
+    light_views_epoch += 1;
+    if( num_light_views < 0 ) {
+        num_light_views = 0;
+        ret = 0;
+        goto cleanup;
+    }
+    if( light_samples > 0 && light_tree_build(&light_tree, scn) < 0 )
+        light_tree_free(&light_tree);
+
+    /* deal the frame out in tiles, threads steal once their own run is done */
+    if( tile_sched_init(&sched, width+aa_pad, height+aa_pad, tile_size, threads) < 0 ) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    struct timeval frame_timer;
+    timer_start(&frame_timer);
     timer_start(&timer);
+
+    /* progressive passes count what each tile has finished, for previews */
+    progress_t *progress = NULL;
+    use_progressive = progressive && name != NULL;
+    #ifdef WITH_MPI
+    if( mpi_mode == MPI_MODE_ROW || mpi_mode == MPI_MODE_PIXEL )
+        use_progressive = 0;
+    #endif /* WITH_MPI */
+    if( use_progressive ) {
+        memset(&prog, '\0', sizeof(prog));
+        prog.num_tiles = sched.num_tiles;
+        prog.passes = calloc(sched.num_tiles, sizeof(int));
+        prog.snapshot = calloc(sched.num_tiles, sizeof(int));
+        pthread_mutex_init(&prog.lock, NULL);
+        char *ext = strrchr(name, '.');
+        int base = ext ? (int)(ext - name) : (int)strlen(name);
+        snprintf(preview_name, sizeof(preview_name), "%.*s_preview%s",
+                 base, name, ext ? ext : "");
+        prog.preview_name = preview_name;
+        prog.frame_timer = &frame_timer;
+        timer_start(&prog.last_preview);
+        if( prog.passes != NULL && prog.snapshot != NULL )
+            progress = &prog;
+    }
+
     int i=0;
     for(i=0; i<threads; ++i) {
         info[i].img = img;
@@ -961,19 +2060,56 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
         info[i].actual_img = actual_img;
         info[i].depth_map = depth_map;
         info[i].max_optic_depth = max_optic_depth;
-
-        if( threads > 1 )
-            pthread_create(&thr[i],NULL,render_lines_thread,&info[i]);
-        else
-            render_lines_thread(&info[i]);
+        info[i].count = first_count;
+        info[i].stats = stats;
+        info[i].sched = &sched;
+        info[i].progress = progress;
     }
-
-    if( threads > 1 ) {
+    /* every pass together renders each pixel once */
+    long phase_pixels = (long)(width+aa_pad)*(height+aa_pad);
+    #ifdef WITH_MPI
+    if( (mpi_mode == MPI_MODE_ROW || mpi_mode == MPI_MODE_PIXEL) && mpiSize > 0 )
+        phase_pixels /= mpiSize;
+    #endif /* WITH_MPI */
+    status_frame(&render_status, render_frame);
+    status_phase(&render_status, "render", phase_pixels);
+
+    int passes = progress ? PROGRESSIVE_LEVELS+1 : 1;
+    int stopped = 0;
+    for(int pass=0; pass<passes && !stopped; ++pass) {
+        if( pass > 0 )
+            tile_sched_reset(&sched);
         for(i=0; i<threads; ++i) {
-            pthread_join(thr[i],NULL);
+            info[i].step = progress ? 1 << (PROGRESSIVE_LEVELS - pass) : 1;
+            info[i].refine = (pass > 0);
+        }
+        run_threads(render_lines_thread, info, threads);
+        if( progress == NULL )
+            break;
+        if( pass+1 == passes )
+            status_phase_end(&render_status);
+
+        for(int t=0; t<prog.num_tiles; ++t) {
+            if( prog.passes[t] <= pass )
+                stopped = 1;
+        }
+        if( stopped ) {
+            status_phase_end(&render_status);
+            /* out of time, stretch what was rendered over the gaps */
+            progress_fill(img, img, sched.tiles, prog.passes, prog.num_tiles);
+            if( depth_map )
+                progress_fill(depth_map, depth_map, sched.tiles, prog.passes, prog.num_tiles);
+            printf("\r                               \r");
+            printf("\tprogressive time budget ran out in pass %i of %i\n",
+                   pass+1, passes);
+        } else if( pass+1 < passes ) {
+            progress_preview(&prog, img, &sched);
         }
     }
 
+    if( progress == NULL )
+        status_phase_end(&render_status);
+
     double initial_time = -1.0;
     timer_elapsed(&timer,&seconds);
     initial_time = seconds;
@@ -986,6 +2122,74 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
     }
     #endif /* WITH_MPI */
 
+    if( adaptive && !stopped ) {
+        /* keep sampling the noisiest tiles until converged or out of budget,
+         * each round's budget is split per tile so -T changes the result
+         * (the thread count does not) */
+        adapt_tile_t *tiles = NULL;
+        int num_tiles = adapt_tiles_init(&tiles, sched.tiles, sched.num_tiles);
+        long pixels = (long)width*height;
+        long total = pixels*first_count;
+        int rounds = 0;
+
+        timer_start(&timer);
+        while( num_tiles > 0 ) {
+            long limit = -1;
+            if( adapt_spp_budget > 0 ) {
+                limit = (long)(adapt_spp_budget*pixels) - total;
+                if( limit <= 0 )
+                    break;
+            }
+            if( adapt_time_budget > 0 ) {
+                timer_elapsed(&frame_timer, &seconds);
+                if( seconds >= adapt_time_budget )
+                    break;
+            }
+            long granted = adapt_tiles_budget(tiles, num_tiles, stats, width, adapt_max_error, limit);
+            if( granted == 0 )
+                break;
+
+            tile_sched_reset(&sched);
+            for(i=0; i<threads; ++i) {
+                info[i].tiles = tiles;
+                info[i].frame_timer = &frame_timer;
+            }
+            status_phase(&render_status, "adaptive", granted);
+            run_threads(adapt_tiles_thread, info, threads);
+            status_phase_end(&render_status);
+            for(i=0; i<threads; ++i)
+                total += info[i].samples_used;
+            rounds += 1;
+        }
+        free(tiles); tiles=NULL;
+
+        timer_elapsed(&timer,&seconds);
+        printf("\tadaptive sampling: %i round%s, %.2f samples per pixel (took %.3fs)\n",
+               rounds, rounds!=1?"s":"", total/(double)pixels, seconds);
+    }
+    if( stats ) {
+        free(stats); stats=NULL;
+    }
+
+    long rays = 0;
+    unsigned long allocs = 0;
+    long occluder_hits = 0, occluder_misses = 0;
+    for(i=0; i<threads; ++i) {
+        rays += info[i].rays;
+        allocs += info[i].allocs;
+        occluder_hits += info[i].occluder_hits;
+        occluder_misses += info[i].occluder_misses;
+    }
+    printf("\t%ld rays traced, %lu heap allocations (%.3g per ray)\n",
+           rays, allocs, rays > 0 ? allocs/(double)rays : 0.0);
+    if( threads > 1 )
+        printf("\t%i tiles of %ix%i, %ld stolen\n", sched.num_tiles,
+               tile_size, tile_size, sched.steals);
+    if( occluder_hits + occluder_misses > 0 )
+        printf("\t%ld shadow rays answered by cached occluders, %ld missed (%.1f%%)\n",
+               occluder_hits, occluder_misses,
+               100.0*occluder_hits/(occluder_hits + occluder_misses));
+
     /* write initial image */
     if( name != NULL ) {
         #ifdef WITH_MPI
@@ -1002,7 +2206,7 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
                 timer_start(&timer);
                 printf("\tsaving %s", name);
                 if( threads > 1 )
-                    image_save_bg(img,name,IMAGE_FORMAT);
+                    image_save_bg(img,name,IMAGE_FORMAT,&render_pool);
                 else
                     image_save(img,name,IMAGE_FORMAT);
                 timer_elapsed(&timer,&seconds);
@@ -1037,7 +2241,7 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
     #endif /* 1 */
 
     if( recursive_aa ) {
-        if( aa_depth >= 0 && aa_diff < 256 ) {
+        if( aa_depth >= 0 && aa_diff < 256 && !stopped ) {
             #ifdef WITH_MPI
             /* broadcast raw initial image for before resampling */
             if( mpi_mode != MPI_MODE_FRAME && mpi_mode != MPI_MODE_FRAME2 )
@@ -1054,18 +2258,52 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
                 info[i].aa_diff = aa_diff;
                 info[i].aa_depth = aa_depth;
                 info[i].pixel_count = 0;
-                pthread_create(&thr[i],NULL,resample_lines_thread,&info[i]);
             }
+            /* find the pixels worth resampling */
+            tile_sched_reset(&sched);
+            run_threads(resample_scan_thread, info, threads);
+
+            /* and share them out in batches */
+            resample_queue_t queue;
+            memset(&queue, '\0', sizeof(queue));
+            for(i=0; i<threads; ++i)
+                queue.num += info[i].num_edges;
+            queue.pixels = calloc(MAX(queue.num, 1), sizeof(int));
+            if( queue.pixels == NULL ) {
+                fprintf(stderr, "%s: failed to allocate %i pixels.\n", __FUNCTION__, queue.num);
+                queue.num = 0;
+            }
+            int num_edges = 0;
+            for(i=0; i<threads; ++i) {
+                if( queue.pixels != NULL && info[i].num_edges > 0 )
+                    memcpy(queue.pixels+num_edges, info[i].edges, info[i].num_edges*sizeof(int));
+                num_edges += info[i].num_edges;
+                free(info[i].edges); info[i].edges = NULL;
+                info[i].num_edges = info[i].edges_size = 0;
+                info[i].queue = &queue;
+            }
+            pthread_mutex_init(&queue.lock, NULL);
+            status_phase(&render_status, "resample", queue.num);
+            run_threads(resample_queue_thread, info, threads);
+            status_phase_end(&render_status);
+            pthread_mutex_destroy(&queue.lock);
+            free(queue.pixels); queue.pixels = NULL;
 
             int pixel_count=0;
+            long subsample_hits = 0, subsample_misses = 0;
             for(i=0; i<threads; ++i) {
-                pthread_join(thr[i],NULL);
                 pixel_count += info[i].pixel_count;
+                subsample_hits += info[i].subsample_hits;
+                subsample_misses += info[i].subsample_misses;
             }
 
             printf("\r                               \r");
             printf("\r\t%i pixels resampled. (%.2f%%)\n", pixel_count,
                     100.0*pixel_count/(width*height));
+            if( subsample_hits + subsample_misses > 0 )
+                printf("\t%ld of %ld subpixel samples reused (%.1f%%)\n",
+                       subsample_hits, subsample_hits + subsample_misses,
+                       100.0*subsample_hits/(subsample_hits + subsample_misses));
 
             #ifdef WITH_MPI
             if( !img_copy ) {
@@ -1103,7 +2341,6 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
         }
 
         free(info); info=NULL;
-        free(thr); thr=NULL;
 
         /* write image */
         if( name != NULL 
@@ -1114,7 +2351,7 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
             timer_start(&timer);
             printf("\tsaving %s", name);
             if( threads > 1 )
-                image_save_bg(actual_img,name,IMAGE_FORMAT);
+                image_save_bg(actual_img,name,IMAGE_FORMAT,&render_pool);
             else
                 image_save(actual_img,name,IMAGE_FORMAT);
             timer_elapsed(&timer,&seconds);
@@ -1131,6 +2368,7 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
         image_free(img);
         free(img); img=NULL;
     }
+cleanup:
     if( actual_img ) {
         image_free(actual_img);
         free(actual_img); actual_img=NULL;
@@ -1139,14 +2377,168 @@ int render_image(scene *scn, char *name, char *depth_name, int width, int height
         image_free(img);
         free(img); img=NULL;
     }
+    if( depth_map ) {
+        image_free(depth_map);
+        free(depth_map); depth_map=NULL;
+    }
     if( info ) {
         free(info); info=NULL;
     }
-    if( thr ) {
-        free(thr); thr=NULL;
+    free(stats); stats=NULL;
+    tile_sched_free(&sched);
+    light_tree_free(&light_tree);
+    scene_light_views_free(light_views, num_light_views);
+    light_views = NULL;
+    num_light_views = 0;
+    if( use_progressive ) {
+        /* the frame supersedes its previews */
+        unlink(preview_name);
+        free(prog.passes);
+        free(prog.snapshot);
+        pthread_mutex_destroy(&prog.lock);
     }
 
-    return 1;
+    return ret;
+}
+
+#ifndef WITHOUT_KDTREE
+typedef struct bounds_job {
+    object **objs;
+    int start, end;
+} bounds_job_t;
+
+static void *bounds_job(void *arg)
+{
+    bounds_job_t *job = arg;
+    for(int i=job->start; i<job->end; ++i)
+        object_get_bounds(job->objs[i]);
+    return NULL;
+}
+
+/* find every object's bounding sphere, split across the pool */
+static void scene_bounds_parallel(scene *scn, int threads)
+{
+    int num = scn->num_objects;
+    if( threads < 1 )
+        threads = 1;
+    bounds_job_t *jobs = calloc(threads, sizeof(bounds_job_t));
+    pool_group_t group = {0};
+    for(int t=0; t<threads; ++t) {
+        jobs[t].objs = scn->object_ptrs;
+        jobs[t].start = (int)((long)num * t / threads);
+        jobs[t].end = (int)((long)num * (t+1) / threads);
+        pool_submit(&render_pool, &group, bounds_job, &jobs[t]);
+    }
+    pool_wait(&render_pool, &group);
+    free(jobs);
+}
+#endif /* !WITHOUT_KDTREE */
+
+/* a frame's scene and kd-tree, which can be set up while the frame before
+ * it renders */
+typedef struct frame_setup {
+    int frame;
+    int build;          /* also build the tree and aim the camera */
+    scene scn;
+    #ifndef WITHOUT_KDTREE
+    kd_tree_t tree;
+    kd_item_list_t items;
+    #endif /* !WITHOUT_KDTREE */
+    int built;
+
+    /* settings from main, the same for every frame */
+    int dimensions;
+    int frames;
+    char *config;
+    int (*custom_scene)(scene *scn, int dimensions, int frame, int frames, char *config);
+    int write_yaml;
+    int threads;
+    int cluster_k;
+    camera_type_t cam_type; /* CAMERA_NORMAL keeps the scene's */
+    double v_fov, h_fov;
+} frame_setup_t;
+
+/* build setup->frame's scene */
+static void frame_scene(frame_setup_t *setup)
+{
+    scene *scn = &setup->scn;
+    int i = setup->frame;
+
+    setup->built = 0;
+    if( setup->custom_scene!=NULL ) {
+        (*setup->custom_scene)(scn,setup->dimensions,i,setup->frames,setup->config);
+    } else {
+        scene_setup(scn,setup->dimensions,i,setup->frames,setup->config);
+    }
+    //scene_print(scn);
+
+    #ifdef WITH_YAML
+    if( setup->write_yaml ) {
+        char *output_dir = "yaml";
+        char dname[128];
+        char yaml_fname[PATH_MAX];
+        mkdir(output_dir,0700);
+        utimes(output_dir, NULL);
+        snprintf(dname,sizeof(dname),"%s/%s_%id", output_dir, scn->name, setup->dimensions);
+        mkdir(dname,0700);
+        utimes(dname, NULL);
+        snprintf(yaml_fname, sizeof(yaml_fname), "%s/%s_%05i.yaml", dname, scn->name, i);
+        scene_write_yaml(scn, yaml_fname);
+    }
+    #endif /* WITH_YAML */
+}
+
+/* build the kd-tree for setup's scene and aim its camera */
+static void frame_build(frame_setup_t *setup)
+{
+    scene *scn = &setup->scn;
+
+    #ifndef WITHOUT_KDTREE
+    kd_tree_init(&setup->tree, scn->dimensions);
+    setup->tree.pool = &render_pool;
+    kd_item_list_init(&setup->items);
+    scene_bounds_parallel(scn, setup->threads);
+    int num = scn->num_objects;
+    for(int i=0; i<num; ++i) {
+       object *obj_ptr = scn->object_ptrs[i];
+       object_kdlist_add(&setup->items, obj_ptr, i);
+    }
+    kd_tree_build(&setup->tree, &setup->items);
+    #else
+    scene_cluster(scn, setup->cluster_k);
+    #endif /* !WITHOUT_KDTREE */
+
+    scene_validate_objects(scn);
+
+    /* setup camera, as requested */
+    if( setup->cam_type != CAMERA_NORMAL ) {
+        scn->cam.type = setup->cam_type;
+        scn->cam.vFov = setup->v_fov;
+        scn->cam.hFov = setup->h_fov;
+    }
+    camera_aim(&scn->cam);
+    setup->built = 1;
+}
+
+static void frame_free(frame_setup_t *setup)
+{
+    #ifndef WITHOUT_KDTREE
+    if( setup->built ) {
+        kd_item_list_free(&setup->items, 1);
+        kd_tree_free(&setup->tree);
+    }
+    #endif /* !WITHOUT_KDTREE */
+    setup->built = 0;
+    scene_free(&setup->scn);
+}
+
+static void *frame_setup_job(void *arg)
+{
+    frame_setup_t *setup = arg;
+    frame_scene(setup);
+    if( setup->build )
+        frame_build(setup);
+    return NULL;
 }
 
 #ifdef WITH_MPI
@@ -1354,10 +2746,16 @@ int print_help_info(int argc, char **argv)
            "\t\t\t\tf: frame level parallelism\n"
            "\t\t\t\tF: frame level with rendering by rank 0\n"
            #endif /* WITH_MPI */
+           "\t-c num[,min]\tSample num lights per hit by importance, and skip\n"
+           "\t\t\tshadow rays for lights adding less than min [default 0,0]\n"
            "\t-d dimension\tNumber of spacial dimension to use\n"
+           "\t-e sampler\tSample sequence (random,stratified,sobol) [default sobol]\n"
            "\t-f arg\t\tFrames to render: last, first:last, or first:last:total\n"
            "\t-h\t\tPrint this help message\n"
+           "\t-i\t\tWavefront rendering, tracing each tile's rays in batches\n"
+           "\t-j num\t\tRussian roulette after num bounces (0 disables) [default 0]\n"
            "\t-k num\t\tNumber of clusters per level when grouping objects\n"
+           "\t\t\t(0 builds a binary hierarchy along a Morton curve)\n"
            "\t-l num\t\tMaximum recusion depth for reflection/refraction\n"
            "\t-m mode\t\tStereoscopic rendering mode (s,o,a,h,m)\n"
            "\t\t\t\ts: side by side (sbs2l)\n"
@@ -1374,9 +2772,17 @@ int print_help_info(int argc, char **argv)
            "\t-r resolution\tImage size {4k,1080p,720p} or WxH (e.g., 1920x1080)\n"
            "\t-s scene.so\tShared object that specifies the scene\n"
            "\t-t threads\tNumber of threads to use\n"
+           "\t-P\t\tPin each thread to a processor\n"
+           "\t-R secs[,budget]\tProgressive refinement, saving previews every secs\n"
+           "\t\t\t(0 only between passes) and stopping after budget secs\n"
+           "\t-S file[,secs]\tReport progress every secs, writing it to file too\n"
+           "\t\t\t(an empty file only sets the interval) [default 0.5]\n"
+           "\t-T size\t\tPixels per edge of the tiles threads render [default 16]\n"
            "\t-u scene_config\tScene specific options string\n"
            "\t-v mode,vFov,[hFov]\tVR/Pano camera, mode={spherical,cylindrical}\n"
            "\t-w\t\tEnable recursive anti-aliasing\n"
+           "\t-x args\t\tAdaptive sampling: max_error[,samples_per_pixel[,seconds]]\n"
+           "\t\t\t(budgets are shared out per -T tile) [default off]\n"
            #ifdef WITH_YAML
            "\t-y\t\tWrite YAML file(s)\n"
            #endif /* WITH_YAML */
@@ -1396,7 +2802,7 @@ int main(int argc, char **argv)
     int frames_given = 0;
     int initial_frame = 0;
     int last_frame = -1;
-    scene scn;
+    scene *scn = NULL;
     char fname[NAME_MAX];
     char dname[128];
     char dname2[145];
@@ -1446,8 +2852,8 @@ int main(int argc, char **argv)
 
     /* process command-line options */
     int ch = '\0';
-    /* unused: c,e,g,i,j,x */
-    while( (ch=getopt(argc, argv, ":a:b:d:f:ghk:l:m:n:o:pq:r:s:t:u:v:wyz3:"))!=-1 ) {
+    /* unused: no lowercase letters left, of the rest only 3,P,R,S,T are taken */
+    while( (ch=getopt(argc, argv, ":a:b:c:d:e:f:ghij:k:l:m:n:o:pq:r:s:t:u:v:wx:yz3:PR:S:T:"))!=-1 ) {
         int arg1, arg2, arg3;
         int nargs;
 
@@ -1507,6 +2913,15 @@ int main(int argc, char **argv)
                 }
                 printf("rendering in %id\n", dimensions);
                 break;
+            case 'e':
+                if( sampler_parse(optarg, &sampler_type) != 0 ) {
+                    #ifdef WITH_MPI
+                    MPI_Finalize();
+                    #endif /* WITH_MPI */
+                    exit(1);
+                }
+                printf("sampler = %s\n", optarg);
+                break;
             case 'f':
                 nargs = sscanf(optarg,"%d:%d:%d", &arg1, &arg2, &arg3);
                 if( nargs >= 3 ) {
@@ -1522,6 +2937,20 @@ int main(int argc, char **argv)
                 }
                 printf("frames %i to %i of %i.\n", initial_frame, last_frame, frames);
                 break;
+            case 'c':
+                nargs = sscanf(optarg, "%d,%lf", &arg1, &light_cull);
+                if( nargs >= 1 )
+                    light_samples = MAX(arg1, 0);
+                printf("light samples = %i, cull threshold = %g\n", light_samples, light_cull);
+                break;
+            case 'i':
+                wavefront = 1;
+                printf("wavefront rendering enabled\n");
+                break;
+            case 'j':
+                russian_roulette = atoi(optarg);
+                printf("russian roulette after %i bounce%s\n", russian_roulette, russian_roulette!=1?"s":"");
+                break;
             case 'k':
                 cluster_k = atoi(optarg);
                 printf("clusters per level = %i\n", cluster_k);
@@ -1668,6 +3097,35 @@ int main(int argc, char **argv)
                 threads = atoi(optarg);
                 printf("threads = %i\n", threads);
                 break;
+            case 'P':
+                pin_threads = 1;
+                printf("pinning threads to processors\n");
+                break;
+            case 'R':
+                progressive = 1;
+                sscanf(optarg,"%lf,%lf", &progressive_interval, &progressive_budget);
+                printf("progressive refinement: preview every %gs, budget %gs\n",
+                       progressive_interval, progressive_budget);
+                break;
+            case 'S':
+                /* file[,seconds] */
+                free(status_file);
+                status_file = strdup(optarg);
+                if( strrchr(status_file, ',') != NULL ) {
+                    char *comma = strrchr(status_file, ',');
+                    *comma = '\0';
+                    status_interval = MIN(atof(comma+1), STATUS_MAX_INTERVAL);
+                }
+                if( status_file[0] == '\0' ) {
+                    free(status_file); status_file = NULL;
+                }
+                printf("status file = %s, every %gs\n", status_file ? status_file : "none",
+                       status_interval > 0 ? status_interval : STATUS_DEFAULT_INTERVAL);
+                break;
+            case 'T':
+                tile_size = MAX(atoi(optarg), 1);
+                printf("tile size = %i\n", tile_size);
+                break;
             case 'u':
                 scene_config = strdup(optarg);
                 printf("scene config string = %s\n", scene_config);
@@ -1708,6 +3166,13 @@ int main(int argc, char **argv)
                 printf("    vFov = %g\n", camera_v_fov * 180.0 / M_PI);
                 printf("    hFov = %g\n", camera_h_fov * 180.0 / M_PI);
                 break;
+            case 'x':
+                nargs = sscanf(optarg,"%lf,%lf,%lf", &adapt_max_error,
+                               &adapt_spp_budget, &adapt_time_budget);
+                adapt_requested = 1;
+                printf("adaptive sampling: error=%g, budget=%g spp, %gs\n",
+                       adapt_max_error, adapt_spp_budget, adapt_time_budget);
+                break;
             case 'w':
                 recursive_aa = 1;
                 printf("recursive anti-aliasing (Whitted’s method) enabled\n");
@@ -1757,10 +3222,49 @@ int main(int argc, char **argv)
     /* load objects */
     register_objects(obj_dir);
 
+    /* one pool for every frame, the main thread works alongside it */
+    pool_init(&render_pool, MAX(threads,1)-1, pin_threads);
+
+    int print_status = 1;
+    #ifdef WITH_MPI
+    print_status = (mpiRank == 0 || (mpiRank == 1 && mpi_mode == MPI_MODE_FRAME));
+    #endif /* WITH_MPI */
+    status_start(&render_status, status_file, status_interval, print_status);
+
     #ifdef WITH_MPI
     int frames_running = 0;
     #endif /* WITH_MPI */
 
+    /* the frame being rendered and the one being set up */
+    frame_setup_t setups[2];
+    memset(setups, '\0', sizeof(setups));
+    for(int s=0; s<2; ++s) {
+        frame_setup_t *setup = &setups[s];
+        setup->dimensions = dimensions;
+        setup->frames = frames;
+        setup->config = scene_config;
+        setup->custom_scene = custom_scene;
+        setup->write_yaml = write_yaml;
+        setup->threads = threads;
+        setup->cluster_k = cluster_k;
+        setup->cam_type = CAMERA_NORMAL;
+        if( enable_vr )
+            setup->cam_type = CAMERA_VR;
+        else if( enable_pano )
+            setup->cam_type = CAMERA_PANO;
+        setup->v_fov = camera_v_fov;
+        setup->h_fov = camera_h_fov;
+    }
+    frame_setup_t *cur = &setups[0];
+    frame_setup_t *next = &setups[1];
+    pool_group_t next_group = { 0 };
+    int next_frame = -1;
+    int pipeline = 1;
+    #ifdef WITH_MPI
+    /* scenes move between ranks, so set them up in frame order */
+    pipeline = (mpi_mode == MPI_MODE_NONE);
+    #endif /* WITH_MPI */
+
     struct timeval global_timer;
     double seconds;
     timer_start(&global_timer);
@@ -1783,35 +3287,24 @@ int main(int argc, char **argv)
         if( mpi_mode==MPI_MODE_FRAME2 && mpiRank!=0 && mpiRank!=render_rank ) {
             continue;
         }
-
-        if( mpiRank == 0 ) {
-            /* only rank 0 computes the scene */
         #endif /* WITH_MPI */
-            /* set up scene */
-            if( custom_scene!=NULL ) {
-                (*custom_scene)(&scn,dimensions,i,frames,scene_config);
-            } else {
-                scene_setup(&scn,dimensions,i,frames,scene_config);
-            }
-            //scene_print(&scn);
-
-            #ifdef WITH_YAML
-            if( write_yaml ) {
-                char *output_dir = "yaml";
-                char yaml_fname[PATH_MAX];
-                mkdir(output_dir,0700);
-                utimes(output_dir, NULL);
-                snprintf(dname,sizeof(dname),"%s/%s_%id", output_dir, scn.name, dimensions);
-                mkdir(dname,0700);
-                utimes(dname, NULL);
-                snprintf(yaml_fname, sizeof(yaml_fname), "%s/%s_%05i.yaml", dname, scn.name, i);
-                scene_write_yaml(&scn, yaml_fname);
-            }
-            #endif /* WITH_YAML */
 
-        #ifdef WITH_MPI
+        if( next_frame == i ) {
+            /* set up while the last frame rendered */
+            pool_wait(&render_pool, &next_group);
+            frame_setup_t *tmp = cur;
+            cur = next;
+            next = tmp;
+            next_frame = -1;
+        } else {
+            cur->frame = i;
+            #ifdef WITH_MPI
+            /* only rank 0 computes the scene */
+            if( mpiRank == 0 )
+            #endif /* WITH_MPI */
+                frame_scene(cur);
         }
-        #endif /* WITH_MPI */
+        scn = &cur->scn;
 
         /* This has to happen after the call to scene setup function, in case
          * there is persistent interframe data that needs to be updated. */
@@ -1820,18 +3313,18 @@ int main(int argc, char **argv)
             #ifdef WITH_MPI
             if( mpiRank == 0 )
             #endif /* WITH_MPI */
-                scene_free(&scn);
+                scene_free(scn);
             continue;
         }
 
         #ifdef WITH_MPI
         if( mpi_mode == MPI_MODE_ROW || mpi_mode == MPI_MODE_PIXEL ) {
             /* broadcast scene */
-            mpi_broadcast_scene(&scn);
+            mpi_broadcast_scene(scn);
         } else if( mpi_mode == MPI_MODE_FRAME || mpi_mode == MPI_MODE_FRAME2 ) {
             /* send scene to appropriate rank */
             if( render_rank != 0 ) {
-                mpi_send_scene(&scn, 0, render_rank);
+                mpi_send_scene(scn, 0, render_rank);
             }
             ++frames_running;
         }
@@ -1841,10 +3334,10 @@ int main(int argc, char **argv)
         char *output_dir = "images";
         mkdir(output_dir,0700);
         utimes(output_dir, NULL);
-        snprintf(dname,sizeof(dname),"%s/%s", output_dir, scn.name);
+        snprintf(dname,sizeof(dname),"%s/%s", output_dir, scn->name);
         mkdir(dname,0700);
         utimes(dname,NULL);
-        snprintf(dname,sizeof(dname),"%s/%s/%id%s%s%s%s", output_dir, scn.name, dimensions, mode_str[0]=='\0'?"":"_", mode_str, cam_str[0]=='\0'?"":"_", cam_str);
+        snprintf(dname,sizeof(dname),"%s/%s/%id%s%s%s%s", output_dir, scn->name, dimensions, mode_str[0]=='\0'?"":"_", mode_str, cam_str[0]=='\0'?"":"_", cam_str);
         mkdir(dname,0700);
         utimes(dname,NULL);
         snprintf(res_str,sizeof(res_str),"%ix%i", width, height);
@@ -1865,11 +3358,11 @@ int main(int argc, char **argv)
         if( IMAGE_FORMAT == IMG_TYPE_JPEG )
            ext = "jpg";
         #endif /* WITH_JPEG */
-        snprintf(fname,sizeof(fname),"%s/%s_%s_%04i.%s", dname2, scn.name, res_str, i, ext);
+        snprintf(fname,sizeof(fname),"%s/%s_%s_%04i.%s", dname2, scn->name, res_str, i, ext);
         char *depth_fname = NULL;
         if( record_depth_map ) {
             depth_fname = calloc(PATH_MAX,sizeof(char));
-            snprintf(depth_fname,PATH_MAX,"%s/%s_%s_%04i.%s", depth_dname, scn.name, res_str, i, ext);
+            snprintf(depth_fname,PATH_MAX,"%s/%s_%s_%04i.%s", depth_dname, scn->name, res_str, i, ext);
         }
 
         image_t *img = NULL;
@@ -1892,37 +3385,23 @@ int main(int argc, char **argv)
         #ifdef WITH_MPI
         if( mpi_mode == MPI_MODE_ROW || mpi_mode == MPI_MODE_PIXEL || mpiRank == render_rank ) {
         #endif /* WITH_MPI */
-            printf("Scene has %i objects and %i lights\n", scn.num_objects, scn.num_lights);
+            printf("Scene has %i objects and %i lights\n", scn->num_objects, scn->num_lights);
 
+            /* build kd-tree, unless it was built with the scene */
+            if( !cur->built )
+                frame_build(cur);
             #ifndef WITHOUT_KDTREE
-            /* build kd-tree */
-            kd_tree_init(&kdtree, scn.dimensions);
-            kd_item_list_t kditems;
-            kd_item_list_init(&kditems);
-            int num = scn.num_objects;
-            for(int i=0; i<num; ++i) {
-               object *obj_ptr = scn.object_ptrs[i];
-               object_get_bounds(obj_ptr);
-               object_kdlist_add(&kditems, obj_ptr, i);
-            }
-            kd_tree_build(&kdtree, &kditems);
-            #else
-            scene_cluster(&scn, cluster_k);
+            kdtree = &cur->tree;
             #endif /* !WITHOUT_KDTREE */
 
-            scene_validate_objects(&scn);
-
-            /* setup camera, as requested */
-            if( enable_vr ) {
-                scn.cam.type = CAMERA_VR;
-                scn.cam.vFov = camera_v_fov;
-                scn.cam.hFov = camera_h_fov;
-            } else if( enable_pano ) {
-                scn.cam.type = CAMERA_PANO;
-                scn.cam.vFov = camera_v_fov;
-                scn.cam.hFov = camera_h_fov;
+            /* set up the next frame on the pool while this one renders,
+             * queued first so a worker takes it before any tiles */
+            if( pipeline && i+1 < frames && i+1 <= last_frame ) {
+                next->frame = i+1;
+                next->build = (i+1 >= initial_frame);
+                next_frame = i+1;
+                pool_submit(&render_pool, &next_group, frame_setup_job, next);
             }
-            camera_aim(&scn.cam);
 
             /* do actual rendering */
             #ifdef WITH_MPI
@@ -1930,11 +3409,11 @@ int main(int argc, char **argv)
             #else
             printf("rendering frame %i/%i \n", i, frames);
             #endif /* WITH_MPI */
-            render_image(&scn, fname, depth_fname, width, height, samples, stereo, threads, aa_diff, aa_depth, max_optic_depth, img, depth_img);
+            render_frame = i;
+            render_image(scn, fname, depth_fname, width, height, samples, stereo, threads, aa_diff, aa_depth, max_optic_depth, img, depth_img);
 
             #ifndef WITHOUT_KDTREE
-            kd_item_list_free(&kditems, 1);
-            kd_tree_free(&kdtree);
+            kdtree = NULL;
             #endif /* !WITHOUT_KDTREE */
 
         #ifdef WITH_MPI
@@ -1997,12 +3476,8 @@ int main(int argc, char **argv)
         }
         #endif /* WITH_MPI */
 
-        #ifndef WITHOUT_KDTREE
-        kd_tree_free(&kdtree);
-        #endif /* !WITHOUT_KDTREE */
-
         /* cleanup */
-        scene_free(&scn);
+        frame_free(cur);
         if( depth_fname != NULL ) {
             free(depth_fname); depth_fname = NULL;
         }
@@ -2058,6 +3533,12 @@ int main(int argc, char **argv)
     }
     #endif /* WITH_MPI */
 
+    status_stop(&render_status);
+    free(status_file); status_file = NULL;
+
+    /* finish queued saves and stop the workers */
+    pool_free(&render_pool);
+
     int active_saves = 0;
     while( (active_saves = image_active_saves()) > 0 ) {
         printf("\rPausing to allow %i I/O thread%s to finish. ", active_saves, ((active_saves==1)?"":"s"));
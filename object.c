@@ -8,6 +8,7 @@
 #include <dlfcn.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #ifdef WITH_VALGRIND
@@ -69,6 +70,7 @@ int register_object(char *filename) {
     entry->obj.params = (int (*)(struct gen_object *, int *, int *, int *, int *, int *))dlsym(dl_handle, "params");
     entry->obj.cleanup = (int (*)(struct gen_object *))dlsym(dl_handle, "cleanup");
     entry->obj.bounding_points = (int (*)(struct gen_object *, bounds_list *))dlsym(dl_handle, "bounding_points");
+    entry->obj.get_bounds = (int (*)(struct gen_object *, vectNd *, double *))dlsym(dl_handle, "get_bounds");
     entry->obj.intersect = (int (*)(struct gen_object *, vectNd *, vectNd *, vectNd *, vectNd *, struct gen_object **))dlsym(dl_handle, "intersect");
     entry->obj.get_color = (int (*)(struct gen_object *, vectNd *, double *, double *, double *))dlsym(dl_handle, "get_color");
     if( entry->obj.get_color == NULL )
@@ -241,12 +243,14 @@ object *object_alloc(int dimensions, char *type, char *name) {
 
     /* record number of dimensions */
     obj->dimensions = dimensions;
+    obj->material = -1;
 
     /* fill in function pointers */
     obj->type_name = curr->obj.type_name;
     obj->params = curr->obj.params;
     obj->cleanup = curr->obj.cleanup;
     obj->bounding_points = curr->obj.bounding_points;
+    obj->get_bounds = curr->obj.get_bounds;
     obj->intersect = curr->obj.intersect;
     obj->get_color = curr->obj.get_color;
     obj->get_reflect = curr->obj.get_reflect;
@@ -271,6 +275,12 @@ object *object_alloc(int dimensions, char *type, char *name) {
 
 int object_free(object *obj) {
 
+    /* shared objects are only freed by their last owner */
+    if( obj->refs > 0 ) {
+        obj->refs--;
+        return 0;
+    }
+
     if( obj->cleanup ) {
         obj->cleanup(obj);
     }
@@ -317,6 +327,21 @@ int object_free(object *obj) {
     return 0;
 }
 
+/* take an extra reference to obj, so it can be placed in several objects
+ * (e.g., as the prototype of many instances) and still be freed once. */
+object *object_share(object *obj) {
+    obj->refs++;
+    return obj;
+}
+
+/* instances reference a prototype in their own coordinates, so moving an
+ * instance must only change its transform */
+static int object_moves_subobjects(object *obj) {
+    char typename[OBJ_TYPE_MAX_LEN] = "";
+    obj->type_name(typename,sizeof(typename));
+    return strncmp(typename, "instance", sizeof(typename)) != 0;
+}
+
 int object_cleanup_all(object *obj) {
     /* perform a post-order cleanup on all objects rooted at obj */
     for(int i=0; i<obj->n_obj; ++i) {
@@ -514,6 +539,83 @@ int object_add_obj(object *obj, object *new_obj) {
     return 0;
 }
 
+/*
+ * Binary mesh file layout (native byte order):
+ *   char[4]  magic "NDTM"
+ *   int32    version (1)
+ *   int32    dimensions
+ *   int32    number of vertices
+ *   int32    number of normals (0 or number of vertices)
+ *   int32    number of simplices
+ *   double   vertices[vertices][dimensions]
+ *   double   normals[normals][dimensions]
+ *   int32    indices[simplices][dimensions]
+ */
+int object_load_mesh(object *obj, char *fname) {
+    if( obj->n_pos != 0 || obj->n_dir != 0 || obj->n_flag != 0 ) {
+        fprintf(stderr, "%s: object '%s' already has positions, directions, or flags.\n", __FUNCTION__, obj->name);
+        return -1;
+    }
+
+    FILE *fp = fopen(fname, "rb");
+    if( fp == NULL ) {
+        perror(fname);
+        return -1;
+    }
+
+    char magic[4];
+    int32_t header[5];
+    if( fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+        || memcmp(magic, "NDTM", sizeof(magic)) != 0
+        || fread(header, sizeof(header[0]), 5, fp) != 5 ) {
+        fprintf(stderr, "%s: '%s' is not a mesh file.\n", __FUNCTION__, fname);
+        fclose(fp);
+        return -1;
+    }
+
+    int version = header[0], dim = header[1];
+    int n_verts = header[2], n_norms = header[3], n_faces = header[4];
+    if( version != 1 || dim != obj->dimensions || n_verts < 0 || n_faces < 0
+        || (n_norms != 0 && n_norms != n_verts) ) {
+        fprintf(stderr, "%s: unsupported mesh '%s' (version %i, %i dimensions, %i vertices, %i normals).\n", __FUNCTION__, fname, version, dim, n_verts, n_norms);
+        fclose(fp);
+        return -1;
+    }
+
+    int ret = 0;
+    vectNd vec;
+    vectNd_calloc(&vec, dim);
+
+    /* shared vertex and normal buffers */
+    for(int i=0; i<n_verts+n_norms && ret==0; ++i) {
+        if( fread(vec.v, sizeof(double), dim, fp) != (size_t)dim ) {
+            ret = -1;
+        } else if( i < n_verts ) {
+            ret = object_add_pos(obj, &vec);
+        } else {
+            ret = object_add_dir(obj, &vec);
+        }
+    }
+    vectNd_free(&vec);
+
+    /* flag[0] selects vertex normals, followed by the index buffer */
+    if( ret == 0 )
+        ret = object_add_flag(obj, n_norms > 0);
+    for(int i=0; i<n_faces*dim && ret==0; ++i) {
+        int32_t idx;
+        if( fread(&idx, sizeof(idx), 1, fp) != 1 || idx < 0 || idx >= n_verts )
+            ret = -1;
+        else
+            ret = object_add_flag(obj, idx);
+    }
+    fclose(fp);
+
+    if( ret < 0 )
+        fprintf(stderr, "%s: '%s' is truncated or has invalid indices.\n", __FUNCTION__, fname);
+
+    return ret;
+}
+
 
 int object_move(object *obj, vectNd *offset) {
     /* make sure object is complete enough to be manipulated */
@@ -526,7 +628,7 @@ int object_move(object *obj, vectNd *offset) {
     vectNd_add(&obj->bounds.center, offset, &obj->bounds.center);
 
     /* move all sub-objects */
-    for(int i=0; i<obj->n_obj; ++i) {
+    for(int i=0; i<obj->n_obj && object_moves_subobjects(obj); ++i) {
         object_move(obj->obj[i], offset);
     }
 
@@ -549,7 +651,7 @@ int object_rotate(object *obj, vectNd *center, int v1, int v2, double angle) {
     }
 
     /* rotate all sub-objects */
-    for(int i=0; i<obj->n_obj; ++i) {
+    for(int i=0; i<obj->n_obj && object_moves_subobjects(obj); ++i) {
         object_rotate(obj->obj[i], center, v1, v2, angle);
     }
 
@@ -572,7 +674,7 @@ int object_rotate2(object *obj, vectNd *center, vectNd *v1, vectNd *v2, double a
     }
 
     /* rotate all sub-objects */
-    for(int i=0; i<obj->n_obj; ++i) {
+    for(int i=0; i<obj->n_obj && object_moves_subobjects(obj); ++i) {
         object_rotate2(obj->obj[i], center, v1, v2, angle);
     }
 
@@ -580,6 +682,14 @@ int object_rotate2(object *obj, vectNd *center, vectNd *v1, vectNd *v2, double a
 }
 
 int object_get_bounds(object *obj) {
+    /* use closed form bounds when the object type knows them */
+    if( obj->get_bounds != NULL
+        && obj->get_bounds(obj, &obj->bounds.center, &obj->bounds.radius) == 0 ) {
+        if( obj->bounds.radius > 0.0 )
+            obj->bounds.radius += EPSILON;
+        return 0;
+    }
+
     bounds_list points;
     bounds_list_init(&points);
     obj->bounding_points(obj, &points);
@@ -680,32 +790,111 @@ int object_kdlist_add(kd_item_list_t *list, object *obj, int obj_id) {
     return 1;
 }
 
-int trace_kd(vectNd *pos, vectNd *unit_look, kd_tree_t *kd, vectNd *hit, vectNd *hit_normal, object **ptr, double dist_limit) {
+int trace_kd(vectNd *pos, vectNd *unit_look, kd_tree_t *kd, vectNd *hit, vectNd *hit_normal, object **ptr, double dist_limit, kd_scratch_t *scratch) {
 
     /* traverse kd-tree to get list of hitable objects */
-    int ret = kd_tree_intersect(kd, pos, unit_look, hit, hit_normal, (void**)ptr, dist_limit);
+    int ret = kd_tree_intersect(kd, pos, unit_look, hit, hit_normal, (void**)ptr, dist_limit, scratch);
 
     return ret;
 }
 #endif /* !WITHOUT_KDTREE */
 
-int trace(vectNd *pos, vectNd *unit_look, object **objs, int *ids, int n, char *obj_mask, vectNd *hit, vectNd *hit_normal, object **ptr, double *t_ptr, double dist_limit) {
+/* objs must have their bounding spheres set already */
+int render_view_init(render_view_t *view, object **objs, int num, int dimensions) {
+    memset(view, '\0', sizeof(*view));
+    view->num = num;
+    view->dimensions = dimensions;
+    view->views = calloc(num, sizeof(object_view_t));
+    view->centers = calloc((size_t)num*dimensions, sizeof(double));
+    view->materials = calloc(num, sizeof(material_t));
+
+    for(int i=0; i<num; ++i) {
+        object *obj = objs[i];
+        object_view_t *ov = &view->views[i];
+        ov->obj = obj;
+        ov->intersect = obj->intersect;
+        if( obj->bounds.radius > 0 ) {
+            ov->radius = obj->bounds.radius;
+            ov->radius_sqr = obj->bounds.radius * obj->bounds.radius;
+            memcpy(view->centers + (size_t)i*dimensions, obj->bounds.center.v,
+                dimensions*sizeof(double));
+        }
+
+        /* copy shading data, hooks are only called for custom ones */
+        material_t *mtl = &view->materials[i];
+        mtl->red = obj->red;
+        mtl->green = obj->green;
+        mtl->blue = obj->blue;
+        mtl->red_r = obj->red_r;
+        mtl->green_r = obj->green_r;
+        mtl->blue_r = obj->blue_r;
+        mtl->refract_index = obj->refract_index;
+        mtl->transparent = obj->transparent;
+        if( obj->get_color != default_color )
+            mtl->custom |= MATERIAL_CUSTOM_COLOR;
+        if( obj->get_reflect != default_reflect )
+            mtl->custom |= MATERIAL_CUSTOM_REFLECT;
+        obj->material = i;
+    }
+
+    return 0;
+}
+
+int render_view_free(render_view_t *view) {
+    for(int i=0; i<view->num; ++i)
+        view->views[i].obj->material = -1;
+    free(view->materials); view->materials = NULL;
+    free(view->views); view->views = NULL;
+    free(view->centers); view->centers = NULL;
+    view->num = 0;
+    return 0;
+}
+
+/* same test as vect_bounding_sphere_intersect, without the temporary */
+static inline int view_bounds_intersect(double *center, double radius, double radius_sqr, vectNd *o, vectNd *v, double min_dist) {
+    int dim = o->n;
+    double oc_len2 = 0.0, voc = 0.0;
+    for(int k=0; k<dim; ++k) {
+        double oc = o->v[k] - center[k];
+        oc_len2 += oc*oc;
+        voc += v->v[k]*oc;
+    }
+
+    /* abort if bounding sphere is too far away based on min_dist */
+    if( min_dist > 0 ) {
+        double min_dist_r = min_dist+radius;
+        if( oc_len2 > min_dist_r*min_dist_r )
+            return 0;
+    }
+
+    /* check to see if bounding sphere is missed or behind us */
+    double voc2 = voc*voc;
+    double desc = voc2 - oc_len2 + radius_sqr;
+    if( desc < 0.0 || (voc > 0.0 && voc2 > desc) )
+        return 0;
+
+    return 1;
+}
+
+/*
+ * Loop shared by trace() and trace_view(), finds the nearest of n objects
+ * hit, taken from objs or, when objs is NULL, from view.  A dist_limit of 0
+ * or more makes it an occlusion query, which stops at the first hit closer
+ * than dist_limit (any hit when it is 0) and reports that one.  res and
+ * normal are scratch space for candidate hits.
+ */
+static forceinline int trace_objects(vectNd *pos, vectNd *unit_look, object **objs, render_view_t *view, int *ids, int n, char *obj_mask, vectNd *hit, vectNd *hit_normal, object **ptr, double *t_ptr, double dist_limit, vectNd *res, vectNd *normal) {
     double min_dist = -1;
-    vectNd res;
-    vectNd normal;
     int dim = unit_look->n;
 
-    vectNd_alloc(&res,dim);
-    vectNd_alloc(&normal,dim);
-
     /* for each object */
     if( ptr!=NULL )
         *ptr = NULL;
     for(int i=0; i<n; ++i) {
+        int id = ids ? ids[i] : i;
 
         /* skip objects that have already been checked */
-        if( obj_mask && ids ) {
-            int id = ids[i];
+        if( obj_mask ) {
             if( obj_mask[id] != 0 ) {
                 continue;
             }
@@ -715,21 +904,32 @@ int trace(vectNd *pos, vectNd *unit_look, object **objs, int *ids, int n, char *
         int ret = VECTND_FAIL;
         double dist = -1;
         object *tmp_ptr = NULL;
-
-        ret = vect_object_intersect(objs[i], pos, unit_look, &res, &normal, &tmp_ptr, min_dist);
+        if( objs != NULL ) {
+            ret = vect_object_intersect(objs[i], pos, unit_look, res, normal, &tmp_ptr, min_dist);
+        } else {
+            /* check bounding sphere first */
+            object_view_t *ov = &view->views[id];
+            if( ov->radius_sqr > 0
+                && !view_bounds_intersect(view->centers + (size_t)id*dim, ov->radius, ov->radius_sqr, pos, unit_look, min_dist) )
+                continue;
+            ret = ov->intersect(ov->obj, pos, unit_look, res, normal, &tmp_ptr);
+        }
         if( ret > 0 ) {
-            vectNd_dist(pos,&res,&dist);
-            if( dist > EPSILON && (dist+EPSILON < min_dist || min_dist < 0) ) {
+            vectNd_dist(pos,res,&dist);
+            if( dist <= EPSILON )
+                continue;
+
+            /* an occluder ends the query, whichever object comes first */
+            int occludes = dist_limit == 0.0 || dist < dist_limit;
+            if( occludes || dist+EPSILON < min_dist || min_dist < 0 ) {
                 min_dist = dist;
-                vectNd_copy(hit,&res);
-                vectNd_copy(hit_normal,&normal);
+                vectNd_copy(hit,res);
+                vectNd_copy(hit_normal,normal);
                 if( ptr!=NULL )
                     *ptr = tmp_ptr;
             }
-
-            if( dist_limit == 0.0 || dist < dist_limit ) {
+            if( occludes )
                 break;
-            }
         }
     }
 
@@ -737,11 +937,90 @@ int trace(vectNd *pos, vectNd *unit_look, object **objs, int *ids, int n, char *
         *t_ptr = min_dist;
     }
 
-    vectNd_free(&normal);
-    vectNd_free(&res);
-
     if( min_dist < 0 )
         return 0;
 
     return 1;
 }
+
+int trace(vectNd *pos, vectNd *unit_look, object **objs, int *ids, int n, char *obj_mask, vectNd *hit, vectNd *hit_normal, object **ptr, double *t_ptr, double dist_limit) {
+    vectNd res;
+    vectNd normal;
+    int dim = unit_look->n;
+
+    vectNd_alloc(&res,dim);
+    vectNd_alloc(&normal,dim);
+
+    int ret = trace_objects(pos, unit_look, objs, NULL, ids, n, obj_mask, hit, hit_normal, ptr, t_ptr, dist_limit, &res, &normal);
+
+    vectNd_free(&normal);
+    vectNd_free(&res);
+
+    return ret;
+}
+
+/* trace() over a render view, ids index into the view, or are 0..n-1 when
+ * NULL.  res and normal are scratch space for candidate hits, allocated
+ * here when NULL. */
+int trace_view(vectNd *pos, vectNd *unit_look, render_view_t *view, int *ids, int n, char *obj_mask, vectNd *hit, vectNd *hit_normal, object **ptr, double *t_ptr, double dist_limit, vectNd *res, vectNd *normal) {
+    vectNd local_res;
+    vectNd local_normal;
+    int dim = unit_look->n;
+
+    if( res == NULL ) {
+        vectNd_alloc(&local_res,dim);
+        res = &local_res;
+    }
+    if( normal == NULL ) {
+        vectNd_alloc(&local_normal,dim);
+        normal = &local_normal;
+    }
+
+    int ret = trace_objects(pos, unit_look, NULL, view, ids, n, obj_mask, hit, hit_normal, ptr, t_ptr, dist_limit, res, normal);
+
+    if( normal == &local_normal )
+        vectNd_free(&local_normal);
+    if( res == &local_res )
+        vectNd_free(&local_res);
+
+    return ret;
+}
+
+/* obj's index in view, -1 when it isn't one of the view's objects */
+int render_view_index(render_view_t *view, object *obj) {
+    if( view != NULL && obj != NULL && obj->material >= 0
+        && obj->material < view->num && view->views[obj->material].obj == obj )
+        return obj->material;
+    return -1;
+}
+
+/* shading data for obj at a hit, straight from the view's material table
+ * unless obj isn't in the view or its type has custom shading, in which
+ * case scratch is filled in and returned */
+material_t *object_material(render_view_t *view, object *obj, vectNd *at, material_t *scratch) {
+    material_t *mtl = NULL;
+    int idx = render_view_index(view, obj);
+    if( idx >= 0 ) {
+        mtl = &view->materials[idx];
+        if( mtl->custom == 0 )
+            return mtl;
+        *scratch = *mtl;
+    } else {
+        scratch->red = obj->red;
+        scratch->green = obj->green;
+        scratch->blue = obj->blue;
+        scratch->red_r = obj->red_r;
+        scratch->green_r = obj->green_r;
+        scratch->blue_r = obj->blue_r;
+        scratch->refract_index = obj->refract_index;
+        scratch->transparent = obj->transparent;
+        scratch->custom = MATERIAL_CUSTOM_COLOR | MATERIAL_CUSTOM_REFLECT;
+    }
+
+    if( scratch->custom & MATERIAL_CUSTOM_COLOR )
+        obj->get_color(obj, at, &scratch->red, &scratch->green, &scratch->blue);
+    if( scratch->custom & MATERIAL_CUSTOM_REFLECT )
+        obj->get_reflect(obj, at, &scratch->red_r, &scratch->green_r, &scratch->blue_r);
+
+    return scratch;
+}
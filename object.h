@@ -17,9 +17,25 @@
 #define EPSILON2 ((EPSILON)*(EPSILON))
 #endif /* EPSILON2 */
 
+/* hierarchy builders for cluster objects, selected by flag[1] */
+#define CLUSTER_BUILD_KMEANS 0  /* recursive k-means, k=flag[0] (default) */
+#define CLUSTER_BUILD_MORTON 1  /* bottom-up split along a Morton curve */
+
 #define OBJ_TYPE_MAX_LEN 64
 #define OBJ_NAME_MAX_LEN 32
 
+/* packed shading data, custom marks hooks the object's type exports */
+#define MATERIAL_CUSTOM_COLOR   1
+#define MATERIAL_CUSTOM_REFLECT 2
+
+typedef struct material {
+    double red, green, blue;
+    double red_r, green_r, blue_r;
+    double refract_index;
+    int transparent;
+    int custom;
+} material_t;
+
 typedef struct gen_object {
     unsigned int transparent:1;
     unsigned int prepared:1;
@@ -55,6 +71,12 @@ typedef struct gen_object {
     int n_obj;
     int cap_obj;
 
+    /* number of extra owners, see object_share */
+    int refs;
+
+    /* index into the current render view's material table, -1 if none */
+    int material;
+
     /* bounds data */
     bounding_sphere bounds;
 
@@ -66,6 +88,7 @@ typedef struct gen_object {
     int (*params)(struct gen_object *obj, int *n_pos, int *n_dir, int *n_size, int *n_flags, int *n_obj);
     int (*cleanup)(struct gen_object *obj);
     int (*bounding_points)(struct gen_object * obj, bounds_list *list);
+    int (*get_bounds)(struct gen_object *obj, vectNd *center, double *radius);
     int (*intersect)(struct gen_object * obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, struct gen_object **obj_ptr);
     int (*get_color)(struct gen_object *obj, vectNd *at, double *red, double *green, double *blue);
     int (*get_reflect)(struct gen_object *obj, vectNd *at, double *red_r, double *green_r, double *blue_r);
@@ -73,6 +96,23 @@ typedef struct gen_object {
     int (*refract_ray)(struct gen_object *obj, vectNd *at, double *index);
 } object;
 
+/* compact per-frame copy of what traversal reads from each object, so the
+ * bounding sphere test and dispatch don't pull in the full object struct */
+typedef struct object_view {
+    double radius;      /* bounding sphere, 0 when there is none */
+    double radius_sqr;
+    int (*intersect)(struct gen_object * obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, struct gen_object **obj_ptr);
+    struct gen_object *obj; /* authoring object, passed to intersect */
+} object_view_t;
+
+typedef struct render_view {
+    int num;
+    int dimensions;
+    object_view_t *views;
+    double *centers;    /* num x dimensions bounding sphere centers */
+    material_t *materials;
+} render_view_t;
+
 struct object_reg_entry {
     char type[OBJ_TYPE_MAX_LEN];
     object obj;
@@ -93,6 +133,7 @@ int unregister_objects();
 /* instanciation of objects */
 object *object_alloc(int dimensions, char *type, char *name);
 int object_free(object *obj);
+object *object_share(object *obj);
 int object_cleanup_all(object *obj);
 int object_validate(object *obj);
 
@@ -104,6 +145,7 @@ int object_add_dirStr(object *obj, char *str);
 int object_add_size(object *obj, double new_size);
 int object_add_flag(object *obj, int new_flag);
 int object_add_obj(object *obj, object *new_obj);
+int object_load_mesh(object *obj, char *fname);
 
 /* positioning objects */
 int object_move(object * obj, vectNd *offset);
@@ -114,8 +156,15 @@ int object_get_bounds(object *obj);
 /* tracing rays to objects */
 #ifndef WITHOUT_KDTREE
 int object_kdlist_add(kd_item_list_t *list, object *obj, int obj_id);
-int trace_kd(vectNd *pos, vectNd *unit_look, kd_tree_t *kd, vectNd *hit, vectNd *hit_normal, object **ptr, double dist_limit);
+int trace_kd(vectNd *pos, vectNd *unit_look, kd_tree_t *kd, vectNd *hit, vectNd *hit_normal, object **ptr, double dist_limit, kd_scratch_t *scratch);
 #endif /* !WITHOUT_KDTREE */
 int trace(vectNd *pos, vectNd *unit_look, object **objs, int *ids, int n, char *obj_mask, vectNd *hit, vectNd *hit_normal, object **ptr, double *t_ptr, double dist_limit);
 
+/* per-frame render view of a set of objects */
+int render_view_init(render_view_t *view, object **objs, int num, int dimensions);
+int render_view_free(render_view_t *view);
+int trace_view(vectNd *pos, vectNd *unit_look, render_view_t *view, int *ids, int n, char *obj_mask, vectNd *hit, vectNd *hit_normal, object **ptr, double *t_ptr, double dist_limit, vectNd *res, vectNd *normal);
+int render_view_index(render_view_t *view, object *obj);
+material_t *object_material(render_view_t *view, object *obj, vectNd *at, material_t *scratch);
+
 #endif /* OBJECT_H */
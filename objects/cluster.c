@@ -4,12 +4,15 @@
  *
  * Copyright (c) 2019-2021 Bryan Franklin. All rights reserved.
  */
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include "object.h"
 #include "../kmeans.h"
 
+#define CLUSTER_KMEANS_MAX_ITERATIONS 100
+
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutexattr_t lock_attr;
 
@@ -27,6 +30,7 @@ int params(object *obj, int *n_pos, int *n_dir, int *n_size, int *n_flags, int *
     *n_dir = 0;
     *n_size = 0;
     *n_flags = 1;   /* number of sub-clusters for k-means */
+                    /* optional flag[1]: CLUSTER_BUILD_* hierarchy builder */
     *n_obj = 0;
 
     return 0;
@@ -79,6 +83,176 @@ static int check_bounds(object *obj, bounding_sphere *bounds) {
 }
 #endif /* 0 */
 
+typedef struct morton_item {
+    uint64_t code;
+    object *obj;
+} morton_item_t;
+
+static int morton_compar(const void *a, const void *b) {
+    uint64_t ca = ((const morton_item_t*)a)->code;
+    uint64_t cb = ((const morton_item_t*)b)->code;
+
+    if( ca < cb )
+        return -1;
+    if( ca > cb )
+        return 1;
+    return 0;
+}
+
+/* grow bounds (center,radius) to also enclose sphere (c2,r2), exactly */
+static void cluster_enclose(vectNd *center, double *radius, vectNd *c2, double r2) {
+    if( *radius < 0 || r2 < 0 ) {
+        *radius = -1.0;
+        return;
+    }
+
+    double dist = 0.0;
+    vectNd_dist(center, c2, &dist);
+    if( dist + r2 <= *radius )
+        return;
+    if( dist + *radius <= r2 ) {
+        vectNd_copy(center, c2);
+        *radius = r2;
+        return;
+    }
+
+    double new_radius = (dist + *radius + r2) / 2.0;
+    vectNd_interpolate(center, c2, (new_radius - *radius) / dist, center);
+    *radius = new_radius;
+}
+
+/* set a node's bounds from its children's bounding spheres, without
+ * enumerating all of the points below it */
+static void cluster_merge_bounds(object *clstr) {
+    if( clstr->n_obj < 1 )
+        return;
+
+    vectNd_copy(&clstr->bounds.center, &clstr->obj[0]->bounds.center);
+    clstr->bounds.radius = clstr->obj[0]->bounds.radius;
+    for(int i=1; i<clstr->n_obj; ++i) {
+        object *sub = clstr->obj[i];
+        cluster_enclose(&clstr->bounds.center, &clstr->bounds.radius,
+                        &sub->bounds.center, sub->bounds.radius);
+    }
+}
+
+/* split a sorted range where the highest differing bit of its codes flips */
+static int morton_split(morton_item_t *items, int start, int end) {
+    uint64_t diff = items[start].code ^ items[end-1].code;
+    if( diff == 0 )
+        return (start + end) / 2;
+
+    uint64_t high = (uint64_t)1 << 63;
+    while( (diff & high) == 0 )
+        high >>= 1;
+
+    int lo = start, hi = end-1;
+    while( lo < hi ) {
+        int mid = (lo + hi) / 2;
+        if( items[mid].code & high )
+            hi = mid;
+        else
+            lo = mid+1;
+    }
+
+    return lo;
+}
+
+static object *morton_build(morton_item_t *items, int start, int end, int dim) {
+    if( end - start == 1 )
+        return items[start].obj;
+
+    int split = morton_split(items, start, end);
+    object *node = object_alloc(dim, "cluster", "morton node");
+    object_add_flag(node, 2);
+    object_add_flag(node, CLUSTER_BUILD_MORTON);
+    object_add_obj(node, morton_build(items, start, split, dim));
+    object_add_obj(node, morton_build(items, split, end, dim));
+    cluster_merge_bounds(node);
+    node->prepared = 1;
+
+    return node;
+}
+
+/* bottom-up hierarchy: sort bounding sphere centers along a Morton curve,
+ * then split ranges of codes on their highest differing bit */
+static int cluster_do_morton(object *clstr)
+{
+    int dim = clstr->dimensions;
+    int num = clstr->n_obj;
+    if( num < 3 ) {
+        cluster_merge_bounds(clstr);
+        return 0;
+    }
+
+    /* infinite objects stay at the top level */
+    morton_item_t *items = calloc(num, sizeof(morton_item_t));
+    object **infinite = calloc(num, sizeof(object*));
+    int n_items = 0, n_infinite = 0;
+    for(int i=0; i<num; ++i) {
+        if( clstr->obj[i]->bounds.radius < 0 )
+            infinite[n_infinite++] = clstr->obj[i];
+        else
+            items[n_items++].obj = clstr->obj[i];
+    }
+
+    /* quantize centers within their bounding box */
+    int bits = 64 / dim;
+    if( bits < 1 )
+        bits = 1;
+    if( bits > 16 )
+        bits = 16;
+    double scale = (double)((1<<bits) - 1);
+    vectNd lo, hi;
+    vectNd_alloc(&lo, dim);
+    vectNd_alloc(&hi, dim);
+    vectNd_fill(&lo, INFINITY);
+    vectNd_fill(&hi, -INFINITY);
+    for(int i=0; i<n_items; ++i) {
+        double *c = items[i].obj->bounds.center.v;
+        for(int d=0; d<dim; ++d) {
+            if( c[d] < lo.v[d] ) lo.v[d] = c[d];
+            if( c[d] > hi.v[d] ) hi.v[d] = c[d];
+        }
+    }
+    for(int i=0; i<n_items; ++i) {
+        double *c = items[i].obj->bounds.center.v;
+        uint64_t code = 0;
+        for(int b=bits-1; b>=0; --b) {
+            for(int d=0; d<dim && d<64; ++d) {
+                double extent = hi.v[d] - lo.v[d];
+                uint64_t q = 0;
+                if( extent > 0 )
+                    q = (uint64_t)((c[d] - lo.v[d]) / extent * scale);
+                code = (code << 1) | ((q >> b) & 1);
+            }
+        }
+        items[i].code = code;
+    }
+    vectNd_free(&lo);
+    vectNd_free(&hi);
+
+    qsort(items, n_items, sizeof(morton_item_t), morton_compar);
+
+    /* replace object list with the two halves and any infinite objects */
+    clstr->n_obj = 0;
+    if( n_items > 0 ) {
+        int split = morton_split(items, 0, n_items);
+        if( split > 0 )
+            object_add_obj(clstr, morton_build(items, 0, split, dim));
+        if( split < n_items )
+            object_add_obj(clstr, morton_build(items, split, n_items, dim));
+    }
+    for(int i=0; i<n_infinite; ++i)
+        object_add_obj(clstr, infinite[i]);
+    cluster_merge_bounds(clstr);
+
+    free(infinite); infinite = NULL;
+    free(items); items = NULL;
+
+    return 1;
+}
+
 static int cluster_do_clustering(object *clstr, int k)
 {
     /* setup kmeans */
@@ -102,11 +276,10 @@ static int cluster_do_clustering(object *clstr, int k)
     /* perform clustering */
     kmean_vector_list_t centroids;
     kmeans_new_list(&centroids,k,clstr->dimensions);
-    for(int i=0; i<k; ++i) {
-        vectNd_copy(&centroids.data[i].vect, &clstr->obj[i]->bounds.center);
-        centroids.data[i].which = i;
-    }
-    kmeans_find(&centers,&centroids);
+    /* fixed seed, so hierarchies are repeatable from run to run */
+    unsigned short seed[3] = {0x330e, 0xabcd, 0x1234};
+    kmeans_seed(&centers,&centroids,seed);
+    kmeans_find_bounded(&centers,&centroids,CLUSTER_KMEANS_MAX_ITERATIONS,0,1);
 
     /* split objects into sub-clusters */
     object **subs = calloc(k,sizeof(object*));
@@ -230,9 +403,13 @@ static int prepare(object *obj) {
         vectNd_free(&intNorm);
 
         /* cluster objects */
-        cluster_do_clustering(obj, obj->flag[0]);
+        if( obj->n_flag > 1 && obj->flag[1] == CLUSTER_BUILD_MORTON ) {
+            cluster_do_morton(obj);
+        } else {
+            cluster_do_clustering(obj, obj->flag[0]);
 
-        object_get_bounds(obj);
+            object_get_bounds(obj);
+        }
 
         /* mark object as prepared */
         obj->prepared = 1;
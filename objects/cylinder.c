@@ -82,18 +82,16 @@ int bounding_points(object *obj, bounds_list *list) {
     return 1;
 }
 
-static forceinline int between_ends(object *cyl, vectNd *point) {
+/* Bc is scratch space */
+static forceinline int between_ends(object *cyl, vectNd *point, vectNd *Bc) {
 
     if( cyl->n_flag>1 && cyl->flag[1] != 0 )
         return 1;
 
     double scale;
     prepped_t *prepped = cyl->prepped;
-    vectNd Bc;
-    vectNd_alloc(&Bc,point->n);
-    vectNd_sub(point,&cyl->pos[0],&Bc);
-    vectNd_dot(&Bc,&prepped->axis,&scale);
-    vectNd_free(&Bc);
+    vectNd_sub(point,&cyl->pos[0],Bc);
+    vectNd_dot(Bc,&prepped->axis,&scale);
 
     if( scale > 0 && scale < prepped->length )
         return 1;
@@ -110,20 +108,15 @@ int intersect(object *cyl, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, ob
         prepare(cyl);
     }
 
-    /* allocate additional intermediate vectors needed */
+    /* res and normal aren't needed until the end, so they hold the
+     * intermediate vectors rather than allocating more per ray */
     prepped_t *prepped = (prepped_t*)cyl->prepped;
     dim = o->n;
     vectNd *Be = &cyl->pos[0];
     vectNd *A = &prepped->axis;
     double size0 = cyl->size[0];
-    vectNd sA;
-    vectNd X;
-    vectNd Y;
-    vectNd tmp;
-    vectNd_alloc(&sA,dim);
-    vectNd_alloc(&X,dim);
-    vectNd_alloc(&Y,dim);
-    vectNd_alloc(&tmp,dim);
+    vectNd *X = res;
+    vectNd *Y = normal;
 
     /* lots of initial dot products */
     double VdA;
@@ -138,32 +131,24 @@ int intersect(object *cyl, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, ob
     BOaa = (BdA-OdA)/AdA;
 
     /* more vector math */
-    vectNd_scale(A,Vaaa,&sA);
-    vectNd_sub(v,&sA,&Y);
-
-    vectNd_sub(o,Be,&tmp);
-    vectNd_scale(A,BOaa,&sA);
-    vectNd_add(&tmp,&sA,&X);
+    for(int k=0; k<dim; ++k) {
+        Y->v[k] = v->v[k] - A->v[k]*Vaaa;
+        X->v[k] = (o->v[k] - Be->v[k]) + A->v[k]*BOaa;
+    }
 
     /* solve quadratic */
     double qa, qb, qc;
     double det, detRoot;
     double t1, t2;
-    vectNd_dot(&Y,&Y,&qa);
-    vectNd_dot(&Y,&X,&qb);
+    vectNd_dot(Y,Y,&qa);
+    vectNd_dot(Y,X,&qb);
     qb *= 2;    /* FOILed again! */
-    vectNd_dot(&X,&X,&qc);
+    vectNd_dot(X,X,&qc);
     qc -= size0 * size0;
 
-    /* free intermediate results that are no longer needed */
-
     /* solve for t */
     det = qb*qb - 4*qa*qc;
     if( det <= 0 ) {
-        vectNd_free(&tmp);
-        vectNd_free(&Y);
-        vectNd_free(&X);
-        vectNd_free(&sA);
         return 0;
     }
     detRoot = sqrt(det);
@@ -172,37 +157,33 @@ int intersect(object *cyl, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, ob
 
     /* pick which (if any) point to return */
     if( t2>EPSILON ) {
-        vectNd_scale(v,t2,&sA);
-        vectNd_add(o,&sA,res);
+        for(int k=0; k<dim; ++k)
+            res->v[k] = o->v[k] + v->v[k]*t2;
 
         /* do end test */
-        if( between_ends(cyl, res) )
+        if( between_ends(cyl, res, normal) )
             ret = 1;
     }
 
     if( ret==0 && t1>EPSILON ) {
-        vectNd_scale(v,t1,&sA);
-        vectNd_add(o,&sA,res);
+        for(int k=0; k<dim; ++k)
+            res->v[k] = o->v[k] + v->v[k]*t1;
 
         /* do end test */
-        if( between_ends(cyl, res) )
+        if( between_ends(cyl, res, normal) )
             ret = 1;
     }
 
     /* find normal */
     if( ret != 0 ) {
         double nCdA;
-        vectNd_sub(res,Be,&X);
-        vectNd_dot(A,&X,&nCdA);
-        vectNd_scale(A,nCdA/AdA,&Y);
-        vectNd_sub(&X,&Y,normal);
+        vectNd_sub(res,Be,normal);
+        vectNd_dot(A,normal,&nCdA);
+        double s = nCdA/AdA;
+        for(int k=0; k<dim; ++k)
+            normal->v[k] -= A->v[k]*s;
     }
 
-    vectNd_free(&tmp);
-    vectNd_free(&Y);
-    vectNd_free(&X);
-    vectNd_free(&sA);
-
     if( ret )
         *ptr = cyl;
 
@@ -233,6 +233,30 @@ int bounding_points(object *obj, bounds_list *list) {
     return 1;
 }
 
+/* centered on pos[0], and with orthogonal edges every corner is at the same
+ * distance, so the smallest enclosing ball needs no search */
+int get_bounds(object *obj, vectNd *center, double *radius) {
+    int dim = obj->dimensions;
+
+    double len2 = 0.0;
+    for(int i=0; i<dim; ++i) {
+        double dot = 0.0;
+        vectNd_dot(&obj->dir[i], &obj->dir[i], &dot);
+        len2 += dot * obj->size[i] * obj->size[i];
+        for(int j=i+1; j<dim; ++j) {
+            double other = 0.0, cross = 0.0;
+            vectNd_dot(&obj->dir[j], &obj->dir[j], &other);
+            vectNd_dot(&obj->dir[i], &obj->dir[j], &cross);
+            if( fabs(cross) > EPSILON*sqrt(dot*other) )
+                return -1;
+        }
+    }
+
+    vectNd_copy(center, &obj->pos[0]);
+    *radius = 0.5*sqrt(len2);
+    return 0;
+}
+
 int intersect(object *hcube, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr)
 {
     if( !hcube->prepared ) {
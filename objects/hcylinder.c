@@ -8,16 +8,18 @@
 #include <math.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include "object.h"
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct prepared_data {
     /* data that is ray invariant and can be pre-computed in prepare function */
-    vectNd *axes;
+    int n;              /* number of axes, dimensions-2 */
+    double *frame;      /* n x dim unit axes, orthonormal when gram is NULL */
+    double *FdP;        /* frame . pos[0] */
     double *lengths;
-    double *AdA;
-    double *BdA;
+    double *gram;       /* n x n frame . frame, only when axes aren't orthogonal */
 } prepped_t;
 
 static int prepare(object *cyl) {
@@ -25,25 +27,50 @@ static int prepare(object *cyl) {
 
     /* fill in any ray invariant parameters */
     if( !cyl->prepared ) {
-        int dim;
-        vectNd *bottom = &cyl->pos[0];
-
         prepped_t *prepped = calloc(1,sizeof(prepped_t));
 
-        dim = bottom->n;
-        prepped->axes = calloc(dim-2,sizeof(vectNd));
-        prepped->lengths = calloc(dim-2,sizeof(double));
-        prepped->AdA = calloc(dim-2,sizeof(double));
-        prepped->BdA = calloc(dim-2,sizeof(double));
-        for(int i=0; i<dim-2; i++) {
-            vectNd_alloc(&prepped->axes[i],dim);
-            vectNd_sub(&cyl->pos[i+1],&cyl->pos[0],&prepped->axes[i]);
-            vectNd_unitize(&prepped->axes[i]);
-            vectNd_dist(&cyl->pos[i+1],&cyl->pos[0],&prepped->lengths[i]);
-            vectNd_dot(&prepped->axes[i],&prepped->axes[i],&prepped->AdA[i]);
-            vectNd_dot(&cyl->pos[0],&prepped->axes[i],&prepped->BdA[i]);
+        int dim = cyl->dimensions;
+        int n = dim-2;
+        prepped->n = n;
+        prepped->frame = calloc(n*dim,sizeof(double));
+        prepped->FdP = calloc(n,sizeof(double));
+        prepped->lengths = calloc(n,sizeof(double));
+        for(int i=0; i<n; i++) {
+            /* get unitized axis vectors */
+            double *e = prepped->frame + i*dim;
+            for(int k=0; k<dim; ++k)
+                e[k] = cyl->pos[i+1].v[k] - cyl->pos[0].v[k];
+            double len = 0.0;
+            for(int k=0; k<dim; ++k)
+                len += e[k]*e[k];
+            len = sqrt(len);
+            prepped->lengths[i] = len;
+            for(int k=0; k<dim; ++k) {
+                e[k] /= len;
+                prepped->FdP[i] += e[k]*cyl->pos[0].v[k];
+            }
         }
 
+        /* keep the cross terms only if some pair isn't orthogonal */
+        double *gram = calloc(n*n,sizeof(double));
+        int orthogonal = 1;
+        for(int i=0; i<n; ++i) {
+            for(int j=0; j<n; ++j) {
+                double *ei = prepped->frame + i*dim;
+                double *ej = prepped->frame + j*dim;
+                double dot = 0.0;
+                for(int k=0; k<dim; ++k)
+                    dot += ei[k]*ej[k];
+                gram[i*n+j] = dot;
+                if( i != j && fabs(dot) > EPSILON )
+                    orthogonal = 0;
+            }
+        }
+        if( orthogonal ) {
+            free(gram); gram = NULL;
+        }
+        prepped->gram = gram;
+
         cyl->prepped = prepped;
         cyl->prepared = 1;
     }
@@ -58,14 +85,13 @@ int cleanup(object *cyl) {
         return -1;
 
     prepped_t *prepped = cyl->prepped;
-    int dim = cyl->dimensions;
-    for(int i=0; i<dim-2; i++) {
-        vectNd_free(&prepped->axes[i]);
+    if( prepped ) {
+        free(prepped->frame); prepped->frame = NULL;
+        free(prepped->FdP); prepped->FdP = NULL;
+        free(prepped->lengths); prepped->lengths = NULL;
+        free(prepped->gram); prepped->gram = NULL;
+        free(cyl->prepped); cyl->prepped = NULL;
     }
-    free(prepped->axes); prepped->axes = NULL;
-    free(prepped->lengths); prepped->lengths = NULL;
-    free(prepped->AdA); prepped->AdA = NULL;
-    free(prepped->BdA); prepped->BdA = NULL;
     return 0;
 }
 
@@ -99,146 +125,133 @@ int bounding_points(object *obj, bounds_list *list) {
     return 1;
 }
 
-static forceinline int between_ends(object *cyl, vectNd *point) {
-    int dim;
-    dim  = point->n;
-
+/* check that o+t*v lies between the ends of each axis, given the per ray
+ * offsets (fo) and rates (fv) along each axis */
+static forceinline int between_ends(object *cyl, double *fo, double *fv, double t) {
     /* skip check and return true for infinite cylinders */
     if( cyl->n_flag!=0 && cyl->flag[0] != 0 )
         return 1;
 
-    /* check length of projection onto each axis against axis length */
-    vectNd Bc;
-    vectNd_alloc(&Bc,dim);
-    vectNd_sub(point,&cyl->pos[0],&Bc);
-    double scale;
     prepped_t* prepped = (prepped_t*)cyl->prepped;
-    vectNd *axes = prepped->axes;
-    double *AdAs = prepped->AdA;
-    for(int i=0; i<dim-2; ++i) {
-        vectNd_dot(&Bc,&axes[i],&scale);
-        scale = scale / AdAs[i];
-
-        if( scale < -EPSILON || scale > prepped->lengths[i]+EPSILON ) {
-            vectNd_free(&Bc);
+    int n = prepped->n;
+    double *lengths = prepped->lengths;
+    for(int i=0; i<n; ++i) {
+        double dist = fo[i] + t*fv[i];
+        if( dist < -EPSILON || dist > lengths[i]+EPSILON )
             return 0;
-        }
     }
-    vectNd_free(&Bc);
-    
+
     return 1;   /* didn't violate any constraints */
 }
 
+/* per ray projections onto a set of n rows, relative to pos[0] */
+static forceinline void hcylinder_project(double *rows, double *RdP, int n, int dim, vectNd *o, vectNd *v, double *ro, double *rv) {
+    for(int i=0; i<n; ++i) {
+        double *r = rows + i*dim;
+        double dot_o = 0.0, dot_v = 0.0;
+        for(int k=0; k<dim; ++k) {
+            dot_o += r[k]*o->v[k];
+            dot_v += r[k]*v->v[k];
+        }
+        ro[i] = dot_o - RdP[i];
+        rv[i] = dot_v;
+    }
+}
+
+/* remove the projections onto each of the axes from the quadratic, the
+ * cross terms only matter when the axes aren't orthogonal */
+static forceinline void hcylinder_quadratic(prepped_t *prepped, double *fo, double *fv, double *qa, double *qb, double *qc) {
+    int n = prepped->n;
+    double *gram = prepped->gram;
+
+    if( gram == NULL ) {
+        for(int i=0; i<n; ++i) {
+            *qa -= fv[i]*fv[i];
+            *qb -= fv[i]*fo[i];
+            *qc -= fo[i]*fo[i];
+        }
+        return;
+    }
+
+    for(int i=0; i<n; ++i) {
+        double gv = 0.0, go = 0.0;
+        for(int j=0; j<n; ++j) {
+            gv += gram[i*n+j]*fv[j];
+            go += gram[i*n+j]*fo[j];
+        }
+        *qa += fv[i]*gv - 2*fv[i]*fv[i];
+        *qb += fv[i]*go - 2*fv[i]*fo[i];
+        *qc += fo[i]*go - 2*fo[i]*fo[i];
+    }
+}
+
 int intersect(object *cyl, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr)
 {
     if( !cyl->prepared ) {
         prepare(cyl);
     }
 
-    int ret = 0;
     prepped_t *prepped = (prepped_t*)cyl->prepped;
+    int ret = 0;
     int dim = cyl->dimensions;
-
-    /* allocate all intermediate vectors */
-    vectNd *axes = prepped->axes;
-    vectNd *pos0 = &cyl->pos[0];
+    int n = prepped->n;
+    double *pos0 = cyl->pos[0].v;
     double radius = cyl->size[0];
-    double VdA, AdA;
-    double OdA, BdA;
-    double qa, qb, qc;
-    double det, detRoot;
-    double t1, t2;
-    vectNd P;
-    vectNd Q;
-    vectNd sA;
-    vectNd sum_A;
-    vectNd_alloc(&P,dim);
-    vectNd_alloc(&Q,dim);
-    vectNd_alloc(&sA,dim);
-    vectNd_calloc(&sum_A,dim);
-
-    /* sum over all basis vectors */
-    for(int i=0; i<dim-2; ++i) {
-        AdA = prepped->AdA[i];
-        vectNd_dot(v,&axes[i],&VdA);
-        vectNd_scale(&axes[i],VdA/AdA,&sA);
-        vectNd_add(&sum_A,&sA,&sum_A);
+    double t = -1.0;
+
+    /* projections of the ray onto each of the axes, on the stack since
+     * this runs for every ray */
+    double proj[2*n];
+    double *fo = proj, *fv = proj + n;
+    hcylinder_project(prepped->frame, prepped->FdP, n, dim, o, v, fo, fv);
+
+    /* squared length of (o+t*v-pos[0]) less its projections onto each of
+     * the unit axes is qa*t^2 + qb*t + qc */
+    double qa = 0.0, qb = 0.0, qc = 0.0;
+    for(int k=0; k<dim; ++k) {
+        double w = o->v[k] - pos0[k];
+        qa += v->v[k]*v->v[k];
+        qb += v->v[k]*w;
+        qc += w*w;
     }
-    vectNd_sub(&sum_A,v,&P);
-
-    vectNd_reset(&sum_A);
-    for(int i=0; i<dim-2; ++i) {
-        BdA = prepped->BdA[i];
-        AdA = prepped->AdA[i];
-        vectNd_dot(o,&axes[i],&OdA);
-        vectNd_scale(&axes[i],(OdA-BdA)/AdA,&sA);
-        vectNd_add(&sum_A,&sA,&sum_A);
-    }
-    vectNd_sub(pos0,o,&Q);
-    vectNd_add(&Q,&sum_A,&Q);
-
-    /* solve quadratic */
-    vectNd_dot(&P,&P,&qa);
-    vectNd_dot(&P,&Q,&qb);
+    hcylinder_quadratic(prepped, fo, fv, &qa, &qb, &qc);
     qb *= 2;    /* FOILed again! */
-    vectNd_dot(&Q,&Q,&qc);
     qc -= radius*radius;
 
     /* solve for t */
-    det = qb*qb - 4*qa*qc;
-    if( det < 0.0 ) {
-        vectNd_free(&Q);
-        vectNd_free(&P);
-        vectNd_free(&sum_A);
-        vectNd_free(&sA);
-        return 0;
-    }
-    detRoot = sqrt(det);
-    t1 = (-qb + detRoot) / (2*qa);
-    t2 = (-qb - detRoot) / (2*qa);
-
-    /* pick which (if any) point to return */
-    if( t2>EPSILON ) {
-        vectNd_scale(v,t2,&sA);
-        vectNd_add(o,&sA,res);
-
-        /* do end test */
-        if( between_ends(cyl, res) )
+    double det = qb*qb - 4*qa*qc;
+    if( det >= 0.0 ) {
+        double detRoot = sqrt(det);
+        double t1 = (-qb + detRoot) / (2*qa);
+        double t2 = (-qb - detRoot) / (2*qa);
+
+        /* pick which (if any) point to return */
+        if( t2>EPSILON && between_ends(cyl, fo, fv, t2) ) {
+            t = t2;
             ret = 1;
-    }
-
-    if( ret==0 && t1>EPSILON ) {
-        vectNd_scale(v,t1,&sA);
-        vectNd_add(o,&sA,res);
-
-        /* do end test */
-        if( between_ends(cyl, res) )
+        } else if( t1>EPSILON && between_ends(cyl, fo, fv, t1) ) {
+            t = t1;
             ret = 1;
+        }
     }
 
     /* find normal */
     if( ret != 0 ) {
-        /* get vector from bottom point to intersection point */
-        vectNd_sub(res,pos0,&P);
-
-        /* get sum of P projected onto each of the axes */
-        vectNd_reset(&Q);
-        for(int i=0; i<dim-2; ++i) {
-            vectNd_proj(&P,&axes[i],&sA);
-            vectNd_add(&Q,&sA,&Q);
+        /* vector from nearest axis point to intersection */
+        for(int k=0; k<dim; ++k) {
+            res->v[k] = o->v[k] + t*v->v[k];
+            normal->v[k] = res->v[k] - pos0[k];
+        }
+        for(int i=0; i<n; ++i) {
+            double *e = prepped->frame + i*dim;
+            double along = fo[i] + t*fv[i];
+            for(int k=0; k<dim; ++k)
+                normal->v[k] -= along*e[k];
         }
-
-        /* get vector from nearest axis point to intersection */
-        vectNd_sub(&P,&Q,normal);
 
         if( ptr != NULL )
             *ptr = cyl;
     }
 
-    vectNd_free(&Q);
-    vectNd_free(&P);
-    vectNd_free(&sum_A);
-    vectNd_free(&sA);
-
     return ret;
 }
@@ -11,15 +11,18 @@
 #include "object.h"
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static int ones_set = 0;
-static vectNd ones;
 
 typedef struct prepared_data {
     /* data that is ray invariant and can be pre-computed in prepare function */
-    vectNd edge[3];
-    vectNd unit_edge[3];
-    vectNd edge_perp;
-    double length[3];    /* length of each 'edge' */
+    vectNd unit_edge0;  /* unit vector along edge 0 */
+    vectNd edge_perp;   /* unit vector in the plane, perpendicular to edge 0 */
+    double sum_e;       /* sum of components of unit_edge0 */
+    double sum_p;       /* sum of components of edge_perp */
+    double V0dE;        /* vertex[0] . unit_edge0 */
+    double V0dP;        /* vertex[0] . edge_perp */
+    double sum_v0;      /* sum of components of vertex[0] */
+    double bary[2][3];  /* l = bary[i][0] + bary[i][1]*x + bary[i][2]*y */
+    int degenerate;
 } prepped_t;
 
 int cleanup(object *face) {
@@ -27,15 +30,11 @@ int cleanup(object *face) {
         return -1;
 
     prepped_t *prepped = face->prepped;
-
-    for(int i=0; i<3; ++i) {
-        vectNd_free(&prepped->edge[i]);
-        vectNd_free(&prepped->unit_edge[i]);
+    if( prepped ) {
+        vectNd_free(&prepped->unit_edge0);
+        vectNd_free(&prepped->edge_perp);
+        free(face->prepped); face->prepped = NULL;
     }
-    vectNd_free(&prepped->edge_perp);
-
-    vectNd_free(&ones);
-    ones_set = 0;
 
     return 0;
 }
@@ -47,42 +46,64 @@ static int prepare(object *face) {
 
     int dim = face->dimensions;
 
-    if( ones_set==0 ) {
-        vectNd_alloc(&ones,dim);
-        vectNd_fill(&ones,1.0);
-        ones_set = 1;
-    }
-
     /* fill in any ray invariant parameters */
     if( !face->prepared ) {
         prepped_t *prepped = calloc(1,sizeof(prepped_t));
-        face->prepped = prepped;
 
-        for(int i=0; i<3; i++) {
-            int j = (i+1)%3;
-            vectNd_alloc(&prepped->edge[i],dim);
-            vectNd_sub(&vertex[j],&vertex[i],&prepped->edge[i]);
-            vectNd_l2norm(&prepped->edge[i],&prepped->length[i]);
+        vectNd edge0, edge2;
+        vectNd_alloc(&edge0,dim);
+        vectNd_alloc(&edge2,dim);
+        vectNd_sub(&vertex[1],&vertex[0],&edge0);
+        vectNd_sub(&vertex[2],&vertex[0],&edge2);
 
-            /* make unitized copies of edges */
-            vectNd_alloc(&prepped->unit_edge[i],dim);
-            vectNd_copy(&prepped->unit_edge[i],&prepped->edge[i]);
-            vectNd_unitize(&prepped->unit_edge[i]);
-        }
-        
-        /* reverse edge 2 for use in intersection code */
-        vectNd_scale(&prepped->edge[2],-1.0,&prepped->edge[2]);
-        vectNd_scale(&prepped->unit_edge[2],-1.0,&prepped->unit_edge[2]);
+        vectNd_alloc(&prepped->unit_edge0,dim);
+        vectNd_copy(&prepped->unit_edge0,&edge0);
+        vectNd_unitize(&prepped->unit_edge0);
 
         /* find vector that is perpendicular to edge 0 */
         vectNd e2e0;
         vectNd_alloc(&e2e0,dim);
         vectNd_alloc(&prepped->edge_perp,dim);
-        vectNd_proj(&prepped->edge[2],&prepped->edge[0],&e2e0);
-        vectNd_sub(&prepped->edge[2],&e2e0,&prepped->edge_perp);
+        vectNd_proj(&edge2,&edge0,&e2e0);
+        vectNd_sub(&edge2,&e2e0,&prepped->edge_perp);
         vectNd_free(&e2e0);
         vectNd_unitize(&prepped->edge_perp);
 
+        double *e = prepped->unit_edge0.v;
+        double *p = prepped->edge_perp.v;
+        for(int k=0; k<dim; ++k) {
+            prepped->sum_e += e[k];
+            prepped->sum_p += p[k];
+            prepped->V0dE += vertex[0].v[k]*e[k];
+            prepped->V0dP += vertex[0].v[k]*p[k];
+            prepped->sum_v0 += vertex[0].v[k];
+        }
+
+        /* 2D coordinates of the vertices within the face's plane, with
+         * vertex[0] at the origin */
+        double x2, y2, x3, y3;
+        vectNd_dot(&prepped->unit_edge0,&edge0,&x2);
+        vectNd_dot(&prepped->edge_perp,&edge0,&y2);
+        vectNd_dot(&prepped->unit_edge0,&edge2,&x3);
+        vectNd_dot(&prepped->edge_perp,&edge2,&y3);
+        vectNd_free(&edge0);
+        vectNd_free(&edge2);
+
+        /* see: http://en.wikipedia.org/wiki/Barycentric_coordinate_system */
+        /* the first two barycentric coordinates are affine in (x,y) */
+        double den = (y2-y3)*(-x3) + (x3-x2)*(-y3);
+        if( fabs(den) < EPSILON2 ) {
+            prepped->degenerate = 1;
+            den = 1.0;
+        }
+        prepped->bary[0][1] = (y2-y3) / den;
+        prepped->bary[0][2] = (x3-x2) / den;
+        prepped->bary[0][0] = -(prepped->bary[0][1]*x3 + prepped->bary[0][2]*y3);
+        prepped->bary[1][1] = y3 / den;
+        prepped->bary[1][2] = (-x3) / den;
+        prepped->bary[1][0] = -(prepped->bary[1][1]*x3 + prepped->bary[1][2]*y3);
+
+        face->prepped = prepped;
         face->prepared = 1;
     }
 
@@ -117,97 +138,6 @@ int bounding_points(object *obj, bounds_list *list) {
     return 1;
 }
 
-static int hfacet_point_in_plane(object *obj, vectNd *point, vectNd *on) {
-    vectNd *vertex = obj->pos;
-    vectNd *unit_edge = ((prepped_t*)obj->prepped)->unit_edge; 
-    vectNd *edge_perp = &((prepped_t*)obj->prepped)->edge_perp;
-
-    vectNd D;
-    vectNd U, V;
-    int dim = point->n;
-    vectNd_alloc(&D, dim);
-    vectNd_alloc(&U, dim);
-    vectNd_alloc(&V, dim);
-
-    vectNd_sub(point,&vertex[0],&D);
-    vectNd_proj_unit(&D,&unit_edge[0],&U);
-    vectNd_proj_unit(&D,edge_perp,&V);
-
-    vectNd_add(&U,&V,on);
-    vectNd_add(on,&vertex[0],on);
-
-    vectNd_free(&D);
-    vectNd_free(&U);
-    vectNd_free(&V);
-    
-    return 0;
-}
-
-/* see: http://en.wikipedia.org/wiki/Barycentric_coordinate_system */
-static inline int get_barycentric(object *face, vectNd *point, double *coords) {
-    vectNd *A;
-    vectNd *B;
-    vectNd C;
-    double xp, yp;
-    double x1=0, y1=0;
-    double x2, y2;
-    double x3, y3;
-
-    prepped_t *prepped = ((prepped_t*)face->prepped);
-    vectNd *vertex = face->pos;
-
-    vectNd_alloc(&C,point->n);
-
-    /* convert point to 2D coordinates within face's plane */
-    A = &prepped->unit_edge[0];
-    B = &prepped->edge_perp;
-    vectNd_sub(point,&vertex[0],&C);
-
-    vectNd_dot(A,&C,&xp);
-    vectNd_dot(B,&C,&yp);
-
-    /* this needs non-unitized edges */
-    vectNd_dot(A,&prepped->edge[0],&x2);
-    vectNd_dot(B,&prepped->edge[0],&y2);
-
-    /* this needs non-unitized edges */
-    vectNd_dot(A,&prepped->edge[2],&x3);
-    vectNd_dot(B,&prepped->edge[2],&y3);
-
-    vectNd_free(&C);
-
-    double l1, l2, l3;
-    l1 = ((y2-y3)*(xp-x3) + (x3-x2)*(yp-y3)) /
-         ((y2-y3)*(x1-x3) + (x3-x2)*(y1-y3));
-    l2 = ((y3-y1)*(xp-x3) + (x1-x3)*(yp-y3)) /
-         ((y2-y3)*(x1-x3) + (x3-x2)*(y1-y3));
-    l3 = 1 - l1 - l2;
-
-    coords[0] = l1;
-    coords[1] = l2;
-    coords[2] = l3;
-
-    return 0;
-}
-
-static inline int inside_facet(object *face, vectNd *point, double *bary) {
-    double lambda[3];
-
-    if( bary==NULL )
-        bary = lambda;
-
-    /* use barycentric coordinates to determine boundraries.
-     * Slow but effective */
-    get_barycentric(face,point,bary);
-
-    for(int i=0; i<3; ++i) {
-        if( bary[i] < -EPSILON || bary[i] > 1+EPSILON )
-            return 0;
-    }
-
-    return 1;   /* didn't violate any constraints */
-}
-
 int intersect(object *face, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr)
 {
     if( !face->prepared ) {
@@ -215,96 +145,75 @@ int intersect(object *face, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, o
     }
 
     prepped_t *prepped = ((prepped_t*)face->prepped);
-    vectNd *vertex = face->pos;
-    vectNd *edge_perp = &prepped->edge_perp;
-    vectNd *unit_edge0 = &prepped->unit_edge[0];
-    int ret = 0;
+    if( prepped->degenerate )
+        return 0;
+
     int dim = face->dimensions;
-    double Qv, Rv;
-    vectNd R;
-    vectNd vE0;
-    vectNd vE2;
-    vectNd Q;
-    vectNd oP0;
-
-    /* additional setup */
-    vectNd_alloc(&R,dim);
-    vectNd_alloc(&vE0,dim);
-    vectNd_alloc(&vE2,dim);
-    vectNd_alloc(&Q,dim);
-    vectNd_alloc(&oP0,dim);
-
-    /* compute dependant terms */
-    vectNd_proj_unit(v,unit_edge0,&vE0);
-    vectNd_proj_unit(v,edge_perp,&vE2);
-    vectNd_add(&vE0,&vE2,&R);
-    vectNd_sub(&R,v,&R);
-    vectNd_dot(&R,&ones,&Rv);
+    double *e = prepped->unit_edge0.v;
+    double *p = prepped->edge_perp.v;
+
+    /* project o and v onto the face's plane in a single pass */
+    double OdE = 0.0, OdP = 0.0, sum_o = 0.0;
+    double VdE = 0.0, VdP = 0.0, sum_v = 0.0;
+    for(int k=0; k<dim; ++k) {
+        OdE += o->v[k]*e[k];
+        OdP += o->v[k]*p[k];
+        sum_o += o->v[k];
+        VdE += v->v[k]*e[k];
+        VdP += v->v[k]*p[k];
+        sum_v += v->v[k];
+    }
+    double x0 = OdE - prepped->V0dE;    /* (o - vertex[0]) in plane coords */
+    double y0 = OdP - prepped->V0dP;
+
+    /* the parts of v and o-vertex[0] that leave the plane, summed over all
+     * components, must cancel at the hit */
+    double Rv = (VdE*prepped->sum_e + VdP*prepped->sum_p) - sum_v;
+    double Qv = (x0*prepped->sum_e + y0*prepped->sum_p) - (sum_o - prepped->sum_v0);
 
     /* give up if divisor is too small (i.e. place is parallel to v) */
-    if( fabs(Rv) < EPSILON ) {
-        vectNd_free(&R);
-        vectNd_free(&Q);
-        vectNd_free(&oP0);
-        vectNd_free(&vE0);
-        vectNd_free(&vE2);
+    if( fabs(Rv) < EPSILON )
         return 0;
-    }
-
-    /* compute constant terms */
-    vectNd_sub(o,&vertex[0],&oP0);
-    vectNd_proj_unit(&oP0,unit_edge0,&vE0);
-    vectNd_proj_unit(&oP0,edge_perp,&vE2);
-    vectNd_add(&vE0,&vE2,&Q);
-    vectNd_sub(&Q,&oP0,&Q);
-    vectNd_dot(&Q,&ones,&Qv);
 
     /* solve for t */
-    double t = -1;
-    t = -Qv / Rv;
+    double t = -Qv / Rv;
+    if( t <= EPSILON )
+        return 0;
 
-    /* pick which (if any) point to return */
+    /* do edges test on barycentric coordinates of the hit */
+    double x = x0 + t*VdE;
+    double y = y0 + t*VdP;
     double lambda[3]; /* barycentric coordiantes */
-    if( t>EPSILON ) {
-        vectNd_scale(v,t,res);
-        vectNd_add(o,res,res);
-
-        /* do edges test */
-        if( inside_facet(face, res, lambda) ) {
-            ret = 1;
-        }
+    lambda[0] = prepped->bary[0][0] + prepped->bary[0][1]*x + prepped->bary[0][2]*y;
+    lambda[1] = prepped->bary[1][0] + prepped->bary[1][1]*x + prepped->bary[1][2]*y;
+    lambda[2] = 1 - lambda[0] - lambda[1];
+    for(int i=0; i<3; ++i) {
+        if( lambda[i] < -EPSILON || lambda[i] > 1+EPSILON )
+            return 0;
     }
 
-    /* find normal */
-    if( ret != 0 ) {
-        int use_normals = face->flag[0];
-        if( use_normals ) {
-            /* use weighted average of normal vectors */
-            vectNd *normals = face->dir;
-
-            vectNd_reset(normal);
-            for(int i=0; i<3; ++i) {
-                vectNd_scale(&normals[i],lambda[i],&R);
-                vectNd_add(normal,&R,normal);
-            }
-        } else {
-            hfacet_point_in_plane(face,o,&R);
-
-            /* normal is the direction of shortest distance from plane to
-             * observer point */
-            vectNd_sub(o,&R,normal);
-            vectNd_unitize(normal);
-        }
+    for(int k=0; k<dim; ++k)
+        res->v[k] = o->v[k] + t*v->v[k];
 
-        if( ptr != NULL )
-            *ptr = face;
+    /* find normal */
+    int use_normals = face->flag[0];
+    if( use_normals ) {
+        /* use weighted average of normal vectors */
+        vectNd *normals = face->dir;
+        for(int k=0; k<dim; ++k)
+            normal->v[k] = lambda[0]*normals[0].v[k]
+                         + lambda[1]*normals[1].v[k]
+                         + lambda[2]*normals[2].v[k];
+    } else {
+        /* normal is the direction of shortest distance from plane to
+         * observer point */
+        for(int k=0; k<dim; ++k)
+            normal->v[k] = o->v[k] - face->pos[0].v[k] - x0*e[k] - y0*p[k];
+        vectNd_unitize(normal);
     }
 
-    vectNd_free(&R);
-    vectNd_free(&Q);
-    vectNd_free(&oP0);
-    vectNd_free(&vE0);
-    vectNd_free(&vE2);
+    if( ptr != NULL )
+        *ptr = face;
 
-    return ret;
+    return 1;
 }
@@ -42,15 +42,14 @@ int intersect(object *obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, ob
     double d=-1;
     double pln=0; /* (p_0-l_0) . n */
     double ln=-1;  /* l . n */
-    vectNd pl;  /* p_0 - l_0 */
+    vectNd *pl = res;  /* p_0 - l_0, res is free until the end */
     vectNd *point = &obj->pos[0];
 
-    vectNd_alloc(&pl,v->n);
     vectNd_copy(normal, &obj->dir[0]);
 
     /* compute d */
-    vectNd_sub(point,o,&pl);
-    vectNd_dot(&pl,normal,&pln);
+    vectNd_sub(point,o,pl);
+    vectNd_dot(pl,normal,&pln);
     vectNd_dot(v,normal,&ln);
 
     if( ln > EPSILON || ln < -EPSILON )
@@ -58,13 +57,10 @@ int intersect(object *obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, ob
 
     /* find intersection */
     if( d >= EPSILON ) {
-        vectNd_copy(res,o);
-        vectNd_scale(v,d,&pl);
-        vectNd_add(res,&pl,res);
+        vectNd_scale(v,d,pl);
+        vectNd_add(o,pl,res);
     }
 
-    vectNd_free(&pl);
-
     if( d < EPSILON )
         return 0;
 
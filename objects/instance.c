@@ -0,0 +1,295 @@
+/*
+ * instance.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2019-2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "object.h"
+#include "../matrix.h"
+
+/*
+ * A shared prototype object placed by an affine transform.
+ *
+ * obj[0]: prototype, attach with object_add_obj(inst, object_share(proto)).
+ * pos[0]: translation, i.e. where the prototype's origin ends up.
+ * dir[i]: image of the i-th axis, i.e. column i of the linear part.
+ * flag[0]: 1 to shade with the instance's material, 0 for the prototype's.
+ *
+ * object_move and object_rotate update pos and dir without touching the
+ * prototype, so moving an instance is independent of the prototype's size.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct prepared_data {
+    /* data that is ray invariant and can be pre-computed in prepare function */
+    double *inverse;    /* row major inverse of the linear part */
+    int singular;
+} prepped_t;
+
+/* ray in prototype space, one set per level of instance nesting */
+typedef struct instance_level {
+    vectNd o, v, res, normal;
+} instance_level_t;
+
+/* this thread's levels, kept between calls so intersect doesn't allocate */
+typedef struct instance_scratch {
+    int dim;
+    int depth;
+    int num_levels;
+    instance_level_t **levels;
+} instance_scratch_t;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *arg) {
+    instance_scratch_t *scratch = arg;
+    if( scratch == NULL )
+        return;
+
+    for(int i=0; i<scratch->num_levels; ++i) {
+        instance_level_t *level = scratch->levels[i];
+        vectNd_free(&level->o);
+        vectNd_free(&level->v);
+        vectNd_free(&level->res);
+        vectNd_free(&level->normal);
+        free(level);
+    }
+    free(scratch->levels);
+    free(scratch);
+}
+
+static void scratch_key_init(void) {
+    pthread_key_create(&scratch_key, scratch_free);
+}
+
+/* next free level of this thread's scratch, NULL if it can't be had */
+static instance_level_t *scratch_push(int dim) {
+    pthread_once(&scratch_once, scratch_key_init);
+    instance_scratch_t *scratch = pthread_getspecific(scratch_key);
+
+    /* levels only change dimension when nothing is using them */
+    if( scratch != NULL && scratch->dim != dim && scratch->depth == 0 ) {
+        scratch_free(scratch);
+        scratch = NULL;
+    }
+    if( scratch == NULL ) {
+        scratch = calloc(1, sizeof(instance_scratch_t));
+        if( scratch == NULL )
+            return NULL;
+        scratch->dim = dim;
+        pthread_setspecific(scratch_key, scratch);
+    }
+
+    /* levels are allocated one at a time, so the vectNds of those in use
+     * never move */
+    if( scratch->depth == scratch->num_levels ) {
+        instance_level_t **levels = realloc(scratch->levels,
+                        (scratch->num_levels+1)*sizeof(instance_level_t*));
+        if( levels == NULL )
+            return NULL;
+        scratch->levels = levels;
+        instance_level_t *level = calloc(1, sizeof(instance_level_t));
+        if( level == NULL )
+            return NULL;
+        vectNd_alloc(&level->o, dim);
+        vectNd_alloc(&level->v, dim);
+        vectNd_alloc(&level->res, dim);
+        vectNd_alloc(&level->normal, dim);
+        scratch->levels[scratch->num_levels++] = level;
+    }
+
+    return scratch->levels[scratch->depth++];
+}
+
+static void scratch_pop(void) {
+    instance_scratch_t *scratch = pthread_getspecific(scratch_key);
+    scratch->depth -= 1;
+}
+
+int cleanup(object *obj) {
+    if( obj->prepared == 0 )
+        return -1;
+
+    prepped_t *prepped = obj->prepped;
+    if( prepped ) {
+        free(prepped->inverse); prepped->inverse = NULL;
+        free(obj->prepped); obj->prepped = NULL;
+    }
+
+    return 0;
+}
+
+static int prepare(object *obj) {
+    pthread_mutex_lock(&lock);
+
+    /* fill in any ray invariant parameters */
+    if( !obj->prepared ) {
+        prepped_t *prepped = calloc(1,sizeof(prepped_t));
+        int dim = obj->dimensions;
+
+        matrix_t A, Ainv;
+        matrix_init(&A, dim, dim);
+        for(int i=0; i<dim; ++i)
+            for(int j=0; j<dim; ++j)
+                matrix_set_value(&A, i, j, obj->dir[j].v[i]);
+
+        prepped->inverse = calloc(dim*dim, sizeof(double));
+        if( fabs(matrix_det(&A)) < EPSILON2 ) {
+            fprintf(stderr, "%s: instance '%s' has a singular transform.\n", __FUNCTION__, obj->name);
+            prepped->singular = 1;
+        } else {
+            matrix_invert(&Ainv, &A);
+            for(int i=0; i<dim; ++i)
+                for(int j=0; j<dim; ++j)
+                    prepped->inverse[i*dim+j] = matrix_get_value(&Ainv, i, j);
+            matrix_free(&Ainv);
+        }
+        matrix_free(&A);
+
+        obj->prepped = prepped;
+        obj->prepared = 1;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return 1;
+}
+
+int type_name(char *name, int size) {
+    strncpy(name,"instance",size);
+    return 0;
+}
+
+int params(object *obj, int *n_pos, int *n_dir, int *n_size, int *n_flags, int *n_obj) {
+    if( obj==NULL )
+        return -1;
+
+    *n_pos = 1;
+    *n_dir = obj->dimensions;
+    *n_size = 0;
+    *n_flags = 1;
+    *n_obj = 1;
+
+    return 0;
+}
+
+/* world = A * local + T */
+static inline void instance_to_world(object *obj, vectNd *local, vectNd *world) {
+    int dim = obj->dimensions;
+    for(int i=0; i<dim; ++i) {
+        double sum = obj->pos[0].v[i];
+        for(int j=0; j<dim; ++j)
+            sum += obj->dir[j].v[i] * local->v[j];
+        world->v[i] = sum;
+    }
+}
+
+int bounding_points(object *obj, bounds_list *list) {
+    if( obj==NULL || list==NULL )
+        return -1;
+
+    /* without a prototype there is nothing to bound */
+    if( obj->n_obj < 1 )
+        return 0;
+
+    object *proto = obj->obj[0];
+    bounds_list points;
+    bounds_list_init(&points);
+    proto->bounding_points(proto, &points);
+    if( points.head == NULL ) {
+        /* infinite prototype, so the instance is too */
+        bounds_list_free(&points);
+        return 0;
+    }
+
+    /* the linear part stretches a sphere by at most its largest singular
+     * value, bound that using Gershgorin discs of A^T A */
+    int dim = obj->dimensions;
+    double stretch = 0.0;
+    for(int i=0; i<dim; ++i) {
+        double row = 0.0;
+        for(int j=0; j<dim; ++j) {
+            double ata = 0.0;
+            vectNd_dot(&obj->dir[i], &obj->dir[j], &ata);
+            row += fabs(ata);
+        }
+        if( row > stretch )
+            stretch = row;
+    }
+    stretch = sqrt(stretch);
+
+    vectNd world;
+    vectNd_alloc(&world, dim);
+    for(bounds_node *curr = points.head; curr!=NULL; curr = curr->next) {
+        instance_to_world(obj, &curr->bounds.center, &world);
+        bounds_list_add(list, &world, fabs(curr->bounds.radius)*stretch);
+    }
+    vectNd_free(&world);
+    bounds_list_free(&points);
+
+    return 1;
+}
+
+int intersect(object *obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr)
+{
+    if( !obj->prepared ) {
+        prepare(obj);
+    }
+
+    prepped_t *prepped = obj->prepped;
+    if( prepped->singular || obj->n_obj < 1 )
+        return 0;
+
+    int dim = obj->dimensions;
+    double *inv = prepped->inverse;
+    instance_level_t *level = scratch_push(dim);
+    if( level == NULL ) {
+        fprintf(stderr, "%s: unable to allocate scratch space.\n", __FUNCTION__);
+        return 0;
+    }
+    vectNd *lo = &level->o, *lv = &level->v;
+    vectNd *lres = &level->res, *lnormal = &level->normal;
+
+    /* move ray into prototype space */
+    for(int i=0; i<dim; ++i) {
+        double so = 0.0, sv = 0.0;
+        for(int j=0; j<dim; ++j) {
+            so += inv[i*dim+j] * (o->v[j] - obj->pos[0].v[j]);
+            sv += inv[i*dim+j] * v->v[j];
+        }
+        lo->v[i] = so;
+        lv->v[i] = sv;
+    }
+    vectNd_unitize(lv);
+
+    /* the instance's own bounds were already checked, so go straight to
+     * the prototype */
+    object *proto = obj->obj[0];
+    object *hit_ptr = NULL;
+    int ret = proto->intersect(proto, lo, lv, lres, lnormal, &hit_ptr);
+    if( ret > 0 ) {
+        instance_to_world(obj, lres, res);
+
+        /* normals transform by the inverse transpose */
+        for(int i=0; i<dim; ++i) {
+            double sum = 0.0;
+            for(int j=0; j<dim; ++j)
+                sum += inv[j*dim+i] * lnormal->v[j];
+            normal->v[i] = sum;
+        }
+        vectNd_unitize(normal);
+
+        if( ptr != NULL )
+            *ptr = (obj->flag[0] || hit_ptr==NULL) ? obj : hit_ptr;
+    }
+
+    scratch_pop();
+
+    return ret;
+}
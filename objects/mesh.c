@@ -0,0 +1,523 @@
+/*
+ * mesh.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2019-2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "object.h"
+
+/*
+ * An indexed mesh of (n-1)-simplices (triangles in 3d, tetrahedra in 4d, ...).
+ *
+ * pos:  shared vertex buffer.
+ * dir:  optional per-vertex normals, used when flag[0] is non-zero.
+ * flag: flag[0] selects vertex normals, the remaining flags are the index
+ *       buffer, one group of 'dimensions' vertex indices per simplex.
+ *
+ * All simplices share a single object struct, and are searched with a
+ * bounding volume hierarchy built during prepare.
+ */
+
+#define MESH_LEAF_SIZE 4
+#define MESH_STACK_SIZE 128
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct mesh_node {
+    int start;  /* first child (inner node) or first face (leaf) */
+    int count;  /* number of faces in a leaf, 0 for inner nodes */
+} mesh_node_t;
+
+typedef struct prepared_data {
+    /* data that is ray invariant and can be pre-computed in prepare function */
+    int num_faces;      /* number of non-degenerate simplices */
+    int *face_ids;      /* simplex index (into index buffer) in leaf order */
+    double *frame;      /* per face: unit normal, then dim-1 dual edge vectors */
+    double *offset;     /* per face: each frame vector dotted with vertex 0 */
+    mesh_node_t *nodes;
+    double *bounds;     /* per node: lower corner followed by upper corner */
+    int num_nodes;
+} prepped_t;
+
+static inline double mesh_dot(double *a, double *b, int dim) {
+    double sum = 0.0;
+    for(int i=0; i<dim; ++i)
+        sum += a[i]*b[i];
+    return sum;
+}
+
+/* invert the symmetric matrix g (n x n) into ginv, returns 0 if singular */
+static int mesh_invert(double *g, double *ginv, int n) {
+    for(int i=0; i<n; ++i)
+        for(int j=0; j<n; ++j)
+            ginv[i*n+j] = (i==j) ? 1.0 : 0.0;
+
+    /* Gauss-Jordan elimination with partial pivoting */
+    for(int c=0; c<n; ++c) {
+        int pivot = c;
+        for(int r=c+1; r<n; ++r)
+            if( fabs(g[r*n+c]) > fabs(g[pivot*n+c]) )
+                pivot = r;
+        if( fabs(g[pivot*n+c]) < EPSILON2*EPSILON2 )
+            return 0;
+        if( pivot != c ) {
+            for(int j=0; j<n; ++j) {
+                double t = g[c*n+j]; g[c*n+j] = g[pivot*n+j]; g[pivot*n+j] = t;
+                t = ginv[c*n+j]; ginv[c*n+j] = ginv[pivot*n+j]; ginv[pivot*n+j] = t;
+            }
+        }
+        double scale = 1.0 / g[c*n+c];
+        for(int j=0; j<n; ++j) {
+            g[c*n+j] *= scale;
+            ginv[c*n+j] *= scale;
+        }
+        for(int r=0; r<n; ++r) {
+            if( r==c )
+                continue;
+            double f = g[r*n+c];
+            if( f == 0.0 )
+                continue;
+            for(int j=0; j<n; ++j) {
+                g[r*n+j] -= f*g[c*n+j];
+                ginv[r*n+j] -= f*ginv[c*n+j];
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* compute the normal and dual edge vectors of a simplex.
+ * dual vector i satisfies dual_i . edge_j == (i==j), and is perpendicular to
+ * the normal, so barycentric coordinates are just dot products. */
+static int mesh_face_frame(object *obj, int *idx, double *frame, double *offset, double *scratch) {
+    int dim = obj->dimensions;
+    int m = dim-1;
+    double *edges = scratch;            /* m x dim */
+    double *gram = edges + m*dim;       /* m x m */
+    double *ginv = gram + m*m;          /* m x m */
+    double *p0 = obj->pos[idx[0]].v;
+
+    for(int i=0; i<m; ++i) {
+        double *p = obj->pos[idx[i+1]].v;
+        for(int k=0; k<dim; ++k)
+            edges[i*dim+k] = p[k] - p0[k];
+    }
+    for(int i=0; i<m; ++i)
+        for(int j=0; j<m; ++j)
+            gram[i*m+j] = mesh_dot(&edges[i*dim], &edges[j*dim], dim);
+
+    if( !mesh_invert(gram, ginv, m) )
+        return 0;
+
+    double *dual = frame + dim;
+    for(int i=0; i<m; ++i) {
+        for(int k=0; k<dim; ++k) {
+            double sum = 0.0;
+            for(int j=0; j<m; ++j)
+                sum += ginv[i*m+j]*edges[j*dim+k];
+            dual[i*dim+k] = sum;
+        }
+    }
+
+    /* normal is the largest residual of an axis after removing the face's
+     * span from it */
+    double *normal = frame;
+    double best = -1.0;
+    for(int a=0; a<dim; ++a) {
+        double *r = ginv + m*m;
+        for(int k=0; k<dim; ++k)
+            r[k] = (k==a) ? 1.0 : 0.0;
+        for(int i=0; i<m; ++i) {
+            double c = dual[i*dim+a];
+            for(int k=0; k<dim; ++k)
+                r[k] -= c*edges[i*dim+k];
+        }
+        double len = sqrt(mesh_dot(r, r, dim));
+        if( len > best ) {
+            best = len;
+            for(int k=0; k<dim; ++k)
+                normal[k] = r[k] / len;
+        }
+    }
+
+    for(int i=0; i<dim; ++i)
+        offset[i] = mesh_dot(&frame[i*dim], p0, dim);
+
+    return 1;
+}
+
+/* reorder face ids in [start,end) so the median centroid along axis is at mid */
+static void mesh_select(int *ids, double *centroid, int dim, int axis, int start, int end, int mid) {
+    while( end - start > 1 ) {
+        double pivot = centroid[ids[(start+end)/2]*dim+axis];
+        int i = start, j = end-1;
+        while( i <= j ) {
+            while( centroid[ids[i]*dim+axis] < pivot ) ++i;
+            while( centroid[ids[j]*dim+axis] > pivot ) --j;
+            if( i <= j ) {
+                int t = ids[i]; ids[i] = ids[j]; ids[j] = t;
+                ++i; --j;
+            }
+        }
+        if( mid <= j )
+            end = j+1;
+        else if( mid >= i )
+            start = i;
+        else
+            return;
+    }
+}
+
+static int mesh_build_node(prepped_t *prepped, int node, int *ids, double *centroid, double *box, int dim, int start, int end) {
+    double *lo = &prepped->bounds[node*2*dim];
+    double *hi = lo + dim;
+
+    for(int k=0; k<dim; ++k) {
+        lo[k] = INFINITY;
+        hi[k] = -INFINITY;
+    }
+    for(int i=start; i<end; ++i) {
+        double *flo = &box[ids[i]*2*dim];
+        double *fhi = flo + dim;
+        for(int k=0; k<dim; ++k) {
+            if( flo[k] < lo[k] ) lo[k] = flo[k];
+            if( fhi[k] > hi[k] ) hi[k] = fhi[k];
+        }
+    }
+
+    if( end - start <= MESH_LEAF_SIZE ) {
+        prepped->nodes[node].start = start;
+        prepped->nodes[node].count = end - start;
+        return 1;
+    }
+
+    /* split at the median centroid along the widest axis of the centroids */
+    int axis = 0;
+    double widest = -1.0;
+    for(int k=0; k<dim; ++k) {
+        double cmin = INFINITY, cmax = -INFINITY;
+        for(int i=start; i<end; ++i) {
+            double c = centroid[ids[i]*dim+k];
+            if( c < cmin ) cmin = c;
+            if( c > cmax ) cmax = c;
+        }
+        if( cmax - cmin > widest ) {
+            widest = cmax - cmin;
+            axis = k;
+        }
+    }
+
+    int mid = (start + end) / 2;
+    mesh_select(ids, centroid, dim, axis, start, end, mid);
+
+    int left = prepped->num_nodes;
+    prepped->num_nodes += 2;
+    prepped->nodes[node].start = left;
+    prepped->nodes[node].count = 0;
+
+    mesh_build_node(prepped, left, ids, centroid, box, dim, start, mid);
+    mesh_build_node(prepped, left+1, ids, centroid, box, dim, mid, end);
+
+    return 1;
+}
+
+int cleanup(object *obj) {
+    if( obj->prepared == 0 )
+        return -1;
+
+    prepped_t *prepped = obj->prepped;
+    if( prepped ) {
+        free(prepped->face_ids); prepped->face_ids = NULL;
+        free(prepped->frame); prepped->frame = NULL;
+        free(prepped->offset); prepped->offset = NULL;
+        free(prepped->nodes); prepped->nodes = NULL;
+        free(prepped->bounds); prepped->bounds = NULL;
+        free(obj->prepped); obj->prepped = NULL;
+    }
+
+    return 0;
+}
+
+static int prepare(object *obj) {
+    pthread_mutex_lock(&lock);
+
+    /* fill in any ray invariant parameters */
+    if( !obj->prepared ) {
+        prepped_t *prepped = calloc(1,sizeof(prepped_t));
+        int dim = obj->dimensions;
+        int total = (obj->n_flag - 1) / dim;
+
+        /* indices may come from a scene file, so check them like
+         * object_load_mesh does, and draw nothing if any are bad */
+        for(int i=1; i<1+total*dim; ++i) {
+            if( obj->flag[i] < 0 || obj->flag[i] >= obj->n_pos ) {
+                fprintf(stderr, "%s: mesh '%s' has invalid index %i at %i (%i vertices).\n",
+                        __FUNCTION__, obj->name, obj->flag[i], i, obj->n_pos);
+                total = 0;
+                break;
+            }
+        }
+
+        /* per-face frames, degenerate simplices are dropped */
+        double *frame = calloc((size_t)total*dim*dim, sizeof(double));
+        double *offset = calloc((size_t)total*dim, sizeof(double));
+        double *centroid = calloc((size_t)total*dim, sizeof(double));
+        double *box = calloc((size_t)total*2*dim, sizeof(double));
+        double *scratch = calloc(3*dim*dim, sizeof(double));
+        int *src = calloc(total, sizeof(int));
+        int num = 0;
+        for(int f=0; f<total; ++f) {
+            int *idx = &obj->flag[1+f*dim];
+            if( !mesh_face_frame(obj, idx, &frame[num*dim*dim], &offset[num*dim], scratch) )
+                continue;
+
+            double *c = &centroid[num*dim];
+            double *lo = &box[num*2*dim];
+            double *hi = lo + dim;
+            for(int k=0; k<dim; ++k) {
+                lo[k] = INFINITY;
+                hi[k] = -INFINITY;
+                c[k] = 0.0;
+            }
+            for(int i=0; i<dim; ++i) {
+                double *p = obj->pos[idx[i]].v;
+                for(int k=0; k<dim; ++k) {
+                    c[k] += p[k] / dim;
+                    if( p[k] < lo[k] ) lo[k] = p[k];
+                    if( p[k] > hi[k] ) hi[k] = p[k];
+                }
+            }
+            src[num++] = f;
+        }
+        free(scratch); scratch = NULL;
+
+        /* build hierarchy over face slots, then store faces in leaf order */
+        int *order = calloc(num>0?num:1, sizeof(int));
+        for(int i=0; i<num; ++i)
+            order[i] = i;
+        prepped->nodes = calloc(num>0?2*num:1, sizeof(mesh_node_t));
+        prepped->bounds = calloc((num>0?2*num:1)*2*dim, sizeof(double));
+        prepped->num_faces = num;
+        if( num > 0 ) {
+            prepped->num_nodes = 1;
+            mesh_build_node(prepped, 0, order, centroid, box, dim, 0, num);
+        }
+
+        prepped->face_ids = calloc(num>0?num:1, sizeof(int));
+        prepped->frame = calloc((size_t)(num>0?num:1)*dim*dim, sizeof(double));
+        prepped->offset = calloc((size_t)(num>0?num:1)*dim, sizeof(double));
+        for(int i=0; i<num; ++i) {
+            int j = order[i];
+            prepped->face_ids[i] = src[j];
+            memcpy(&prepped->frame[i*dim*dim], &frame[j*dim*dim], dim*dim*sizeof(double));
+            memcpy(&prepped->offset[i*dim], &offset[j*dim], dim*sizeof(double));
+        }
+
+        free(order); order = NULL;
+        free(src); src = NULL;
+        free(box); box = NULL;
+        free(centroid); centroid = NULL;
+        free(offset); offset = NULL;
+        free(frame); frame = NULL;
+
+        obj->prepped = prepped;
+        obj->prepared = 1;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return 1;
+}
+
+int type_name(char *name, int size) {
+    strncpy(name,"mesh",size);
+    return 0;
+}
+
+int params(object *obj, int *n_pos, int *n_dir, int *n_size, int *n_flags, int *n_obj) {
+    if( obj==NULL )
+        return -1;
+
+    /* at least a single simplex is required */
+    *n_pos = obj->dimensions;
+    *n_dir = 0;     /* n_pos are needed when flag[0]==1 */
+    *n_size = 0;
+    *n_flags = 1 + obj->dimensions;
+    *n_obj = 0;
+
+    return 0;
+}
+
+int bounding_points(object *obj, bounds_list *list) {
+    if( obj==NULL || list==NULL )
+        return -1;
+
+    if( obj->n_pos <= 0 )
+        return 0;
+
+    /* opposite corners of the axis aligned box around all vertices */
+    int dim = obj->dimensions;
+    vectNd lo, hi;
+    vectNd_alloc(&lo, dim);
+    vectNd_alloc(&hi, dim);
+    vectNd_copy(&lo, &obj->pos[0]);
+    vectNd_copy(&hi, &obj->pos[0]);
+    for(int i=1; i<obj->n_pos; ++i) {
+        double *p = obj->pos[i].v;
+        for(int k=0; k<dim; ++k) {
+            if( p[k] < lo.v[k] ) lo.v[k] = p[k];
+            if( p[k] > hi.v[k] ) hi.v[k] = p[k];
+        }
+    }
+    bounds_list_add(list, &lo, 0.0);
+    bounds_list_add(list, &hi, 0.0);
+    vectNd_free(&lo);
+    vectNd_free(&hi);
+
+    return 1;
+}
+
+/* slab test against node's box, returns entry distance or -1 on a miss */
+static inline double mesh_node_hit(double *bounds, double *o, double *inv, int dim, double t_max) {
+    double *lo = bounds;
+    double *hi = bounds + dim;
+    double t0 = 0.0, t1 = t_max;
+
+    for(int k=0; k<dim; ++k) {
+        double a = (lo[k] - o[k]) * inv[k];
+        double b = (hi[k] - o[k]) * inv[k];
+        if( a > b ) {
+            double t = a; a = b; b = t;
+        }
+        if( a > t0 ) t0 = a;
+        if( b < t1 ) t1 = b;
+        if( t0 > t1 )
+            return -1.0;
+    }
+
+    return t0;
+}
+
+int intersect(object *obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr)
+{
+    if( !obj->prepared ) {
+        prepare(obj);
+    }
+
+    prepped_t *prepped = obj->prepped;
+    if( prepped->num_faces == 0 )
+        return 0;
+
+    int dim = obj->dimensions;
+    double *ov = o->v;
+    double *vv = v->v;
+    /* reciprocal direction for the slab tests, on the stack since this
+     * runs for every ray */
+    double inv[dim];
+    for(int k=0; k<dim; ++k)
+        inv[k] = 1.0 / vv[k];
+
+    double best_t = INFINITY;
+    double best_sum = 0.0;
+    int best = -1;
+
+    int stack[MESH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while( top > 0 ) {
+        int n = stack[--top];
+        mesh_node_t *node = &prepped->nodes[n];
+        if( mesh_node_hit(&prepped->bounds[n*2*dim], ov, inv, dim, best_t) < 0.0 )
+            continue;
+
+        if( node->count == 0 ) {
+            /* visit nearer child first */
+            int l = node->start, r = node->start+1;
+            double tl = mesh_node_hit(&prepped->bounds[l*2*dim], ov, inv, dim, best_t);
+            double tr = mesh_node_hit(&prepped->bounds[r*2*dim], ov, inv, dim, best_t);
+            if( tl >= 0.0 && tr >= 0.0 && top+2 <= MESH_STACK_SIZE ) {
+                if( tl < tr ) {
+                    stack[top++] = r;
+                    stack[top++] = l;
+                } else {
+                    stack[top++] = l;
+                    stack[top++] = r;
+                }
+            } else if( tl >= 0.0 && top < MESH_STACK_SIZE ) {
+                stack[top++] = l;
+            } else if( tr >= 0.0 && top < MESH_STACK_SIZE ) {
+                stack[top++] = r;
+            }
+            continue;
+        }
+
+        for(int f=node->start; f<node->start+node->count; ++f) {
+            double *frame = &prepped->frame[f*dim*dim];
+            double *offset = &prepped->offset[f*dim];
+
+            double nv = mesh_dot(frame, vv, dim);
+            if( fabs(nv) < EPSILON2 )
+                continue;
+            double t = (offset[0] - mesh_dot(frame, ov, dim)) / nv;
+            if( t <= EPSILON || t >= best_t )
+                continue;
+
+            /* barycentric coordinates of o+t*v */
+            double sum = 0.0;
+            int inside = 1;
+            for(int i=1; i<dim; ++i) {
+                double *dual = &frame[i*dim];
+                double b = mesh_dot(dual, ov, dim) + t*mesh_dot(dual, vv, dim) - offset[i];
+                if( b < -EPSILON ) {
+                    inside = 0;
+                    break;
+                }
+                sum += b;
+            }
+            if( !inside || sum > 1.0+EPSILON )
+                continue;
+
+            best_t = t;
+            best_sum = sum;
+            best = f;
+        }
+    }
+
+    if( best < 0 )
+        return 0;
+
+    vectNd_scale(v, best_t, res);
+    vectNd_add(o, res, res);
+
+    double *frame = &prepped->frame[best*dim*dim];
+    int use_normals = obj->flag[0] && obj->n_dir >= obj->n_pos;
+    if( use_normals ) {
+        /* weighted average of vertex normals, recompute all weights */
+        int *idx = &obj->flag[1+prepped->face_ids[best]*dim];
+        double *offset = &prepped->offset[best*dim];
+        double w0 = 1.0 - best_sum;
+        vectNd_scale(&obj->dir[idx[0]], w0, normal);
+        for(int i=1; i<dim; ++i) {
+            double *dual = &frame[i*dim];
+            double b = mesh_dot(dual, res->v, dim) - offset[i];
+            for(int k=0; k<dim; ++k)
+                normal->v[k] += b*obj->dir[idx[i]].v[k];
+        }
+        vectNd_unitize(normal);
+    } else {
+        /* face normal, pointing back toward the ray's origin */
+        double sign = (mesh_dot(frame, v->v, dim) > 0.0) ? -1.0 : 1.0;
+        for(int k=0; k<dim; ++k)
+            normal->v[k] = sign*frame[k];
+    }
+
+    if( ptr != NULL )
+        *ptr = obj;
+
+    return 1;
+}
@@ -11,7 +11,7 @@
 
 int type_name(char *name, int size);
 int params(object *obj, int *n_pos, int *n_dir, int *n_size, int *n_flags, int *n_obj);
-int get_bounds(object *obj);
+int get_bounds(object *obj, vectNd *center, double *radius);
 int cleanup(object *obj);
 int intersect(object *obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr);
 int get_color(object *obj, vectNd *at, double *red, double *green, double *blue);
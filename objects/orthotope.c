@@ -8,16 +8,20 @@
 #include <math.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include "object.h"
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct prepared_data {
     /* data that is ray invariant and can be pre-computed in prepare function */
-    vectNd *basis;
+    int n;              /* number of edges, flag[0] */
+    double *frame;      /* n x dim unit edges, orthonormal when gram is NULL */
+    double *FdP;        /* frame . pos[0] */
     double *lengths;
-    double *BdP;
-    double *BdB;
+    double *gram;       /* n x n frame . frame, only when edges aren't orthogonal */
+    double *plane;      /* unit normal when the orthotope is a hyperplane facet */
+    double PdP;         /* plane . pos[0] */
 } prepped_t;
 
 static int prepare(object *sub) {
@@ -27,21 +31,75 @@ static int prepare(object *sub) {
     if( !sub->prepared ) {
         prepped_t *prepped = calloc(1,sizeof(prepped_t));
 
-        int dim = sub->flag[0];
-        prepped->basis = calloc(dim,sizeof(vectNd));
-        prepped->lengths = calloc(dim,sizeof(double));
-        prepped->BdP = calloc(dim,sizeof(double));
-        prepped->BdB = calloc(dim,sizeof(double));
-        for(int i=0; i<dim; i++) {
-            /* get unitized basis vectors */
-            vectNd_alloc(&prepped->basis[i],sub->dir[0].n);
-            vectNd_copy(&prepped->basis[i],&sub->dir[i]);
-            vectNd_unitize(&prepped->basis[i]);
-
-            /* pre-compute lengths and dot products */
-            vectNd_l2norm(&sub->dir[i], &prepped->lengths[i]);
-            vectNd_dot(&prepped->basis[i], &prepped->basis[i], &prepped->BdB[i]);
-            vectNd_dot(&sub->pos[0], &prepped->basis[i], &prepped->BdP[i]);
+        int dim = sub->dimensions;
+        int n = sub->flag[0];
+        prepped->n = n;
+        prepped->frame = calloc(n*dim,sizeof(double));
+        prepped->FdP = calloc(n,sizeof(double));
+        prepped->lengths = calloc(n,sizeof(double));
+        for(int i=0; i<n; i++) {
+            /* get unitized edge vectors */
+            double *e = prepped->frame + i*dim;
+            memcpy(e, sub->dir[i].v, dim*sizeof(double));
+            double len = 0.0;
+            for(int k=0; k<dim; ++k)
+                len += e[k]*e[k];
+            len = sqrt(len);
+            prepped->lengths[i] = len;
+            for(int k=0; k<dim; ++k) {
+                e[k] /= len;
+                prepped->FdP[i] += e[k]*sub->pos[0].v[k];
+            }
+        }
+
+        /* keep the cross terms only if some pair isn't orthogonal */
+        double *gram = calloc(n*n,sizeof(double));
+        int orthogonal = 1;
+        for(int i=0; i<n; ++i) {
+            for(int j=0; j<n; ++j) {
+                double *ei = prepped->frame + i*dim;
+                double *ej = prepped->frame + j*dim;
+                double dot = 0.0;
+                for(int k=0; k<dim; ++k)
+                    dot += ei[k]*ej[k];
+                gram[i*n+j] = dot;
+                if( i != j && fabs(dot) > EPSILON )
+                    orthogonal = 0;
+            }
+        }
+        if( orthogonal ) {
+            free(gram); gram = NULL;
+        }
+        prepped->gram = gram;
+
+        if( n == dim-1 && prepped->gram == NULL ) {
+            /* normal is the largest residual of an axis against the frame */
+            prepped->plane = calloc(dim,sizeof(double));
+            double *r = calloc(dim,sizeof(double));
+            double best = -1.0;
+            for(int a=0; a<dim; ++a) {
+                memset(r, 0, dim*sizeof(double));
+                r[a] = 1.0;
+                for(int i=0; i<n; ++i) {
+                    double *e = prepped->frame + i*dim;
+                    for(int k=0; k<dim; ++k)
+                        r[k] -= e[a]*e[k];
+                }
+                double len = 0.0;
+                for(int k=0; k<dim; ++k)
+                    len += r[k]*r[k];
+                if( len > best ) {
+                    best = len;
+                    memcpy(prepped->plane, r, dim*sizeof(double));
+                }
+            }
+            free(r); r = NULL;
+
+            best = sqrt(best);
+            for(int k=0; k<dim; ++k) {
+                prepped->plane[k] /= best;
+                prepped->PdP += prepped->plane[k]*sub->pos[0].v[k];
+            }
         }
 
         sub->prepped = prepped;
@@ -58,14 +116,14 @@ int cleanup(object *sub) {
         return -1;
 
     prepped_t *prepped = sub->prepped;
-    int dim = sub->flag[0];
-    for(int i=0; i<dim; i++) {
-        vectNd_free(&prepped->basis[i]);
+    if( prepped ) {
+        free(prepped->frame); prepped->frame = NULL;
+        free(prepped->FdP); prepped->FdP = NULL;
+        free(prepped->lengths); prepped->lengths = NULL;
+        free(prepped->gram); prepped->gram = NULL;
+        free(prepped->plane); prepped->plane = NULL;
+        free(sub->prepped); sub->prepped = NULL;
     }
-    free(prepped->basis); prepped->basis = NULL;
-    free(prepped->lengths); prepped->lengths = NULL;
-    free(prepped->BdP); prepped->BdP = NULL;
-    free(prepped->BdB); prepped->BdB = NULL;
     return 0;
 }
 
@@ -119,184 +177,199 @@ int bounding_points(object *obj, bounds_list *list) {
     return 1;
 }
 
-static forceinline int within_orthotope(object *sub, vectNd *point) {
-    int dim  = point->n;
-    int n = sub->flag[0];
-    double scale;
-    prepped_t* prepped = (prepped_t*)sub->prepped;
-    double *lengths = prepped->lengths;
-    double *BdBs = prepped->BdB;
-    vectNd *basis = prepped->basis;
-    vectNd Bc;
+/* a parallelotope is symmetric about its center, so that is also the center
+ * of the smallest enclosing ball, and every corner is equally far from it
+ * when the edges are orthogonal */
+int get_bounds(object *obj, vectNd *center, double *radius) {
+    int n = obj->flag[0];
 
-    /* check length of projection onto each axis against axis length */
-    vectNd_alloc(&Bc,dim);
-    vectNd_sub(point,&sub->pos[0],&Bc);
+    double len2 = 0.0;
     for(int i=0; i<n; ++i) {
-        /* get scaling of basis[i] needed to project (point - pos[0]) onto basis[i] */
-        vectNd_dot(&Bc,&basis[i],&scale);
-        scale = scale / BdBs[i];
+        double dot = 0.0;
+        vectNd_dot(&obj->dir[i], &obj->dir[i], &dot);
+        len2 += dot;
+        for(int j=i+1; j<n; ++j) {
+            double other = 0.0, cross = 0.0;
+            vectNd_dot(&obj->dir[j], &obj->dir[j], &other);
+            vectNd_dot(&obj->dir[i], &obj->dir[j], &cross);
+            if( fabs(cross) > EPSILON*sqrt(dot*other) )
+                return -1;
+        }
+    }
+
+    vectNd_copy(center, &obj->pos[0]);
+    for(int i=0; i<n; ++i)
+        for(int k=0; k<center->n; ++k)
+            center->v[k] += 0.5*obj->dir[i].v[k];
+    *radius = 0.5*sqrt(len2);
+    return 0;
+}
+
+/* check that o+t*v lies within each edge's slab, given the per ray offsets
+ * (fo) and rates (fv) along each edge */
+static forceinline int within_orthotope(prepped_t *prepped, double *fo, double *fv, double t) {
+    int n = prepped->n;
+    double *lengths = prepped->lengths;
 
-        if( scale < -EPSILON || scale > lengths[i]+EPSILON ) {
-            vectNd_free(&Bc);
+    for(int i=0; i<n; ++i) {
+        double dist = fo[i] + t*fv[i];
+        if( dist < -EPSILON || dist > lengths[i]+EPSILON )
             return 0;
-        }
     }
-    vectNd_free(&Bc);
 
     return 1;   /* didn't violate any constraints */
 }
 
+/* per ray projections onto a set of n rows, relative to pos[0] */
+static forceinline void orthotope_project(double *rows, double *RdP, int n, int dim, vectNd *o, vectNd *v, double *ro, double *rv) {
+    for(int i=0; i<n; ++i) {
+        double *r = rows + i*dim;
+        double dot_o = 0.0, dot_v = 0.0;
+        for(int k=0; k<dim; ++k) {
+            dot_o += r[k]*o->v[k];
+            dot_v += r[k]*v->v[k];
+        }
+        ro[i] = dot_o - RdP[i];
+        rv[i] = dot_v;
+    }
+}
+
+/* remove the projections onto each of the edges from the quadratic, the
+ * cross terms only matter when the edges aren't orthogonal */
+static forceinline void orthotope_quadratic(prepped_t *prepped, double *fo, double *fv, double *qa, double *qb, double *qc) {
+    int n = prepped->n;
+    double *gram = prepped->gram;
+
+    if( gram == NULL ) {
+        for(int i=0; i<n; ++i) {
+            *qa -= fv[i]*fv[i];
+            *qb -= fv[i]*fo[i];
+            *qc -= fo[i]*fo[i];
+        }
+        return;
+    }
+
+    for(int i=0; i<n; ++i) {
+        double gv = 0.0, go = 0.0;
+        for(int j=0; j<n; ++j) {
+            gv += gram[i*n+j]*fv[j];
+            go += gram[i*n+j]*fo[j];
+        }
+        *qa += fv[i]*gv - 2*fv[i]*fv[i];
+        *qb += fv[i]*go - 2*fv[i]*fo[i];
+        *qc += fo[i]*go - 2*fo[i]*fo[i];
+    }
+}
+
 int intersect(object *sub, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr)
 {
     if( !sub->prepared ) {
         prepare(sub);
     }
 
+    prepped_t *prepped = (prepped_t*)sub->prepped;
     int ret = 0;
     int dim = sub->dimensions;
-    int flag0 = sub->flag[0];
-    double VdA, AdA;
-    double OdA, BdA;
-    double qa, qb, qc;
-    double t1, t2;
-    double det, detRoot;
-    prepped_t *prepped = (prepped_t*)sub->prepped;
-    double *BdBs = prepped->BdB;
-    double *BdPs = prepped->BdP;
-    vectNd *basis = prepped->basis;
-    vectNd *pos0 = &sub->pos[0];
-    vectNd P;
-    vectNd Q;
-    vectNd sum_A;
-    vectNd sA;
-
-    /* sum over all basis vectors */
-    vectNd_alloc(&P,dim);
-    vectNd_alloc(&Q,dim);
-    vectNd_alloc(&sA,dim);
-    vectNd_calloc(&sum_A,dim);
-    for(int i=0; i<flag0; ++i) {
-        AdA = BdBs[i];
-        vectNd_dot(v,&basis[i],&VdA);
-        vectNd_scale(&basis[i],VdA/AdA,&sA);
-        vectNd_add(&sum_A,&sA,&sum_A);
-    }   /* sum_A is now \sum Y_i */
-    vectNd_sub(&sum_A,v,&P);
-
-    vectNd_reset(&sum_A);
-    for(int i=0; i<flag0; ++i) {
-        BdA = BdPs[i];
-        AdA = BdBs[i];
-        vectNd_dot(o,&basis[i],&OdA);
-        vectNd_scale(&basis[i],(OdA-BdA)/AdA,&sA);
-        vectNd_add(&sum_A,&sA,&sum_A);
-    }   /* sum_A is now \sum X_i */
-    vectNd_sub(pos0,o,&Q);
-    vectNd_add(&Q,&sum_A,&Q);
-
-    /* solve quadratic */
-    vectNd_dot(&P,&P,&qa);
-    vectNd_dot(&P,&Q,&qb);
-    qb *= 2;    /* FOILed again! */
-    vectNd_dot(&Q,&Q,&qc);
-    qc -= EPSILON;
-
-    /* solve for t */
-    det = qb*qb - 4*qa*qc;
-    if( det >= 0.0 && fabs(qa)>EPSILON ) {
-        detRoot = sqrt(det);
-        double half_inv_qa = 0.5/qa;
-        t1 = (-qb + detRoot) * half_inv_qa;
-        t2 = (-qb - detRoot) * half_inv_qa;
-
-        /* pick which (if any) point to return */
-        if( t2>EPSILON ) {
-            vectNd_scale(v,t2,&sA);
-            vectNd_add(o,&sA,res);
-
-            /* do end test */
-            if( within_orthotope(sub, res) )
-                ret = 1;
+    int n = prepped->n;
+    double *pos0 = sub->pos[0].v;
+    double t = -1.0;
+
+    /* projections of the ray onto each of the edges, on the stack since
+     * this runs for every ray */
+    double proj[2*n];
+    double *fo = proj, *fv = proj + n;
+    orthotope_project(prepped->frame, prepped->FdP, n, dim, o, v, fo, fv);
+
+    if( prepped->plane ) {
+        /* hyperplane facet, so solve for the plane crossing directly */
+        double *plane = prepped->plane;
+        double PdO = -prepped->PdP, PdV = 0.0;
+        for(int k=0; k<dim; ++k) {
+            PdO += plane[k]*o->v[k];
+            PdV += plane[k]*v->v[k];
         }
 
-        if( ret==0 && t1>EPSILON ) {
-            vectNd_scale(v,t1,&sA);
-            vectNd_add(o,&sA,res);
-
-            /* do end test */
-            if( within_orthotope(sub, res) )
+        if( fabs(PdV) > EPSILON2 ) {
+            t = -PdO / PdV;
+            if( t > EPSILON && within_orthotope(prepped, fo, fv, t) ) {
+                for(int k=0; k<dim; ++k) {
+                    res->v[k] = o->v[k] + t*v->v[k];
+                    normal->v[k] = (PdO > 0.0) ? plane[k] : -plane[k];
+                }
                 ret = 1;
+            }
         }
-    }
-
-    if( ret == 0 ) {
-        double t=-1.0;
-        /* find value of t where o+v*t is closest to plane */
-        if( fabs(qa) < EPSILON ) {
-            /* equation is essentially qb*t + qc = 0 */
-            if( fabs(qb) < EPSILON )
-                t = -qc / qb;
-            else
-                t = -1.0;
-        }
-        else
-        {
-            /* find minumum for qa*t^2 + qb*t + qc */
-            /* find d/dt = 2*qa*t + qb = 0 */
-            t = -qb / (2*qa);
+    } else {
+        /* squared length of (o+t*v-pos[0]) less its projections onto each
+         * of the unit edges is qa*t^2 + qb*t + qc */
+        double qa = 0.0, qb = 0.0, qc = 0.0;
+        for(int k=0; k<dim; ++k) {
+            double w = o->v[k] - pos0[k];
+            qa += v->v[k]*v->v[k];
+            qb += v->v[k]*w;
+            qc += w*w;
         }
-        if( t < EPSILON ) {
-            /* hit is behind the viewer */
-            vectNd_free(&sum_A);
-            vectNd_free(&P);
-            vectNd_free(&Q);
-            vectNd_free(&sA);
-            return 0;
+        orthotope_quadratic(prepped, fo, fv, &qa, &qb, &qc);
+        qb *= 2;    /* FOILed again! */
+        qc -= EPSILON;
+
+        /* solve for t */
+        double det = qb*qb - 4*qa*qc;
+        if( det >= 0.0 && fabs(qa)>EPSILON ) {
+            double detRoot = sqrt(det);
+            double half_inv_qa = 0.5/qa;
+            double t1 = (-qb + detRoot) * half_inv_qa;
+            double t2 = (-qb - detRoot) * half_inv_qa;
+
+            /* pick which (if any) point to return */
+            if( t2>EPSILON && within_orthotope(prepped, fo, fv, t2) ) {
+                t = t2;
+                ret = 1;
+            } else if( t1>EPSILON && within_orthotope(prepped, fo, fv, t1) ) {
+                t = t1;
+                ret = 1;
+            }
         }
 
-        double dist = qa*t*t + qb*t + qc;
-        if( fabs(dist) > EPSILON ) {
-            /* closest point is too far from surface */
-            vectNd_free(&sum_A);
-            vectNd_free(&P);
-            vectNd_free(&Q);
-            vectNd_free(&sA);
-            return 0;
+        if( ret == 0 ) {
+            /* find value of t where o+v*t is closest to plane */
+            if( fabs(qa) < EPSILON ) {
+                /* equation is essentially qb*t + qc = 0 */
+                if( fabs(qb) > EPSILON )
+                    t = -qc / qb;
+                else
+                    t = -1.0;
+            }
+            else
+            {
+                /* find minumum for qa*t^2 + qb*t + qc */
+                /* find d/dt = 2*qa*t + qb = 0 */
+                t = -qb / (2*qa);
+            }
+
+            /* hit must be in front of the viewer, and close to the surface */
+            if( t >= EPSILON && fabs(qa*t*t + qb*t + qc) <= EPSILON
+                && within_orthotope(prepped, fo, fv, t) )
+                ret = 1;
         }
 
-        /* find intersection point */
-        vectNd_scale(v,t,&sA);
-        vectNd_add(o,&sA,res);
-
-        /* do end test */
-        if( within_orthotope(sub, res) )
-            ret = 1;
-    }
-
-    /* find normal */
-    if( ret != 0 ) {
-        /* get vector from bottom point to intersection point */
-        vectNd_sub(res,pos0,&P);
-
-        /* get sum of P projected onto each of the basis */
-        vectNd_reset(&Q);
-        for(int i=0; i<flag0; ++i) {
-            vectNd_proj(&P,&basis[i],&sA);
-            vectNd_add(&Q,&sA,&Q);
+        /* normal is res-pos[0] less its projections onto the edges */
+        if( ret != 0 ) {
+            for(int k=0; k<dim; ++k) {
+                res->v[k] = o->v[k] + t*v->v[k];
+                normal->v[k] = res->v[k] - pos0[k];
+            }
+            for(int i=0; i<n; ++i) {
+                double *e = prepped->frame + i*dim;
+                double along = fo[i] + t*fv[i];
+                for(int k=0; k<dim; ++k)
+                    normal->v[k] -= along*e[k];
+            }
         }
-
-        /* get vector from nearest axis point to intersection */
-        vectNd_sub(&P,&Q,normal);
-
-        if( ptr != NULL )
-            *ptr = sub;
     }
 
-    vectNd_free(&sum_A);
-    vectNd_free(&P);
-    vectNd_free(&Q);
-    vectNd_free(&sA);
+    if( ret != 0 && ptr != NULL )
+        *ptr = sub;
 
     return ret;
 }
@@ -54,6 +54,12 @@ int bounding_points(object *obj, bounds_list *list) {
     return 1;
 }
 
+int get_bounds(object *obj, vectNd *center, double *radius) {
+    vectNd_copy(center, &obj->pos[0]);
+    *radius = fabs(obj->size[0]);
+    return 0;
+}
+
 int intersect(object *obj, vectNd *o, vectNd *v, vectNd *res, vectNd *normal, object **ptr)
 {
     if( !obj->prepared ) {
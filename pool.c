@@ -0,0 +1,176 @@
+/*
+ * pool.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include "pool.h"
+
+/* take the next job, with the lock held */
+static pool_job_t *pool_pop(thread_pool_t *pool)
+{
+    pool_job_t *job = pool->head;
+    if( job != NULL ) {
+        pool->head = job->next;
+        if( pool->head == NULL )
+            pool->tail = NULL;
+    }
+    return job;
+}
+
+/* run job, with the lock held on entry and exit */
+static void pool_run(thread_pool_t *pool, pool_job_t *job)
+{
+    pthread_mutex_unlock(&pool->lock);
+    job->func(job->arg);
+    pthread_mutex_lock(&pool->lock);
+
+    if( job->group )
+        job->group->pending -= 1;
+    free(job);
+    pthread_cond_broadcast(&pool->done);
+}
+
+static void *pool_worker(void *arg)
+{
+    thread_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while( 1 ) {
+        pool_job_t *job = pool_pop(pool);
+        if( job != NULL ) {
+            pool_run(pool, job);
+            continue;
+        }
+        /* queue is drained before stopping */
+        if( pool->stop )
+            break;
+        pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* keep thread on one processor */
+static void pool_pin(pthread_t thr, int cpu)
+{
+    #ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if( pthread_setaffinity_np(thr, sizeof(set), &set) != 0 )
+        fprintf(stderr, "%s: failed to pin thread to processor %i.\n", __FUNCTION__, cpu);
+    #else
+    (void)thr;
+    (void)cpu;
+    #endif /* __linux__ */
+}
+
+/* start workers threads, pinning them and the caller to processors if pin */
+int pool_init(thread_pool_t *pool, int workers, int pin)
+{
+    memset(pool, '\0', sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    if( workers < 0 )
+        workers = 0;
+    pool->threads = calloc(workers > 0 ? workers : 1, sizeof(pthread_t));
+    if( pool->threads == NULL ) {
+        fprintf(stderr, "%s: failed to allocate %i threads.\n", __FUNCTION__, workers);
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if( cpus < 1 )
+        cpus = 1;
+    if( pin )
+        pool_pin(pthread_self(), 0);
+    for(int i=0; i<workers; ++i) {
+        if( pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0 ) {
+            fprintf(stderr, "%s: failed to start worker %i, continuing with %i.\n", __FUNCTION__, i, i);
+            break;
+        }
+        pool->num += 1;
+        if( pin )
+            pool_pin(pool->threads[i], (i+1) % cpus);
+    }
+
+    return pool->num;
+}
+
+/* run any queued jobs, then stop the workers */
+int pool_free(thread_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    /* with no workers, the caller drains the queue */
+    if( pool->num == 0 ) {
+        pool_job_t *job;
+        while( (job = pool_pop(pool)) != NULL )
+            pool_run(pool, job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i=0; i<pool->num; ++i)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, '\0', sizeof(*pool));
+
+    return 0;
+}
+
+/* queue func(arg), counted in group when it isn't NULL */
+int pool_submit(thread_pool_t *pool, pool_group_t *group, pool_func_t func, void *arg)
+{
+    pool_job_t *job = calloc(1, sizeof(pool_job_t));
+    if( job == NULL ) {
+        fprintf(stderr, "%s: failed to allocate job, running it now.\n", __FUNCTION__);
+        func(arg);
+        return -1;
+    }
+    job->func = func;
+    job->arg = arg;
+    job->group = group;
+
+    pthread_mutex_lock(&pool->lock);
+    if( group )
+        group->pending += 1;
+    if( pool->tail )
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* wait for group's jobs to finish, running queued jobs meanwhile */
+int pool_wait(thread_pool_t *pool, pool_group_t *group)
+{
+    pthread_mutex_lock(&pool->lock);
+    while( group->pending > 0 ) {
+        pool_job_t *job = pool_pop(pool);
+        if( job != NULL )
+            pool_run(pool, job);
+        else
+            pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * pool.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef POOL_H
+#define POOL_H
+#include <pthread.h>
+
+/* same shape as a pthread start routine, so thread functions run as jobs */
+typedef void *(*pool_func_t)(void *arg);
+
+typedef struct pool_job {
+    pool_func_t func;
+    void *arg;
+    struct pool_group *group;
+    struct pool_job *next;
+} pool_job_t;
+
+/* jobs that are waited for together */
+typedef struct pool_group {
+    int pending;
+} pool_group_t;
+
+/*
+ * Worker threads that live for the whole run, so frames and phases don't
+ * pay for thread startup.  A thread waiting on a group runs queued jobs
+ * itself, which lets jobs wait on jobs they submit, and lets a pool of
+ * zero workers run everything on the waiting thread.
+ */
+typedef struct thread_pool {
+    pthread_t *threads;
+    int num;
+    pool_job_t *head, *tail;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* a job was queued, or the pool is stopping */
+    pthread_cond_t done;    /* a job finished */
+} thread_pool_t;
+
+int pool_init(thread_pool_t *pool, int workers, int pin);
+int pool_free(thread_pool_t *pool);
+int pool_submit(thread_pool_t *pool, pool_group_t *group, pool_func_t func, void *arg);
+int pool_wait(thread_pool_t *pool, pool_group_t *group);
+#endif /* POOL_H */
@@ -0,0 +1,56 @@
+/*
+ * rng.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef RNG_H
+#define RNG_H
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Counter based random numbers.
+ *
+ * Each stream is keyed by (frame, pixel, sample), the n-th draw is a pure
+ * function of the key and n, so an image comes out the same no matter how
+ * many threads render it or in what order pixels are visited.
+ */
+typedef struct rng {
+    uint64_t key;
+    uint64_t counter;
+} rng_t;
+
+/* SplitMix64 finalizer */
+static inline uint64_t rng_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* bit pattern of a double, for keying streams on sample positions */
+static inline uint64_t rng_hash_double(double d) {
+    uint64_t bits;
+    d += 0.0;   /* fold -0.0 into 0.0 */
+    memcpy(&bits, &d, sizeof(bits));
+    return rng_mix(bits);
+}
+
+static inline void rng_seed(rng_t *rng, uint64_t frame, uint64_t pixel, uint64_t sample) {
+    uint64_t key = rng_mix(frame + 0x9e3779b97f4a7c15ULL);
+    key = rng_mix(key ^ pixel);
+    key = rng_mix(key ^ sample);
+    rng->key = key;
+    rng->counter = 0;
+}
+
+static inline uint64_t rng_next(rng_t *rng) {
+    rng->counter += 1;
+    return rng_mix(rng->key + rng->counter * 0x9e3779b97f4a7c15ULL);
+}
+
+/* uniform in [0,1) */
+static inline double rng_double(rng_t *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+#endif /* RNG_H */
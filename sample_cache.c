@@ -0,0 +1,109 @@
+/*
+ * sample_cache.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sample_cache.h"
+#include "rng.h"
+
+static inline uint64_t sample_hash(int64_t x, int64_t y)
+{
+    return rng_mix((uint64_t)x ^ rng_mix((uint64_t)y));
+}
+
+/* entry holding (x,y), or the empty one where it would go */
+static sample_entry_t *sample_slot(sample_entry_t *entries, int size, int epoch, int64_t x, int64_t y)
+{
+    uint64_t mask = size - 1;
+    uint64_t h = sample_hash(x, y) & mask;
+
+    while( entries[h].epoch == epoch ) {
+        if( entries[h].x == x && entries[h].y == y )
+            break;
+        h = (h + 1) & mask;
+    }
+
+    return &entries[h];
+}
+
+static int sample_cache_grow(sample_cache_t *cache)
+{
+    int size = cache->size > 0 ? cache->size*2 : 1024;
+    sample_entry_t *entries = calloc(size, sizeof(sample_entry_t));
+    if( entries == NULL ) {
+        fprintf(stderr, "%s: failed to allocate %i entries.\n", __FUNCTION__, size);
+        return -1;
+    }
+
+    for(int i=0; i<cache->size; ++i) {
+        sample_entry_t *old = &cache->entries[i];
+        if( old->epoch != cache->epoch )
+            continue;
+        *sample_slot(entries, size, cache->epoch, old->x, old->y) = *old;
+    }
+    free(cache->entries);
+    cache->entries = entries;
+    cache->size = size;
+
+    return 0;
+}
+
+/* forget every entry, and key new ones on a lattice of scale points per pixel */
+void sample_cache_clear(sample_cache_t *cache, double scale)
+{
+    cache->epoch += 1;
+    cache->num = 0;
+    cache->scale = scale;
+}
+
+void sample_cache_free(sample_cache_t *cache)
+{
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->size = 0;
+    cache->num = 0;
+}
+
+/*
+ * Entry for position (x,y).  When found is set it holds the position's
+ * colour, otherwise it has been added and the caller fills it in before the
+ * next call.  NULL when the cache is disabled or full.
+ */
+dbl_pixel_t *sample_cache_find(sample_cache_t *cache, double x, double y, int *found)
+{
+    *found = 0;
+    if( cache->scale <= 0.0 )
+        return NULL;
+
+    int64_t qx = llround(x * cache->scale);
+    int64_t qy = llround(y * cache->scale);
+
+    /* keep the table at most half full */
+    if( 2*(cache->num+1) > cache->size && cache->size < SAMPLE_CACHE_MAX )
+        sample_cache_grow(cache);
+    if( cache->size == 0 ) {
+        cache->misses += 1;
+        return NULL;
+    }
+
+    sample_entry_t *entry = sample_slot(cache->entries, cache->size, cache->epoch, qx, qy);
+    if( entry->epoch == cache->epoch ) {
+        cache->hits += 1;
+        *found = 1;
+        return &entry->clr;
+    }
+    cache->misses += 1;
+    if( 2*(cache->num+1) > cache->size )
+        return NULL;    /* full */
+
+    entry->x = qx;
+    entry->y = qy;
+    entry->epoch = cache->epoch;
+    cache->num += 1;
+
+    return &entry->clr;
+}
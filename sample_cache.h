@@ -0,0 +1,38 @@
+/*
+ * sample_cache.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef SAMPLE_CACHE_H
+#define SAMPLE_CACHE_H
+#include <stdint.h>
+#include "image.h"
+
+/* most entries a cache grows to, later points are traced uncached */
+#define SAMPLE_CACHE_MAX (1<<18)
+
+typedef struct sample_entry {
+    int64_t x, y;       /* lattice coordinate */
+    int epoch;          /* entry is live when it matches the cache's */
+    dbl_pixel_t clr;
+} sample_entry_t;
+
+/*
+ * Colours of subpixel positions, keyed by their coordinate on a lattice of
+ * scale points per pixel, so positions shared by neighbouring squares are
+ * traced once.  Clearing just bumps the epoch.
+ */
+typedef struct sample_cache {
+    sample_entry_t *entries;
+    int size;           /* power of two */
+    int num;
+    int epoch;
+    double scale;       /* lattice points per pixel, 0 disables the cache */
+    long hits, misses;
+} sample_cache_t;
+
+void sample_cache_clear(sample_cache_t *cache, double scale);
+void sample_cache_free(sample_cache_t *cache);
+dbl_pixel_t *sample_cache_find(sample_cache_t *cache, double x, double y, int *found);
+#endif /* SAMPLE_CACHE_H */
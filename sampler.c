@@ -0,0 +1,161 @@
+/*
+ * sampler.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <math.h>
+#include <strings.h>
+#include "sampler.h"
+
+static inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/* hash based nested uniform (Owen) scramble */
+/* see: Burley, Practical Hash-based Owen Scrambling, JCGT 2020 */
+static inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+/* second Sobol dimension, the first is just reverse_bits */
+static inline uint32_t sobol_dim1(uint32_t i) {
+    uint32_t r = 0;
+    for(uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+        if( i & 1 )
+            r ^= v;
+    return r;
+}
+
+/* hashed permutation of [0,len) */
+/* see: Kensler, Correlated Multi-Jittered Sampling, 2013 */
+static uint32_t permute(uint32_t i, uint32_t len, uint32_t p) {
+    uint32_t w = len - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p; i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8; i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1; i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11; i *= 0x74dcb303;
+        i ^= (i & w) >> 2; i *= 0x9e501cc3;
+        i ^= (i & w) >> 2; i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while( i >= len );
+    return (i + p) % len;
+}
+
+void sampler_start(sampler_t *smp, sampler_type_t type, uint64_t frame,
+                   uint64_t pixel, uint32_t index, uint32_t count)
+{
+    smp->type = type;
+    smp->key = rng_mix(rng_mix(frame + 0x9e3779b97f4a7c15ULL) ^ pixel);
+    smp->index = index;
+    smp->count = count;
+    smp->dim = 0;
+    rng_seed(&smp->rng, frame, pixel, index);
+}
+
+void sampler_get_2d(sampler_t *smp, double *u, double *v)
+{
+    uint64_t seed = rng_mix(smp->key + smp->dim);
+    smp->dim += 1;
+
+    switch( smp->type ) {
+        case SAMPLER_SOBOL: {
+            uint32_t i = owen_scramble(smp->index, (uint32_t)seed);
+            uint32_t x = owen_scramble(reverse_bits(i), (uint32_t)(seed >> 32));
+            uint32_t y = owen_scramble(sobol_dim1(i), (uint32_t)rng_mix(seed));
+            *u = x * (1.0 / 4294967296.0);
+            *v = y * (1.0 / 4294967296.0);
+            return;
+        }
+        case SAMPLER_STRATIFIED:
+            if( smp->count > 1 && smp->index < smp->count ) {
+                /* an m x rows grid with every cell used, m being the
+                 * largest factor of n up to its square root; a prime n
+                 * gives 1 x n, still stratified in both axes through the
+                 * sub-cell permutations */
+                uint32_t n = smp->count;
+                uint32_t m = (uint32_t)sqrt((double)n);
+                while( n % m != 0 )
+                    --m;
+                uint32_t rows = n / m;
+                uint32_t p = (uint32_t)seed;
+                uint32_t s = permute(smp->index, n, p * 0x51633e2d);
+                uint32_t sx = permute(s % m, m, p * 0xa511e9b3);
+                uint32_t sy = permute(s / m, rows, p * 0x63d83595);
+                double jx = rng_double(&smp->rng);
+                double jy = rng_double(&smp->rng);
+                *u = ((s % m) + (sy + jx) / rows) / m;
+                *v = ((s / m) + (sx + jy) / m) / rows;
+                return;
+            }
+            /* more samples than planned, fall back to random */
+            break;
+        case SAMPLER_RANDOM:
+        default:
+            break;
+    }
+
+    *u = rng_double(&smp->rng);
+    *v = rng_double(&smp->rng);
+}
+
+/* see: Shirley and Chiu, A Low Distortion Map Between Disk and Square, 1997 */
+void sampler_disk(double u, double v, double *x, double *y)
+{
+    double a = 2.0 * u - 1.0;
+    double b = 2.0 * v - 1.0;
+    double r, phi;
+
+    if( a == 0.0 && b == 0.0 ) {
+        *x = *y = 0.0;
+        return;
+    }
+
+    if( fabs(a) > fabs(b) ) {
+        r = a;
+        phi = (M_PI / 4.0) * (b / a);
+    } else {
+        r = b;
+        phi = (M_PI / 2.0) - (M_PI / 4.0) * (a / b);
+    }
+    *x = r * cos(phi);
+    *y = r * sin(phi);
+}
+
+int sampler_parse(char *str, sampler_type_t *type)
+{
+    if( strcasecmp(str, "random") == 0 || strcasecmp(str, "r") == 0 ) {
+        *type = SAMPLER_RANDOM;
+    } else if( strcasecmp(str, "stratified") == 0 || strcasecmp(str, "t") == 0 ) {
+        *type = SAMPLER_STRATIFIED;
+    } else if( strcasecmp(str, "sobol") == 0 || strcasecmp(str, "s") == 0 ) {
+        *type = SAMPLER_SOBOL;
+    } else {
+        fprintf(stderr, "%s: unknown sampler '%s'.\n", __FUNCTION__, str);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * sampler.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef SAMPLER_H
+#define SAMPLER_H
+#include <stdint.h>
+#include "rng.h"
+
+typedef enum sampler_type {
+    SAMPLER_RANDOM,     /* independent uniform samples */
+    SAMPLER_STRATIFIED, /* correlated multi-jittered over the pixel's samples */
+    SAMPLER_SOBOL,      /* Owen scrambled, index shuffled (0,2) sequence */
+} sampler_type_t;
+
+/*
+ * Supplies the 2d sample points for one camera sample.
+ *
+ * Each call to sampler_get_2d moves to the next dimension pair (pixel,
+ * lens, then one per area light per bounce), every pair of every pixel is
+ * decorrelated by its own scramble.
+ */
+typedef struct sampler {
+    sampler_type_t type;
+    uint64_t key;       /* per pixel decorrelation */
+    uint32_t index;     /* which of the pixel's samples this is */
+    uint32_t count;     /* samples planned for the pixel (for stratified) */
+    uint32_t dim;       /* next dimension pair */
+    rng_t rng;
+} sampler_t;
+
+void sampler_start(sampler_t *smp, sampler_type_t type, uint64_t frame,
+                   uint64_t pixel, uint32_t index, uint32_t count);
+void sampler_get_2d(sampler_t *smp, double *u, double *v);
+
+/* map [0,1)^2 onto the unit disk, preserving stratification */
+void sampler_disk(double u, double v, double *x, double *y);
+
+int sampler_parse(char *str, sampler_type_t *type);
+#endif /* SAMPLER_H */
@@ -4,6 +4,7 @@
  *
  * Copyright (c) 2019-2021 Bryan Franklin. All rights reserved.
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -194,6 +195,79 @@ int scene_prepare_light(light *lgt)
     return 0;
 }
 
+/* build the frame's light views, returning how many or -1 */
+int scene_light_views_init(scene *scn, light_view_t **views)
+{
+    int num = scn->num_lights;
+    int dim = scn->dimensions;
+
+    *views = calloc(num > 0 ? num : 1, sizeof(light_view_t));
+    if( *views == NULL ) {
+        fprintf(stderr, "%s: failed to allocate %i light views.\n", __FUNCTION__, num);
+        return -1;
+    }
+
+    for(int i=0; i<num; ++i) {
+        light *lgt = scn->lights[i];
+        light_view_t *lv = &(*views)[i];
+
+        if( lgt->prepared == 0 )
+            scene_prepare_light(lgt);
+
+        lv->type = lgt->type;
+        vectNd_calloc(&lv->pos, dim);
+        vectNd_calloc(&lv->dir, dim);
+        vectNd_calloc(&lv->u1, dim);
+        vectNd_calloc(&lv->v1, dim);
+        if( lgt->pos.n == dim )
+            vectNd_copy(&lv->pos, &lgt->pos);
+        if( (lgt->type == LIGHT_DIRECTIONAL || lgt->type == LIGHT_SPOT)
+            && lgt->dir.n == dim ) {
+            vectNd_copy(&lv->dir, &lgt->dir);
+            vectNd_unitize(&lv->dir);
+        }
+        if( lgt->type == LIGHT_DISK || lgt->type == LIGHT_RECT ) {
+            vectNd_scale(&lgt->u1, lgt->radius, &lv->u1);
+            vectNd_scale(&lgt->v1, lgt->radius, &lv->v1);
+        }
+
+        /* angle is in degrees, a cone of 180 or more lets everything in */
+        lv->cos_angle = lgt->angle >= 180.0 ? -2.0 : cos(lgt->angle * M_PI / 180.0);
+
+        lv->red = lgt->red;
+        lv->green = lgt->green;
+        lv->blue = lgt->blue;
+        lv->max_light = lgt->red;
+        if( lgt->green > lv->max_light )
+            lv->max_light = lgt->green;
+        if( lgt->blue > lv->max_light )
+            lv->max_light = lgt->blue;
+        if( lv->max_light != 0.0 ) {
+            lv->red_n = lgt->red / lv->max_light;
+            lv->green_n = lgt->green / lv->max_light;
+            lv->blue_n = lgt->blue / lv->max_light;
+        }
+    }
+
+    return num;
+}
+
+int scene_light_views_free(light_view_t *views, int num)
+{
+    if( views == NULL )
+        return 0;
+
+    for(int i=0; i<num; ++i) {
+        vectNd_free(&views[i].pos);
+        vectNd_free(&views[i].dir);
+        vectNd_free(&views[i].u1);
+        vectNd_free(&views[i].v1);
+    }
+    free(views);
+
+    return 0;
+}
+
 static vectNd sort_pos;
 
 int scene_sort_compar(const void *a, const void *b)
@@ -255,9 +329,12 @@ int scene_cluster(scene *scn, int k)
         return -1;
     }
 
-    /* create a cluster for finite objects */
+    /* create a cluster for finite objects, k<=0 builds bottom-up instead of
+     * by k-means */
     object *finite = object_alloc(scn->dimensions, "cluster", "finite");
     object_add_flag(finite, k);
+    if( k <= 0 )
+        object_add_flag(finite, CLUSTER_BUILD_MORTON);
 
     /* create a second cluster for infinite objects */
     object *infinite = object_alloc(scn->dimensions, "cluster", "infinite");
@@ -1637,6 +1714,7 @@ static int scene_yaml_parse_object(yaml_parser_t *parser, object **obj) {
     yaml_event_t event;
     object *tmp = calloc(1,sizeof(object));
     char typeStr[OBJ_TYPE_MAX_LEN] = "unspecified";
+    char meshFile[PATH_MAX] = "";
     int dimensions=0;
     while( !done ) {
         /* Get the next event. */
@@ -1679,6 +1757,8 @@ static int scene_yaml_parse_object(yaml_parser_t *parser, object **obj) {
                     scene_yaml_parse_subobjects(parser, tmp);
                 } else if( strcasecmp("bounds", value) == 0 ) {
                     scene_yaml_parse_bounds(parser, tmp);
+                } else if( strcasecmp("file", value) == 0 ) {
+                    scene_yaml_parse_string(parser, meshFile, sizeof(meshFile));
                 } else {
                     fprintf(stderr,"%s: Unhandled key '%s'.\n", __FUNCTION__, value);
                 }
@@ -1723,6 +1803,8 @@ static int scene_yaml_parse_object(yaml_parser_t *parser, object **obj) {
     for(int i=0; i<tmp->n_obj; ++i)
         object_add_obj(*obj, tmp->obj[i]);
     tmp->n_obj = tmp->cap_obj = 0;  /* prevent removal objects referenced by *obj */
+    if( meshFile[0] != '\0' )
+        object_load_mesh(*obj, meshFile);
 
     if( object_validate(*obj) < 0 ) {
         fprintf(stderr, "%s: loaded %s failed to validate.\n", __FUNCTION__, typeStr);
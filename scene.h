@@ -48,6 +48,19 @@ typedef struct light_t
     char name[LIGHT_NAME_MAX_LEN];
 } light;
 
+/* per-frame shading copy of a light, with what doesn't change between
+ * hits (unit direction, cone cosine, area basis) worked out once */
+typedef struct light_view {
+    light_type type;
+    vectNd pos;
+    vectNd dir;         /* unit, for directional and spot lights */
+    vectNd u1, v1;      /* area light basis, scaled by radius */
+    double cos_angle;   /* cosine of a spot light's cone angle */
+    double red, green, blue;
+    double max_light;   /* brightest channel */
+    double red_n, green_n, blue_n;  /* colour over max_light, for specular */
+} light_view_t;
+
 typedef struct scene_t
 {
     int dimensions;
@@ -69,6 +82,8 @@ int scene_alloc_light(scene *scn, light **lgt);
 int scene_free_light(light *lgt);
 int scene_aim_light(light *lgt, vectNd *target);
 int scene_prepare_light(light *lgt);
+int scene_light_views_init(scene *scn, light_view_t **views);
+int scene_light_views_free(light_view_t *views, int num);
 int scene_validate_objects(scene *scn);
 int scene_cluster(scene *scn, int k);
 int scene_print(scene *scn);
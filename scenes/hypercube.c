@@ -28,7 +28,8 @@ static int num_n_faces(int n, int m) {
     return (1<<(n-m)) * choose(n, m);
 }
 
-static int add_faces(object *cube, int m) {
+/* finite_edges bounds the hcylinder faces, which are otherwise infinite */
+static int add_faces(object *cube, int m, int finite_edges) {
     int n = cube->dimensions;
     int num_faces = num_n_faces(n, m);
     vectNd dir;
@@ -37,7 +38,7 @@ static int add_faces(object *cube, int m) {
     vectNd_calloc(&pos, n);
 
     if( m > 0 )
-        add_faces(cube, m-1);
+        add_faces(cube, m-1, finite_edges);
 
     printf("Adding %i-dimensional faces.\n", m);
 
@@ -93,7 +94,7 @@ static int add_faces(object *cube, int m) {
             obj = object_alloc(cube->dimensions, "hcylinder", "");
             snprintf(obj->name, sizeof(obj->name), "'edge' %i", f);
             object_add_size(obj, EDGE_SIZE + (n-m) * (EDGE_SIZE*0.05 + EPSILON) );
-            object_add_flag(obj, m);
+            object_add_flag(obj, finite_edges ? 0 : m);
 
             for(int i=0; i<m; ++i) {
                 vectNd_set(&pos, dirs_count[i], -CUBE_SIZE/2.0);
@@ -214,16 +215,19 @@ int scene_setup(scene *scn, int dimensions, int frame, int frames, char *config)
 {
     double t = frame/(double)frames;
     int use_hcube = 0;
+    int use_instance = 0;
     int with_walls = 0;
 
     /* process options */
     if( config && strstr("hcube", config) )
         use_hcube = 1;
+    if( config && strstr("instance", config) )
+        use_instance = 1;
     if( config && strstr("walls", config) )
         with_walls = 1;
 
-    printf("config: %s; use_hcube: %i, with_walls: %i\n",
-        config?config:"null", use_hcube, with_walls);
+    printf("config: %s; use_hcube: %i, use_instance: %i, with_walls: %i\n",
+        config?config:"null", use_hcube, use_instance, with_walls);
 
     /* determine name of scene */
     char *prefix = "hypercube";
@@ -231,6 +235,8 @@ int scene_setup(scene *scn, int dimensions, int frame, int frames, char *config)
     char scene_name[64];
     if( use_hcube )
         prefix = "hcube";
+    if( use_instance )
+        prefix = "instance";
     if( with_walls )
         suffix = "-reflect";
     snprintf(scene_name, sizeof(scene_name), "%s%s", prefix, suffix);
@@ -384,11 +390,57 @@ int scene_setup(scene *scn, int dimensions, int frame, int frames, char *config)
         obj->red = 0.0;
         obj->green = 0.0;
         obj->blue = 0.8;
+    } else if( use_instance ) {
+        /* build the faces once as a prototype, and place copies of it with
+         * instances, so rotating only touches an instance's transform */
+        object *proto = object_alloc(dimensions, "cluster", "hypercube prototype");
+        object_add_flag(proto, 2*dimensions);
+        add_faces(proto, dimensions-1, 1);
+
+        vectNd temp;
+        vectNd_calloc(&temp,dimensions);
+
+        /* small copies resting on the floor, in their own colours */
+        double scale = 0.3;
+        double rest = -CUBE_SIZE*1.5 + scale*CUBE_SIZE*sqrt(dimensions)/2.0;
+        char *small_pos[] = { "5,0,-25,0", "-25,0,5,0" };
+        for(int c=0; c<2; ++c) {
+            scene_alloc_object(scn,dimensions,&obj,"instance");
+            snprintf(obj->name, sizeof(obj->name), "small hypercube %i", c);
+            vectNd_reset(&temp);
+            vectNd_setStr(&temp, small_pos[c]);
+            vectNd_set(&temp, 1, rest);
+            object_add_pos(obj, &temp);
+            for(int i=0; i<dimensions; ++i) {
+                vectNd_reset(&temp);
+                vectNd_set(&temp, i, scale);
+                object_add_dir(obj, &temp);
+            }
+            object_add_flag(obj, 1);
+            obj->red = c==0 ? 0.8 : 0.0;
+            obj->green = c==0 ? 0.0 : 0.8;
+            obj->blue = 0.0;
+            object_add_obj(obj, object_share(proto));
+        }
+
+        /* full size copy, rotated below */
+        scene_alloc_object(scn,dimensions,&obj,"instance");
+        snprintf(obj->name, sizeof(obj->name), "the hypercube");
+        vectNd_reset(&temp);
+        object_add_pos(obj, &temp);
+        for(int i=0; i<dimensions; ++i) {
+            vectNd_reset(&temp);
+            vectNd_set(&temp, i, 1.0);
+            object_add_dir(obj, &temp);
+        }
+        vectNd_free(&temp);
+        object_add_flag(obj, 0);
+        object_add_obj(obj, proto);
     } else {
         /* add all of the faces for a (hyper)cube */
         scene_alloc_object(scn,dimensions,&obj,"cluster");
         object_add_flag(obj, 2*dimensions);
-        add_faces(obj, dimensions-1);
+        add_faces(obj, dimensions-1, 0);
     }
 
     /* rotate (hyper)cube */
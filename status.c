@@ -0,0 +1,197 @@
+/*
+ * status.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "status.h"
+#include "timing.h"
+#include "image.h"
+
+static inline long status_load(long *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* replace the status file, via a rename so pollers never see half of it */
+static int status_write(render_status_t *status, long done, long total,
+                        double elapsed, double remaining)
+{
+    char tmp_name[4096];
+    double frame_secs = 0.0;
+    long pixels = status_load(&status->pixels);
+    long rays = status_load(&status->rays);
+    long samples = status_load(&status->samples);
+
+    timer_elapsed(&status->frame_timer, &frame_secs);
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", status->file);
+    FILE *fp = fopen(tmp_name, "w");
+    if( fp == NULL ) {
+        fprintf(stderr, "%s: unable to write '%s'.\n", __FUNCTION__, tmp_name);
+        return -1;
+    }
+
+    fprintf(fp, "frame=%i\n", status->frame);
+    fprintf(fp, "phase=%s\n", status->phase ? status->phase : "idle");
+    fprintf(fp, "done=%ld\n", done);
+    fprintf(fp, "total=%ld\n", total);
+    fprintf(fp, "percent=%.2f\n", total > 0 ? 100.0*done/total : 0.0);
+    fprintf(fp, "phase_seconds=%.3f\n", elapsed);
+    fprintf(fp, "eta_seconds=%.3f\n", remaining);
+    fprintf(fp, "frame_seconds=%.3f\n", frame_secs);
+    fprintf(fp, "pixels=%ld\n", pixels);
+    fprintf(fp, "rays=%ld\n", rays);
+    fprintf(fp, "samples=%ld\n", samples);
+    fprintf(fp, "pixels_per_second=%.1f\n", frame_secs > 0 ? pixels/frame_secs : 0.0);
+    fprintf(fp, "rays_per_second=%.1f\n", frame_secs > 0 ? rays/frame_secs : 0.0);
+    fclose(fp);
+
+    if( rename(tmp_name, status->file) != 0 ) {
+        fprintf(stderr, "%s: unable to replace '%s'.\n", __FUNCTION__, status->file);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* report the current phase, with the lock held */
+static void status_report(render_status_t *status)
+{
+    long done = status_load(&status->done);
+    long total = status->total;
+    double elapsed = 0.0;
+    double remaining = -1.0;
+
+    timer_elapsed(&status->phase_timer, &elapsed);
+    if( status->phase != NULL && done > 0 && done <= total )
+        remaining = elapsed * (total - done) / done;
+
+    if( status->print && status->phase != NULL ) {
+        int saves = image_active_saves();
+        double percent = total > 0 ? 100.0*done/total : 0.0;
+        int len = 0;
+        if( saves > 0 ) {
+            len = printf("\r% 6.2f%%  (%i active save%s)", percent, saves, (saves==1)?"":"s");
+        } else if( remaining >= 0 ) {
+            double rays = status_load(&status->rays);
+            double frame_secs = 0.0;
+            timer_elapsed(&status->frame_timer, &frame_secs);
+            len = printf("\r% 6.2f%% (%.2fs remaining, %.3g rays/s)", percent,
+                         remaining, frame_secs > 0 ? rays/frame_secs : 0.0);
+        } else {
+            len = printf("\r% 6.2f%%", percent);
+        }
+        /* blank what is left of a longer line */
+        if( len < status->shown )
+            printf("%*s", status->shown - len, "");
+        status->shown = MAX(len, status->shown);
+        fflush(stdout);
+    }
+
+    if( status->file != NULL )
+        status_write(status, done, total, elapsed, remaining);
+}
+
+static void *status_thread(void *arg)
+{
+    render_status_t *status = arg;
+
+    pthread_mutex_lock(&status->lock);
+    while( status->running ) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        double secs = floor(status->interval);
+        long nsec = wake.tv_nsec + (long)((status->interval - secs) * 1e9);
+        wake.tv_sec += (time_t)secs + nsec / 1000000000L;
+        wake.tv_nsec = nsec % 1000000000L;
+        pthread_cond_timedwait(&status->wake, &status->lock, &wake);
+
+        if( status->running && status->phase != NULL )
+            status_report(status);
+    }
+    pthread_mutex_unlock(&status->lock);
+
+    return NULL;
+}
+
+/* start reporting every interval seconds, to file when it isn't NULL and
+ * to the console when print is set */
+int status_start(render_status_t *status, char *file, double interval, int print)
+{
+    memset(status, '\0', sizeof(*status));
+    status->file = file;
+    status->print = print;
+    status->interval = interval > 0 ? MIN(interval, STATUS_MAX_INTERVAL) : STATUS_DEFAULT_INTERVAL;
+    status->running = 1;
+    timer_start(&status->phase_timer);
+    timer_start(&status->frame_timer);
+    pthread_mutex_init(&status->lock, NULL);
+    pthread_cond_init(&status->wake, NULL);
+
+    if( pthread_create(&status->thread, NULL, status_thread, status) != 0 ) {
+        fprintf(stderr, "%s: failed to start the reporter thread.\n", __FUNCTION__);
+        status->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int status_stop(render_status_t *status)
+{
+    pthread_mutex_lock(&status->lock);
+    int running = status->running;
+    status->running = 0;
+    pthread_cond_signal(&status->wake);
+    pthread_mutex_unlock(&status->lock);
+
+    if( running )
+        pthread_join(status->thread, NULL);
+    pthread_cond_destroy(&status->wake);
+    pthread_mutex_destroy(&status->lock);
+
+    return 0;
+}
+
+/* reset the frame totals for a new frame */
+void status_frame(render_status_t *status, int frame)
+{
+    pthread_mutex_lock(&status->lock);
+    status->frame = frame;
+    __atomic_store_n(&status->pixels, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&status->rays, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&status->samples, 0, __ATOMIC_RELAXED);
+    timer_start(&status->frame_timer);
+    pthread_mutex_unlock(&status->lock);
+}
+
+/* begin a phase of total units of work */
+void status_phase(render_status_t *status, const char *phase, long total)
+{
+    pthread_mutex_lock(&status->lock);
+    status->phase = phase;
+    status->total = total;
+    __atomic_store_n(&status->done, 0, __ATOMIC_RELAXED);
+    timer_start(&status->phase_timer);
+    pthread_mutex_unlock(&status->lock);
+}
+
+/* end the phase, once this returns nothing more is printed for it */
+void status_phase_end(render_status_t *status)
+{
+    pthread_mutex_lock(&status->lock);
+    status->phase = NULL;
+    if( status->shown > 0 ) {
+        printf("\r%*s\r", status->shown, "");
+        fflush(stdout);
+        status->shown = 0;
+    }
+    if( status->file != NULL )
+        status_write(status, status_load(&status->done), status->total, 0.0, 0.0);
+    pthread_mutex_unlock(&status->lock);
+}
@@ -0,0 +1,63 @@
+/*
+ * status.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef STATUS_H
+#define STATUS_H
+#include <pthread.h>
+#include <sys/time.h>
+
+/* seconds between reports unless asked otherwise */
+#define STATUS_DEFAULT_INTERVAL 0.5
+/* longest wait between reports, keeps the wake up time representable */
+#define STATUS_MAX_INTERVAL 3600.0
+
+/*
+ * Progress of the frame being rendered.  Workers add to the counters with
+ * atomic adds and never take a lock; a reporter thread turns them into
+ * throughput and an ETA for the console and, optionally, a status file a
+ * job scheduler can poll.
+ */
+typedef struct render_status {
+    /* work of the current phase, in the phase's own units */
+    long done;
+    long total;
+
+    /* frame totals */
+    long pixels;
+    long rays;
+    long samples;
+
+    const char *phase;      /* NULL between phases */
+    int frame;
+    struct timeval phase_timer;
+    struct timeval frame_timer;
+
+    /* reporter */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;
+    int print;              /* show progress on the console */
+    int shown;              /* width of the progress line on screen */
+    double interval;
+    char *file;             /* status file, NULL for none */
+} render_status_t;
+
+int status_start(render_status_t *status, char *file, double interval, int print);
+int status_stop(render_status_t *status);
+void status_frame(render_status_t *status, int frame);
+void status_phase(render_status_t *status, const char *phase, long total);
+void status_phase_end(render_status_t *status);
+
+static inline void status_add(render_status_t *status, long done, long pixels,
+                              long rays, long samples)
+{
+    __atomic_fetch_add(&status->done, done, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&status->pixels, pixels, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&status->rays, rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&status->samples, samples, __ATOMIC_RELAXED);
+}
+#endif /* STATUS_H */
@@ -0,0 +1,147 @@
+/*
+ * tiles.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "tiles.h"
+
+typedef struct tile_key {
+    uint32_t code;
+    render_tile_t tile;
+} tile_key_t;
+
+/* interleave the bits of x and y */
+static uint32_t morton2(uint32_t x, uint32_t y)
+{
+    uint32_t code = 0;
+    for(int b=0; b<16; ++b) {
+        code |= ((x >> b) & 1u) << (2*b);
+        code |= ((y >> b) & 1u) << (2*b+1);
+    }
+    return code;
+}
+
+static int tile_key_compar(const void *a, const void *b)
+{
+    uint32_t ca = ((const tile_key_t*)a)->code;
+    uint32_t cb = ((const tile_key_t*)b)->code;
+    return (ca > cb) - (ca < cb);
+}
+
+int tile_sched_init(tile_sched_t *sched, int width, int height, int size, int threads)
+{
+    memset(sched, '\0', sizeof(*sched));
+    if( size < 1 )
+        size = TILE_DEFAULT_SIZE;
+    if( threads < 1 )
+        threads = 1;
+
+    int cols = (width + size - 1) / size;
+    int rows = (height + size - 1) / size;
+    int num = cols * rows;
+
+    tile_key_t *keys = calloc(num > 0 ? num : 1, sizeof(tile_key_t));
+    sched->tiles = calloc(num > 0 ? num : 1, sizeof(render_tile_t));
+    sched->queues = calloc(threads, sizeof(tile_deque_t));
+    if( keys == NULL || sched->tiles == NULL || sched->queues == NULL ) {
+        fprintf(stderr, "%s: failed to allocate %i tiles.\n", __FUNCTION__, num);
+        free(keys);
+        free(sched->tiles); sched->tiles = NULL;
+        free(sched->queues); sched->queues = NULL;
+        return -1;
+    }
+
+    for(int j=0; j<rows; ++j) {
+        for(int i=0; i<cols; ++i) {
+            tile_key_t *key = &keys[j*cols+i];
+            key->code = morton2(i, j);
+            key->tile.x = i*size;
+            key->tile.y = j*size;
+            key->tile.w = width - key->tile.x < size ? width - key->tile.x : size;
+            key->tile.h = height - key->tile.y < size ? height - key->tile.y : size;
+        }
+    }
+    qsort(keys, num, sizeof(tile_key_t), tile_key_compar);
+    for(int t=0; t<num; ++t)
+        sched->tiles[t] = keys[t].tile;
+    free(keys);
+    sched->num_tiles = num;
+
+    /* contiguous runs of the curve, one per thread */
+    sched->num_queues = threads;
+    for(int k=0; k<threads; ++k) {
+        tile_deque_t *q = &sched->queues[k];
+        q->first = (int)((long)num * k / threads);
+        q->last = (int)((long)num * (k+1) / threads);
+        pthread_mutex_init(&q->lock, NULL);
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    tile_sched_reset(sched);
+
+    return num;
+}
+
+int tile_sched_free(tile_sched_t *sched)
+{
+    if( sched->queues ) {
+        for(int k=0; k<sched->num_queues; ++k)
+            pthread_mutex_destroy(&sched->queues[k].lock);
+        pthread_mutex_destroy(&sched->lock);
+    }
+    free(sched->queues);
+    free(sched->tiles);
+    memset(sched, '\0', sizeof(*sched));
+
+    return 0;
+}
+
+/* hand every tile out again, for another pass over the image */
+int tile_sched_reset(tile_sched_t *sched)
+{
+    for(int k=0; k<sched->num_queues; ++k) {
+        tile_deque_t *q = &sched->queues[k];
+        q->head = q->first;
+        q->tail = q->last;
+    }
+    sched->done = 0;
+
+    return 0;
+}
+
+/* next tile for thread thr, stolen from another thread once its own run
+ * is empty, or -1 when none are left */
+int tile_sched_next(tile_sched_t *sched, int thr)
+{
+    int t = -1;
+    int stolen = 0;
+
+    tile_deque_t *own = &sched->queues[thr % sched->num_queues];
+    pthread_mutex_lock(&own->lock);
+    if( own->head < own->tail )
+        t = own->head++;
+    pthread_mutex_unlock(&own->lock);
+
+    for(int k=1; t < 0 && k<sched->num_queues; ++k) {
+        tile_deque_t *victim = &sched->queues[(thr + k) % sched->num_queues];
+        pthread_mutex_lock(&victim->lock);
+        if( victim->head < victim->tail ) {
+            t = --victim->tail;
+            stolen = 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if( t >= 0 ) {
+        pthread_mutex_lock(&sched->lock);
+        sched->done += 1;
+        sched->steals += stolen;
+        pthread_mutex_unlock(&sched->lock);
+    }
+
+    return t;
+}
@@ -0,0 +1,48 @@
+/*
+ * tiles.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef TILES_H
+#define TILES_H
+#include <pthread.h>
+
+/* default pixels per tile edge */
+#define TILE_DEFAULT_SIZE 16
+
+typedef struct render_tile {
+    int x, y;           /* top left pixel */
+    int w, h;
+} render_tile_t;
+
+/* one thread's run of tiles [head,tail), taken from the head by their
+ * owner and from the tail by idle threads */
+typedef struct tile_deque {
+    int head, tail;
+    int first, last;    /* the thread's whole run, for refilling */
+    pthread_mutex_t lock;
+} tile_deque_t;
+
+/*
+ * Tiles of an image, ordered along a Morton curve and split into one
+ * contiguous run per thread, so each thread works a compact area and
+ * steals from the others once its own run is done.
+ */
+typedef struct tile_sched {
+    render_tile_t *tiles;
+    int num_tiles;
+    tile_deque_t *queues;
+    int num_queues;
+
+    /* progress, guarded by lock */
+    int done;
+    long steals;
+    pthread_mutex_t lock;
+} tile_sched_t;
+
+int tile_sched_init(tile_sched_t *sched, int width, int height, int size, int threads);
+int tile_sched_free(tile_sched_t *sched);
+int tile_sched_reset(tile_sched_t *sched);
+int tile_sched_next(tile_sched_t *sched, int thr);
+#endif /* TILES_H */
@@ -22,17 +22,3 @@ int timer_elapsed(struct timeval *tv, double *elapsed)
 
     return 0;
 }
-
-double timer_remaining(struct timeval *tv, double curr, double total) {
-    if( total <= 0 )
-        return -1.0;    /* invalid total */
-    if( curr <= 0 || curr > total ) {
-        return -2.0;    /* curr outside valid range */
-    }
-    double progress = curr / total;
-    double elapsed;
-    timer_elapsed(tv,&elapsed);
-    double est_total = (elapsed / progress);
-    double ret = (1-progress) * est_total;
-    return ret;
-}
@@ -8,4 +8,3 @@
 
 int timer_start(struct timeval *tv);
 int timer_elapsed(struct timeval *tv, double *elapsed);
-double timer_remaining(struct timeval *tv, double curr, double total);
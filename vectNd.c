@@ -12,6 +12,8 @@
 #include "vectNd.h"
 #include "matrix.h"
 
+__thread unsigned long vectNd_allocs = 0;
+
 /* this requires dimmensions-1 vectors */
 int vectNd_cross(vectNd *vects, vectNd *res)
 {
@@ -101,17 +103,23 @@ int vectNd_angle3(vectNd *p1, vectNd *p2, vectNd *p3, double *angle)
 int vectNd_reflect(vectNd *u, vectNd *n, vectNd *res, double mag)
 {
     /* see: http://www.unc.edu/~marzuola/Math547_S13/Math547_S13_Projects/P_Smith_Section001_RayTracing.pdf */
-    vectNd nnu; /* norm * (norm . look) */
     double nu; /* norm . look */
     double nn; /* norm . norm (missing from source material) */
 
     vectNd_dot(n, u, &nu);  /* n . u */
     vectNd_dot(n, n, &nn);  /* n . n */
-    vectNd_alloc(&nnu,u->n);
-    vectNd_scale(n, (1+mag)*nu/nn, &nnu); /* 2*(n.nu) * n */
-    vectNd_sub(u, &nnu, res); /* u - 2*(n.nu) * n */
 
-    vectNd_free(&nnu);
+    /* u - 2*(n.nu) * n, one element at a time so res needs no temporary */
+    double s = (1+mag)*nu/nn;
+    #if defined(__SSE__) && !defined(WITHOUT_SSE)
+    int k=(u->n+1)>>1;
+    __m128d ss = _mm_set1_pd(s);
+    for(int i=0; i<k; ++i)
+        vectNd_SSE(res)[i] = _mm_sub_pd(vectNd_SSE(u)[i],_mm_mul_pd(vectNd_SSE(n)[i],ss));
+    #else
+    for(int i=0; i<u->n; ++i)
+        res->v[i] = u->v[i] - n->v[i]*s;
+    #endif /* __SSE__ */
 
     return VECTND_SUCCESS;
 }
@@ -121,24 +129,26 @@ int vectNd_refract(vectNd *u, vectNd *n, vectNd *res, double index)
     /* see: http://en.wikipedia.org/wiki/Snell's_law */
     int dim = u->n;
 
-    /* get angle of incidence */
-    vectNd rev_u;
-    vectNd rev_n;
-    vectNd_alloc(&rev_u,dim);
-    vectNd_alloc(&rev_n,dim);
-    vectNd_scale(u,-1,&rev_u);
-    vectNd_scale(n,-1,&rev_n);
+    /* get angle of incidence, between -u and whichever of n and -n is on
+     * its side */
     double un_dot;
-    vectNd_dot(&rev_u,n,&un_dot);
+    vectNd_dot(u,n,&un_dot);
+    un_dot = -un_dot;
+    double len_u, len_n;
+    vectNd_l2norm(u,&len_u);
+    vectNd_l2norm(n,&len_n);
 
     /* compute refraction angle */
-    double theta_in;
+    double theta_in = -1;
+    double div = len_u*len_n;
     if( un_dot < 0 ) {
         /* invert index if we're on the other side of normal */
         index = 1/index;
-        vectNd_angle(&rev_u,&rev_n,&theta_in);
+        if( fabs(div) > EPSILON )
+            theta_in = acos(-un_dot / div);
     } else {
-        vectNd_angle(&rev_u,n,&theta_in);
+        if( fabs(div) > EPSILON )
+            theta_in = acos(un_dot / div);
     }
 
     double theta_out;
@@ -150,39 +160,30 @@ int vectNd_refract(vectNd *u, vectNd *n, vectNd *res, double index)
         theta_out = M_PI - theta_in;
     }
 
-    /* get vector perpendicular to normal */
-    vectNd_unitize(&rev_n);
+    /* get unit vector perpendicular to normal, in res */
     vectNd_unitize(n);
-    vectNd un;
-    vectNd np;
-    vectNd_alloc(&un,dim);
-    vectNd_alloc(&np,dim);
-    vectNd_proj_unit(u,&rev_n,&un);
-    vectNd_sub(u,&un,&np);
-    vectNd_unitize(&np);
-
-    /* get refraction vector */
+    vectNd_proj_unit(u,n,res);
+    vectNd_sub(u,res,res);
+    vectNd_unitize(res);
+
+    /* get refraction vector, normal part along n or -n */
     double rn;
     double rp;
     rn = cos(theta_out);
     rp = sin(theta_out);
-    vectNd ref_n;
-    vectNd ref_p;
-    vectNd_alloc(&ref_n,dim);
-    vectNd_alloc(&ref_p,dim);
-    if( un_dot < 0 )
-        vectNd_scale(n,rn,&ref_n);
-    else
-        vectNd_scale(&rev_n,rn,&ref_n);
-    vectNd_scale(&np,rp,&ref_p);
-
-    vectNd_add(&ref_n,&ref_p,res);
-    vectNd_free(&un);
-    vectNd_free(&np);
-    vectNd_free(&ref_n);
-    vectNd_free(&ref_p);
-    vectNd_free(&rev_n);
-    vectNd_free(&rev_u);
+    if( un_dot >= 0 )
+        rn = -rn;
+    #if defined(__SSE__) && !defined(WITHOUT_SSE)
+    int k=(dim+1)>>1;
+    __m128d sn = _mm_set1_pd(rn);
+    __m128d sp = _mm_set1_pd(rp);
+    for(int i=0; i<k; ++i)
+        vectNd_SSE(res)[i] = _mm_add_pd(_mm_mul_pd(vectNd_SSE(n)[i],sn),
+                                        _mm_mul_pd(vectNd_SSE(res)[i],sp));
+    #else
+    for(int i=0; i<dim; ++i)
+        res->v[i] = n->v[i]*rn + res->v[i]*rp;
+    #endif /* __SSE__ */
 
     return VECTND_SUCCESS;
 }
@@ -121,11 +121,16 @@ static forceinline int vectNd_setStr(vectNd *v, char *str)
     return VECTND_SUCCESS;
 }
 
+/* heap allocations made by vectNd_alloc in the calling thread, so hot
+ * loops can check that they don't allocate */
+extern __thread unsigned long vectNd_allocs;
+
 static forceinline int vectNd_alloc(vectNd *v, int dim)
 {
     v->n = dim;
     if( dim > VECTND_DEF_SIZE ) {
         int alloc_dim = dim;
+        ++vectNd_allocs;
         #if defined(__SSE__) && !defined(WITHOUT_SSE)
         alloc_dim += alloc_dim&1;   /* make even if needed */
         #endif /* __SSE__ */
@@ -330,11 +335,29 @@ static forceinline void vectNd_unitize(vectNd *v)
 
 static forceinline void vectNd_dist(vectNd *v1, vectNd *v2, double *res)
 {
-    vectNd diff;
-    vectNd_alloc(&diff,v1->n);
-    vectNd_sub(v1,v2,&diff);
-    vectNd_l2norm(&diff,res);
-    vectNd_free(&diff);
+    /* same as vectNd_sub then vectNd_l2norm, without a temporary */
+    #if defined(__SSE__) && !defined(WITHOUT_SSE)
+    int k=(v1->n+1)>>1;
+    int i;
+    __m128d diff;
+    __m128d sums;
+    diff = _mm_sub_pd(vectNd_SSE(v1)[0],vectNd_SSE(v2)[0]);
+    sums = _mm_mul_pd(diff,diff);
+    for(i=1; i<k; ++i) {
+        diff = _mm_sub_pd(vectNd_SSE(v1)[i],vectNd_SSE(v2)[i]);
+        sums = _mm_add_pd(sums,_mm_mul_pd(diff,diff));
+    }
+    *res = sqrt(sums[0]+sums[1]);
+    #else /* __SSE__ */
+    int dim = v1->n;
+    double sum = 0.0;
+    int i;
+    for(i=0; i<dim; ++i) {
+        double diff = v1->v[i] - v2->v[i];
+        sum += diff*diff;
+    }
+    *res = sqrt(sum);
+    #endif /* __SSE__ */
 }
 
 static forceinline void vectNd_copy(vectNd *dst, vectNd *src)
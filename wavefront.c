@@ -0,0 +1,91 @@
+/*
+ * wavefront.c
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wavefront.h"
+
+/* grow an aligned array from old to size elements of elem bytes */
+static int grow_array(void **ptr, int old, int size, size_t elem)
+{
+    void *mem = NULL;
+    if( posix_memalign(&mem, 16, size*elem) != 0 ) {
+        fprintf(stderr, "%s: failed to allocate %i elements.\n", __FUNCTION__, size);
+        return -1;
+    }
+    /* zero fill so odd dimension padding stays zero for SSE */
+    memset(mem, '\0', size*elem);
+    if( *ptr != NULL ) {
+        memcpy(mem, *ptr, old*elem);
+        free(*ptr);
+    }
+    *ptr = mem;
+
+    return 0;
+}
+
+static int ray_queue_grow(ray_queue_t *queue, int size)
+{
+    int old = queue->size;
+    size_t vect = queue->stride*sizeof(double);
+
+    if( grow_array((void**)&queue->src, old, size, vect) < 0
+        || grow_array((void**)&queue->look, old, size, vect) < 0
+        || grow_array((void**)&queue->hit, old, size, vect) < 0
+        || grow_array((void**)&queue->normal, old, size, vect) < 0
+        || grow_array((void**)&queue->r, old, size, sizeof(double)) < 0
+        || grow_array((void**)&queue->g, old, size, sizeof(double)) < 0
+        || grow_array((void**)&queue->b, old, size, sizeof(double)) < 0
+        || grow_array((void**)&queue->frac, old, size, sizeof(double)) < 0
+        || grow_array((void**)&queue->depth, old, size, sizeof(int)) < 0
+        || grow_array((void**)&queue->path, old, size, sizeof(int)) < 0
+        || grow_array((void**)&queue->obj, old, size, sizeof(object*)) < 0 )
+        return -1;
+    queue->size = size;
+
+    return 0;
+}
+
+int ray_queue_init(ray_queue_t *queue, int dim, int size)
+{
+    memset(queue, '\0', sizeof(*queue));
+    queue->dim = dim;
+    queue->stride = dim + (dim&1);
+
+    if( size < 1 )
+        size = 1;
+    return ray_queue_grow(queue, size);
+}
+
+int ray_queue_free(ray_queue_t *queue)
+{
+    free(queue->src);
+    free(queue->look);
+    free(queue->hit);
+    free(queue->normal);
+    free(queue->r);
+    free(queue->g);
+    free(queue->b);
+    free(queue->frac);
+    free(queue->depth);
+    free(queue->path);
+    free(queue->obj);
+    memset(queue, '\0', sizeof(*queue));
+
+    return 0;
+}
+
+/* append a ray, returning its index */
+int ray_queue_push(ray_queue_t *queue)
+{
+    if( queue->num >= queue->size ) {
+        if( ray_queue_grow(queue, queue->size*2) < 0 )
+            return -1;
+    }
+
+    return queue->num++;
+}
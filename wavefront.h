@@ -0,0 +1,49 @@
+/*
+ * wavefront.h
+ * ndt: n-dimensional tracer
+ *
+ * Copyright (c) 2021 Bryan Franklin. All rights reserved.
+ */
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+#include "vectNd.h"
+#include "object.h"
+
+/*
+ * A batch of rays in structure of arrays form.
+ *
+ * Vectors are stored back to back with an even stride (so SSE loads stay
+ * aligned), and are handed to the vectNd functions through
+ * ray_queue_vect views rather than copies.
+ */
+typedef struct ray_queue {
+    int num;
+    int size;
+    int dim;
+    int stride;
+
+    /* rays */
+    double *src;
+    double *look;
+    double *r, *g, *b;  /* weight of the ray's colour in its path */
+    double *frac;       /* share of the pixel, for pruning */
+    int *depth;         /* remaining reflection/refraction depth */
+    int *path;          /* path the ray belongs to */
+
+    /* intersections, filled in by the intersect stage */
+    double *hit;
+    double *normal;
+    object **obj;
+} ray_queue_t;
+
+int ray_queue_init(ray_queue_t *queue, int dim, int size);
+int ray_queue_free(ray_queue_t *queue);
+int ray_queue_push(ray_queue_t *queue);
+
+/* point v at row i of one of queue's vector arrays */
+static inline void ray_queue_vect(ray_queue_t *queue, double *base, int i, vectNd *v)
+{
+    v->v = base + (size_t)i*queue->stride;
+    v->n = queue->dim;
+}
+#endif /* WAVEFRONT_H */